@@ -0,0 +1,211 @@
+/*
+ * Copyright (C) 2012 by Tomasz Moń <desowin@gmail.com>
+ *
+ * Arena for frame sized buffers, on huge pages where possible.
+ *
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright
+ * notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+ * OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name of a copyright holder shall not
+ * be used in advertising or otherwise to promote the sale, use or other dealings
+ * in this Software without prior written authorization of the copyright holder.
+ */
+
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "arena.h"
+
+#define MAX_CHUNKS 64
+
+struct chunk
+{
+    uint8_t *base;              /* NULL if the slot is unused */
+    size_t size;
+    size_t used;                /* blocks are handed out bottom up */
+    unsigned int live;          /* blocks not freed yet */
+    int hugetlb;
+};
+
+static struct chunk chunks[MAX_CHUNKS];
+static unsigned int arena_flags = 0;
+static int mlock_failed = 0;
+static pthread_mutex_t arena_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t round_up(size_t v, size_t to)
+{
+    return (v + to - 1) / to * to;
+}
+
+/* Takes the page faults now rather than on the first frames */
+static void prefault(uint8_t * p, size_t size)
+{
+    size_t i;
+
+#ifdef MADV_POPULATE_WRITE
+    if (0 == madvise(p, size, MADV_POPULATE_WRITE))
+        return;
+#endif
+
+    for (i = 0; i < size; i += ARENA_ALIGN)
+        ((volatile uint8_t *)p)[i] = 0;
+}
+
+/* Transparent huge pages only back 2 MiB aligned ranges */
+static uint8_t *map_aligned(size_t size)
+{
+    uint8_t *raw, *p;
+    size_t head;
+
+    raw = mmap(NULL, size + ARENA_HUGE_PAGE, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (MAP_FAILED == raw)
+        return NULL;
+
+    p = (uint8_t *) round_up((uintptr_t) raw, ARENA_HUGE_PAGE);
+    head = p - raw;
+
+    if (head)
+        munmap(raw, head);
+    if (ARENA_HUGE_PAGE - head)
+        munmap(p + size, ARENA_HUGE_PAGE - head);
+
+#ifdef MADV_HUGEPAGE
+    /* Fails where THP is not built in, plain pages do then */
+    madvise(p, size, MADV_HUGEPAGE);
+#endif
+
+    prefault(p, size);
+
+    return p;
+}
+
+static int map_chunk(struct chunk *c, size_t size)
+{
+    void *p;
+
+    memset(c, 0, sizeof(*c));
+
+    /* Only succeeds if enough pages are reserved in nr_hugepages */
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+
+    if (MAP_FAILED != p)
+    {
+        c->hugetlb = 1;
+    }
+    else
+    {
+        p = map_aligned(size);
+
+        if (!p)
+            return -1;
+    }
+
+    if ((arena_flags & ARENA_MLOCK) && mlock(p, size) && !mlock_failed)
+    {
+        fprintf(stderr, "Cannot lock frame buffers in memory: %s\n",
+                strerror(errno));
+        mlock_failed = 1;
+    }
+
+    c->base = p;
+    c->size = size;
+
+    return 0;
+}
+
+void arena_init(unsigned int flags)
+{
+    arena_flags = flags;
+}
+
+void *arena_alloc(size_t size)
+{
+    struct chunk *c = NULL;
+    void *p = NULL;
+    unsigned int i;
+
+    size = round_up(size ? size : 1, ARENA_ALIGN);
+
+    pthread_mutex_lock(&arena_lock);
+
+    for (i = 0; i < MAX_CHUNKS && !c; i++)
+        if (chunks[i].base && chunks[i].size - chunks[i].used >= size)
+            c = &chunks[i];
+
+    for (i = 0; i < MAX_CHUNKS && !c; i++)
+        if (!chunks[i].base)
+        {
+            if (map_chunk(&chunks[i], round_up(size, ARENA_HUGE_PAGE)))
+                goto out;
+
+            c = &chunks[i];
+        }
+
+    if (!c)
+    {
+        errno = ENOMEM;
+        goto out;
+    }
+
+    p = c->base + c->used;
+    c->used += size;
+    c->live++;
+
+  out:
+    pthread_mutex_unlock(&arena_lock);
+
+    return p;
+}
+
+void arena_free(void *p)
+{
+    unsigned int i;
+
+    if (!p)
+        return;
+
+    pthread_mutex_lock(&arena_lock);
+
+    for (i = 0; i < MAX_CHUNKS; i++)
+    {
+        struct chunk *c = &chunks[i];
+
+        if (!c->base || (uint8_t *) p < c->base ||
+            (uint8_t *) p >= c->base + c->used)
+            continue;
+
+        if (0 == --c->live)
+        {
+            munmap(c->base, c->size);
+            c->base = NULL;
+        }
+
+        break;
+    }
+
+    assert(i < MAX_CHUNKS);
+
+    pthread_mutex_unlock(&arena_lock);
+}
@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2012 by Tomasz Moń <desowin@gmail.com>
+ *
+ * Arena for frame sized buffers, on huge pages where possible.
+ *
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright
+ * notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+ * OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name of a copyright holder shall not
+ * be used in advertising or otherwise to promote the sale, use or other dealings
+ * in this Software without prior written authorization of the copyright holder.
+ */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/* Every block starts on a page, which also suits USERPTR i/o */
+#define ARENA_ALIGN 4096
+
+/* Chunks come in multiples of this, the x86-64 huge page size */
+#define ARENA_HUGE_PAGE (2UL << 20)
+
+/* arena_init() flags */
+#define ARENA_MLOCK 1           /* lock chunks in memory, best effort */
+
+/*
+ * Frame buffers are carved from chunks of anonymous memory, explicit huge
+ * pages (MAP_HUGETLB) if any are reserved, otherwise transparent ones
+ * asked for with MADV_HUGEPAGE. Chunks are faulted in when mapped, so the
+ * first frames do not pay for it, and unmapped once all their blocks were
+ * freed. Blocks come zeroed.
+ */
+void arena_init(unsigned int flags);
+
+/* Returns NULL with errno set on failure */
+void *arena_alloc(size_t size);
+
+void arena_free(void *p);
+
+#endif /* ARENA_H */
@@ -0,0 +1,136 @@
+/*
+ * Copyright (C) 2012 by Tomasz Moń <desowin@gmail.com>
+ *
+ * Adaptive V4L2 capture queue depth.
+ *
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright
+ * notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+ * OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name of a copyright holder shall not
+ * be used in advertising or otherwise to promote the sale, use or other dealings
+ * in this Software without prior written authorization of the copyright holder.
+ */
+
+#include "bufq.h"
+
+/* Frames per evaluation window */
+#define BUFQ_WINDOW 30
+
+/* Calm windows before giving one buffer back */
+#define BUFQ_CALM_WINDOWS 4
+
+void bufq_init(struct bufq *q, unsigned int min, unsigned int max,
+               unsigned int start)
+{
+    q->min = min;
+    q->max = max > min ? max : min;
+    q->target = start < q->min ? q->min : start > q->max ? q->max : start;
+
+    q->started = 0;
+    q->interval_ns = 0;
+    q->jitter_ns = 0;
+    q->frames = 0;
+    q->calm = 0;
+
+    q->dropped = 0;
+    q->grown = 0;
+    q->shrunk = 0;
+}
+
+static void bufq_grow(struct bufq *q, unsigned int n)
+{
+    q->calm = 0;
+
+    while (n-- && q->target < q->max)
+    {
+        q->target++;
+        q->grown++;
+    }
+}
+
+static void bufq_window(struct bufq *q)
+{
+    /* Dequeues arrive in bursts: someone sat on the buffers */
+    if (q->jitter_ns * 2 > q->interval_ns)
+    {
+        bufq_grow(q, 1);
+        return;
+    }
+
+    if (q->jitter_ns * 8 > q->interval_ns)
+    {
+        q->calm = 0;
+        return;
+    }
+
+    if (++q->calm >= BUFQ_CALM_WINDOWS && q->target > q->min)
+    {
+        q->target--;
+        q->shrunk++;
+        q->calm = 0;
+    }
+}
+
+unsigned int bufq_dequeued(struct bufq *q, uint32_t sequence, uint64_t now_ns)
+{
+    int64_t d, dev;
+    uint32_t gap;
+
+    if (!q->started)
+    {
+        q->started = 1;
+        q->sequence = sequence;
+        q->last_ns = now_ns;
+        return q->target;
+    }
+
+    gap = sequence - q->sequence - 1;
+    q->sequence = sequence;
+
+    /* Ignore sequence resets, e.g. after STREAMOFF */
+    if (gap != 0 && gap < 0x80000000u)
+    {
+        q->dropped += gap;
+        bufq_grow(q, gap > 2 ? 2 : gap);
+    }
+
+    d = now_ns - q->last_ns;
+    q->last_ns = now_ns;
+
+    if (q->interval_ns == 0)
+        q->interval_ns = d;
+
+    dev = d - q->interval_ns;
+    if (dev < 0)
+        dev = -dev;
+
+    q->interval_ns += (d - q->interval_ns) / 8;
+    q->jitter_ns += (dev - q->jitter_ns) / 8;
+
+    if (++q->frames >= BUFQ_WINDOW)
+    {
+        q->frames = 0;
+        bufq_window(q);
+    }
+
+    return q->target;
+}
+
+void bufq_limit(struct bufq *q, unsigned int max)
+{
+    q->max = max > q->min ? max : q->min;
+
+    if (q->target > q->max)
+        q->target = q->max;
+}
@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2012 by Tomasz Moń <desowin@gmail.com>
+ *
+ * Adaptive V4L2 capture queue depth.
+ *
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright
+ * notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+ * OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name of a copyright holder shall not
+ * be used in advertising or otherwise to promote the sale, use or other dealings
+ * in this Software without prior written authorization of the copyright holder.
+ */
+
+#ifndef BUFQ_H
+#define BUFQ_H
+
+#include <stdint.h>
+
+/*
+ * Decides how many buffers should circulate between the driver and the
+ * application. Gaps in the buffer sequence numbers mean the driver had
+ * nothing queued to capture into, so the queue grows at once. Bursty
+ * dequeue intervals mean the consumer falls behind now and then, so it
+ * grows by one per window. After several calm windows it shrinks again.
+ */
+struct bufq
+{
+    unsigned int min;
+    unsigned int max;
+    unsigned int target;
+
+    int started;
+    uint32_t sequence;
+    uint64_t last_ns;
+    int64_t interval_ns;        /* smoothed dequeue interval */
+    int64_t jitter_ns;          /* smoothed deviation from it */
+
+    unsigned int frames;        /* dequeued in the current window */
+    unsigned int calm;          /* consecutive windows with headroom */
+
+    unsigned long dropped;
+    unsigned int grown;
+    unsigned int shrunk;
+};
+
+void bufq_init(struct bufq *q, unsigned int min, unsigned int max,
+               unsigned int start);
+
+/*
+ * Feeds one dequeued buffer, now_ns is CLOCK_MONOTONIC at DQBUF time.
+ * Returns the number of buffers that should be circulating from now on.
+ */
+unsigned int bufq_dequeued(struct bufq *q, uint32_t sequence, uint64_t now_ns);
+
+/* Caps the queue at max buffers, e.g. when allocating more failed */
+void bufq_limit(struct bufq *q, unsigned int max);
+
+#endif /* BUFQ_H */
@@ -0,0 +1,743 @@
+/*
+ * Copyright (C) 2012 by Tomasz Moń <desowin@gmail.com>
+ *
+ * Standalone benchmark of the colorspace conversion kernels.
+ *
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright
+ * notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+ * OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name of a copyright holder shall not
+ * be used in advertising or otherwise to promote the sale, use or other dealings
+ * in this Software without prior written authorization of the copyright holder.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>             /* getopt_long() */
+#include <time.h>
+
+#include "convert.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>          /* __rdtsc() */
+#define HAVE_RDTSC 1
+#endif
+
+struct frame
+{
+    size_t width;
+    size_t height;
+    size_t pixels;
+
+    uint8_t *yuyv;              /* synthetic input */
+    uint8_t *ref;               /* YCbCrToRGB() of yuyv, RGB24 */
+    uint16_t *ref565;           /* ref through RGB888_to_RGB565() */
+    uint16_t *ref565_v4l2;      /* same in V4L2_PIX_FMT_RGB565X */
+    uint32_t *rgb888;           /* ref as 0xRRGGBB */
+
+    uint8_t *nv12;              /* second synthetic input, 4:2:0 */
+    uint8_t *nv21;              /* the same in the other 4:2:0 layouts */
+    uint8_t *i420;
+    uint8_t *ref420;            /* YCbCrToRGB() of nv12, RGB24 */
+    uint16_t *ref420_565;
+
+    uint8_t *rgb24;
+    uint16_t *rgb565;
+    uint16_t *rgb565_v4l2;
+    uint8_t *half;
+};
+
+struct kernel
+{
+    const char *name;
+    int simd;                   /* runs once per kernel set */
+    size_t bytes;               /* read and written per pixel */
+    void (*run) (struct frame * f);
+    size_t (*check) (const struct frame * f);   /* returns bad pixels */
+    void (*prepare) (struct frame * f); /* before the first run, or NULL */
+};
+
+/* 1366 is not a multiple of any vector width, it runs the tail code */
+static size_t sizes[][2] = {
+    {320, 240},
+    {640, 480},
+    {1280, 720},
+    {1366, 768},
+    {1920, 1080},
+    {3840, 2160},
+};
+
+#define N_SIZES (sizeof(sizes) / sizeof(sizes[0]))
+
+static double min_time = 0.25;
+
+static void *xmalloc(size_t size)
+{
+    void *p = malloc(size);
+
+    if (!p)
+    {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    return p;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t cycles(void)
+{
+#ifdef HAVE_RDTSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+/* Deterministic noise, hits every Y, Cb, Cr value including clamping */
+static uint32_t xorshift32(uint32_t * state)
+{
+    uint32_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+
+    return *state = x;
+}
+
+static void frame_alloc(struct frame *f, size_t width, size_t height)
+{
+    uint32_t seed = 0x12345678;
+    size_t i;
+
+    f->width = width;
+    f->height = height;
+    f->pixels = width * height;
+
+    f->yuyv = xmalloc(f->pixels * 2);
+    f->ref = xmalloc(f->pixels * 3);
+    f->ref565 = xmalloc(f->pixels * 2);
+    f->ref565_v4l2 = xmalloc(f->pixels * 2);
+    f->rgb888 = xmalloc(f->pixels * 4);
+    f->rgb24 = xmalloc(f->pixels * 3);
+    f->rgb565 = xmalloc(f->pixels * 2);
+    f->rgb565_v4l2 = xmalloc(f->pixels * 2);
+    f->half = xmalloc(f->pixels / 2);
+    f->nv12 = xmalloc(f->pixels * 3 / 2);
+    f->nv21 = xmalloc(f->pixels * 3 / 2);
+    f->i420 = xmalloc(f->pixels * 3 / 2);
+    f->ref420 = xmalloc(f->pixels * 3);
+    f->ref420_565 = xmalloc(f->pixels * 2);
+
+    for (i = 0; i < f->pixels * 2; i += 4)
+    {
+        uint32_t v = xorshift32(&seed);
+
+        memcpy(f->yuyv + i, &v, 4);
+    }
+
+    for (i = 0; i < f->pixels; i++)
+    {
+        const uint8_t *p = f->yuyv + (i & ~(size_t) 1) * 2;
+        uint8_t *rgb = f->ref + i * 3;
+
+        YCbCrToRGB(p[(i & 1) * 2], p[1], p[3], &rgb[0], &rgb[1], &rgb[2]);
+
+        f->rgb888[i] = rgb[0] << 16 | rgb[1] << 8 | rgb[2];
+        f->ref565[i] = RGB888_to_RGB565(f->rgb888[i]);
+        f->ref565_v4l2[i] = RGB565X_swap_green(f->ref565[i]);
+    }
+
+    for (i = 0; i < f->pixels * 3 / 2; i += 4)
+    {
+        uint32_t v = xorshift32(&seed);
+
+        memcpy(f->nv12 + i, &v, 4);
+    }
+
+    /* Same samples, Y plane first in every layout */
+    memcpy(f->nv21, f->nv12, f->pixels);
+    memcpy(f->i420, f->nv12, f->pixels);
+
+    for (i = 0; i < f->pixels / 4; i++)
+    {
+        const uint8_t *uv = f->nv12 + f->pixels + i * 2;
+
+        f->nv21[f->pixels + i * 2] = uv[1];
+        f->nv21[f->pixels + i * 2 + 1] = uv[0];
+        f->i420[f->pixels + i] = uv[0];
+        f->i420[f->pixels + f->pixels / 4 + i] = uv[1];
+    }
+
+    for (i = 0; i < f->pixels; i++)
+    {
+        size_t row = i / width, col = i % width;
+        const uint8_t *uv = f->nv12 + f->pixels + row / 2 * width +
+            col / 2 * 2;
+        uint8_t *rgb = f->ref420 + i * 3;
+
+        YCbCrToRGB(f->nv12[i], uv[0], uv[1], &rgb[0], &rgb[1], &rgb[2]);
+
+        f->ref420_565[i] = RGB888_to_RGB565(rgb[0] << 16 | rgb[1] << 8 |
+                                            rgb[2]);
+    }
+}
+
+static void frame_free(struct frame *f)
+{
+    free(f->yuyv);
+    free(f->ref);
+    free(f->ref565);
+    free(f->ref565_v4l2);
+    free(f->rgb888);
+    free(f->rgb24);
+    free(f->rgb565);
+    free(f->rgb565_v4l2);
+    free(f->half);
+    free(f->nv12);
+    free(f->nv21);
+    free(f->i420);
+    free(f->ref420);
+    free(f->ref420_565);
+}
+
+static int off_by(int a, int b, int tolerance)
+{
+    return a - b > tolerance || b - a > tolerance;
+}
+
+/*
+ * Red and blue have to match YCbCrToRGB() exactly. Green may be 1 off,
+ * the fixed point paths round a handful of inputs the other way.
+ */
+static size_t check_rgb24(const uint8_t * out, const uint8_t * ref,
+                          size_t pixels)
+{
+    size_t i, bad = 0;
+
+    for (i = 0; i < pixels; i++, out += 3, ref += 3)
+    {
+        if (out[0] != ref[0] || off_by(out[1], ref[1], 1) || out[2] != ref[2])
+            bad++;
+    }
+
+    return bad;
+}
+
+/* Undoes the byte swap of RGB888_to_RGB565() */
+static uint16_t rgb565_native(uint16_t px)
+{
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+    return (px >> 8) | (px << 8);
+#else
+    return px;
+#endif
+}
+
+static size_t check_rgb565(const uint16_t * out, const uint16_t * ref,
+                           size_t pixels)
+{
+    size_t i, bad = 0;
+
+    for (i = 0; i < pixels; i++)
+    {
+        uint16_t a = rgb565_native(out[i]);
+        uint16_t b = rgb565_native(ref[i]);
+
+        if ((a & 0xF81F) != (b & 0xF81F) ||
+            off_by((a >> 5) & 0x3F, (b >> 5) & 0x3F, 1))
+            bad++;
+    }
+
+    return bad;
+}
+
+static void run_YUV422_to_RGB(struct frame *f)
+{
+    size_t i;
+
+    for (i = 0; i < f->pixels; i += 2)
+        YUV422_to_RGB(f->rgb24 + i * 3, f->yuyv + i * 2);
+}
+
+static void run_YUV422_to_RGB565(struct frame *f)
+{
+    size_t i;
+
+    for (i = 0; i < f->pixels; i += 2)
+        YUV422_to_RGB565(f->rgb565 + i, f->yuyv + i * 2);
+}
+
+static void run_RGB888_to_RGB565(struct frame *f)
+{
+    size_t i;
+
+    for (i = 0; i < f->pixels; i++)
+        f->rgb565[i] = RGB888_to_RGB565(f->rgb888[i]);
+}
+
+static void run_rgb24_row(struct frame *f)
+{
+    size_t y;
+
+    for (y = 0; y < f->height; y++)
+        yuyv_to_rgb24_row(f->rgb24 + y * f->width * 3,
+                          f->yuyv + y * f->width * 2, f->width);
+}
+
+static void run_rgb565x_row(struct frame *f)
+{
+    size_t y;
+
+    for (y = 0; y < f->height; y++)
+        yuyv_to_rgb565x_row(f->rgb565 + y * f->width,
+                            f->yuyv + y * f->width * 2, f->width);
+}
+
+static void run_rgb565x_dual_row(struct frame *f)
+{
+    size_t y;
+
+    for (y = 0; y < f->height; y++)
+        yuyv_to_rgb565x_dual_row(f->rgb565 + y * f->width,
+                                 f->rgb565_v4l2 + y * f->width,
+                                 f->yuyv + y * f->width * 2, f->width);
+}
+
+/* gen_buf() of the rgb565x tools: V4L2 layout in, SDL layout out */
+static void run_gen_buf(struct frame *f)
+{
+    rgb565x_swap_green_row(f->rgb565, f->ref565_v4l2, f->pixels);
+}
+
+/* Into a device OUTPUT buffer: SDL layout in, V4L2 layout out */
+static void run_gen_buf_nt(struct frame *f)
+{
+    rgb565x_swap_green_row_nt(f->rgb565_v4l2, f->ref565, f->pixels);
+}
+
+/* The swap undoes itself, so the timed runs keep toggling the frame */
+static void prepare_gen_buf_inplace(struct frame *f)
+{
+    memcpy(f->rgb565, f->ref565_v4l2, f->pixels * 2);
+}
+
+static void run_gen_buf_inplace(struct frame *f)
+{
+    rgb565x_swap_green_inplace(f->rgb565, f->pixels);
+}
+
+static void run_downscale2(struct frame *f)
+{
+    size_t y;
+
+    for (y = 0; y + 1 < f->height; y += 2)
+        yuyv_downscale2_row(f->half + y / 2 * f->width,
+                            f->yuyv + y * f->width * 2,
+                            f->yuyv + (y + 1) * f->width * 2, f->width);
+}
+
+/* Luma row y and its chroma, planes as laid out by frame_alloc() */
+struct yuv420_row
+{
+    const uint8_t *y;
+    const uint8_t *u;
+    const uint8_t *v;
+    size_t step;
+};
+
+static struct yuv420_row yuv420_row(const struct frame *f,
+                                    const uint8_t * image, size_t y)
+{
+    const uint8_t *chroma = image + f->pixels;
+    struct yuv420_row row;
+
+    row.y = image + y * f->width;
+
+    if (image == f->i420)
+    {
+        row.u = chroma + y / 2 * f->width / 2;
+        row.v = row.u + f->pixels / 4;
+        row.step = 1;
+    }
+    else
+    {
+        row.u = chroma + y / 2 * f->width + (image == f->nv21);
+        row.v = chroma + y / 2 * f->width + (image == f->nv12);
+        row.step = 2;
+    }
+
+    return row;
+}
+
+static void run_yuv420_rgb24(struct frame *f, const uint8_t * image)
+{
+    size_t y;
+
+    for (y = 0; y < f->height; y++)
+    {
+        struct yuv420_row row = yuv420_row(f, image, y);
+
+        yuv420_to_rgb24_row(f->rgb24 + y * f->width * 3, row.y, row.u,
+                            row.v, row.step, f->width);
+    }
+}
+
+static void run_yuv420_rgb565x(struct frame *f, const uint8_t * image)
+{
+    size_t y;
+
+    for (y = 0; y < f->height; y++)
+    {
+        struct yuv420_row row = yuv420_row(f, image, y);
+
+        yuv420_to_rgb565x_row(f->rgb565 + y * f->width, row.y, row.u,
+                              row.v, row.step, f->width);
+    }
+}
+
+static void run_nv12_rgb24(struct frame *f)
+{
+    run_yuv420_rgb24(f, f->nv12);
+}
+
+static void run_nv21_rgb24(struct frame *f)
+{
+    run_yuv420_rgb24(f, f->nv21);
+}
+
+static void run_i420_rgb24(struct frame *f)
+{
+    run_yuv420_rgb24(f, f->i420);
+}
+
+static void run_nv12_rgb565x(struct frame *f)
+{
+    run_yuv420_rgb565x(f, f->nv12);
+}
+
+static void run_nv21_rgb565x(struct frame *f)
+{
+    run_yuv420_rgb565x(f, f->nv21);
+}
+
+static void run_i420_rgb565x(struct frame *f)
+{
+    run_yuv420_rgb565x(f, f->i420);
+}
+
+static size_t check_yuv420_rgb24_out(const struct frame *f)
+{
+    return check_rgb24(f->rgb24, f->ref420, f->pixels);
+}
+
+static size_t check_yuv420_rgb565x_out(const struct frame *f)
+{
+    return check_rgb565(f->rgb565, f->ref420_565, f->pixels);
+}
+
+static size_t check_rgb24_out(const struct frame *f)
+{
+    return check_rgb24(f->rgb24, f->ref, f->pixels);
+}
+
+static size_t check_rgb565_out(const struct frame *f)
+{
+    return check_rgb565(f->rgb565, f->ref565, f->pixels);
+}
+
+/* The V4L2 copy has green split across bytes, compare it via the SDL one */
+static size_t check_dual_out(const struct frame *f)
+{
+    size_t i, bad = check_rgb565(f->rgb565, f->ref565, f->pixels);
+
+    for (i = 0; i < f->pixels; i++)
+    {
+        if (RGB565X_swap_green(f->rgb565_v4l2[i]) != f->rgb565[i])
+            bad++;
+    }
+
+    return bad;
+}
+
+/* Only rearranges bits, so bit exact, green included */
+static size_t check_gen_buf_out(const struct frame *f)
+{
+    size_t i, bad = 0;
+
+    for (i = 0; i < f->pixels; i++)
+        if (f->rgb565[i] != f->ref565[i])
+            bad++;
+
+    return bad;
+}
+
+static size_t check_gen_buf_nt_out(const struct frame *f)
+{
+    size_t i, bad = 0;
+
+    for (i = 0; i < f->pixels; i++)
+        if (f->rgb565_v4l2[i] != f->ref565_v4l2[i])
+            bad++;
+
+    return bad;
+}
+
+/*
+ * Not a colorspace conversion, so against a plain 2x2 average; the SIMD
+ * versions may round up by 1.
+ */
+static size_t check_downscale2_out(const struct frame *f)
+{
+    static const int taps[4][2] = { {0, 2}, {1, 5}, {4, 6}, {3, 7} };
+    size_t x, y, bad = 0;
+
+    for (y = 0; y + 1 < f->height; y += 2)
+    {
+        const uint8_t *a = f->yuyv + y * f->width * 2;
+        const uint8_t *b = a + f->width * 2;
+        const uint8_t *out = f->half + y / 2 * f->width;
+
+        for (x = 0; x + 4 <= f->width; x += 4)
+        {
+            int i;
+
+            for (i = 0; i < 4; i++)
+            {
+                int avg = (a[x * 2 + taps[i][0]] + a[x * 2 + taps[i][1]] +
+                           b[x * 2 + taps[i][0]] + b[x * 2 + taps[i][1]] +
+                           2) >> 2;
+
+                if (out[x + i] != avg && out[x + i] != avg + 1)
+                    bad++;
+            }
+        }
+    }
+
+    return bad;
+}
+
+static const struct kernel kernels[] = {
+    {"YUV422_to_RGB", 0, 2 + 3, run_YUV422_to_RGB, check_rgb24_out},
+    {"yuyv_to_rgb24_row", 1, 2 + 3, run_rgb24_row, check_rgb24_out},
+    {"YUV422_to_RGB565", 0, 2 + 2, run_YUV422_to_RGB565, check_rgb565_out},
+    {"yuyv_to_rgb565x_row", 1, 2 + 2, run_rgb565x_row, check_rgb565_out},
+    {"yuyv_to_rgb565x_dual_row", 1, 2 + 4, run_rgb565x_dual_row,
+     check_dual_out},
+    {"RGB888_to_RGB565", 0, 4 + 2, run_RGB888_to_RGB565, check_rgb565_out},
+    {"gen_buf", 1, 2 + 2, run_gen_buf, check_gen_buf_out},
+    {"gen_buf nt", 1, 2 + 2, run_gen_buf_nt, check_gen_buf_nt_out},
+    {"gen_buf inplace", 1, 2 + 2, run_gen_buf_inplace, check_gen_buf_out,
+     prepare_gen_buf_inplace},
+    {"yuyv_downscale2_row", 1, 2 + 1, run_downscale2, check_downscale2_out},
+    /* 1.5 bytes in per pixel, rounded up */
+    {"yuv420_to_rgb24 nv12", 1, 2 + 3, run_nv12_rgb24, check_yuv420_rgb24_out},
+    {"yuv420_to_rgb24 nv21", 1, 2 + 3, run_nv21_rgb24, check_yuv420_rgb24_out},
+    {"yuv420_to_rgb24 i420", 1, 2 + 3, run_i420_rgb24, check_yuv420_rgb24_out},
+    {"yuv420_to_rgb565x nv12", 1, 2 + 2, run_nv12_rgb565x,
+     check_yuv420_rgb565x_out},
+    {"yuv420_to_rgb565x nv21", 1, 2 + 2, run_nv21_rgb565x,
+     check_yuv420_rgb565x_out},
+    {"yuv420_to_rgb565x i420", 1, 2 + 2, run_i420_rgb565x,
+     check_yuv420_rgb565x_out},
+};
+
+#define N_KERNELS (sizeof(kernels) / sizeof(kernels[0]))
+
+/* Returns the number of bad pixels of the first run */
+static size_t bench(const struct kernel *k, const char *set, struct frame *f)
+{
+    unsigned long iterations = 0;
+    double start, elapsed;
+    uint64_t start_cycles, n_cycles;
+    double pixels;
+    size_t bad;
+
+    if (k->prepare)
+        k->prepare(f);
+
+    /* Also warms up caches and page tables */
+    k->run(f);
+    bad = k->check(f);
+
+    start = now();
+    start_cycles = cycles();
+
+    do
+    {
+        k->run(f);
+        iterations++;
+        elapsed = now() - start;
+    }
+    while (elapsed < min_time || iterations < 3);
+
+    n_cycles = cycles() - start_cycles;
+    pixels = (double)f->pixels * iterations;
+
+    printf("  %-26s %-6s %9.1f ", k->name, set, pixels / elapsed / 1e6);
+
+    if (n_cycles)
+        printf("%8.2f ", n_cycles / pixels);
+    else
+        printf("%8s ", "-");
+
+    printf("%7.2f  ", pixels * k->bytes / elapsed / 1e9);
+
+    if (bad)
+        printf("FAIL (%zu px)\n", bad);
+    else
+        printf("ok\n");
+
+    return bad;
+}
+
+static void usage(FILE * fp, int argc, char **argv)
+{
+    fprintf(fp,
+            "Usage: %s [options]\n\n"
+            "Options:\n"
+            "-h | --help          Print this message\n"
+            "-k | --kernel name   Only run kernels whose name contains name\n"
+            "-s | --size WxH      Only run this frame size\n"
+            "-t | --time sec      Minimum time per kernel and size [0.25]\n"
+            "", argv[0]);
+}
+
+static const char short_options[] = "hk:s:t:";
+
+static const struct option long_options[] = {
+    {"help", no_argument, NULL, 'h'},
+    {"kernel", required_argument, NULL, 'k'},
+    {"size", required_argument, NULL, 's'},
+    {"time", required_argument, NULL, 't'},
+    {0, 0, 0, 0}
+};
+
+int main(int argc, char **argv)
+{
+    const char *filter = NULL;
+    const char *best;
+    size_t n_sizes = N_SIZES;
+    size_t failed = 0;
+    unsigned int i, k, s;
+
+    for (;;)
+    {
+        int index;
+        int c;
+
+        c = getopt_long(argc, argv, short_options, long_options, &index);
+
+        if (-1 == c)
+            break;
+
+        switch (c)
+        {
+        case 0:                /* getopt_long() flag */
+            break;
+
+        case 'h':
+            usage(stdout, argc, argv);
+            exit(EXIT_SUCCESS);
+
+        case 'k':
+            filter = optarg;
+            break;
+
+        case 's':
+            if (sscanf(optarg, "%zux%zu", &sizes[0][0], &sizes[0][1]) != 2
+                || !sizes[0][0] || !sizes[0][1] || sizes[0][0] % 2 ||
+                sizes[0][1] % 2)
+            {
+                /* YUYV pairs pixels, 4:2:0 also rows */
+                fprintf(stderr, "Size must be WxH, W and H even\n");
+                exit(EXIT_FAILURE);
+            }
+            n_sizes = 1;
+            break;
+
+        case 't':
+            min_time = atof(optarg);
+            break;
+
+        default:
+            usage(stderr, argc, argv);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    convert_init();
+    best = convert_simd_name;
+
+    printf("Kernel sets:");
+    for (i = 0; convert_simd_names(i); i++)
+    {
+        const char *name = convert_simd_names(i);
+
+        printf(" %s%s", name, convert_select(name) ? " (unsupported)" :
+               strcmp(name, best) ? "" : " (default)");
+    }
+    printf("\n");
+
+#ifndef HAVE_RDTSC
+    printf("No cycle counter, cycles/px is not measured\n");
+#endif
+
+    for (i = 0; i < n_sizes; i++)
+    {
+        struct frame f;
+
+        frame_alloc(&f, sizes[i][0], sizes[i][1]);
+
+        printf("\n%zux%zu\n", f.width, f.height);
+        printf("  %-26s %-6s %9s %8s %7s  %s\n", "kernel", "set",
+               "Mpix/s", "cyc/px", "GB/s", "check");
+
+        for (k = 0; k < N_KERNELS; k++)
+        {
+            if (filter && !strstr(kernels[k].name, filter))
+                continue;
+
+            if (!kernels[k].simd)
+            {
+                failed += bench(&kernels[k], "inline", &f);
+                continue;
+            }
+
+            for (s = 0; convert_simd_names(s); s++)
+            {
+                if (convert_select(convert_simd_names(s)))
+                    continue;
+
+                failed += bench(&kernels[k], convert_simd_name, &f);
+            }
+        }
+
+        frame_free(&f);
+    }
+
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,1052 @@
+/*
+ * Copyright (C) 2012 by Tomasz Moń <desowin@gmail.com>
+ *
+ * Colorspace conversion helpers shared by the viewers.
+ *
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright
+ * notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+ * OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name of a copyright holder shall not
+ * be used in advertising or otherwise to promote the sale, use or other dealings
+ * in this Software without prior written authorization of the copyright holder.
+ */
+
+#include <stddef.h>
+#include <string.h>
+
+#include "convert.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CONVERT_X86 1
+#include <immintrin.h>
+#endif
+
+#define max(a, b) (a > b ? a : b)
+#define min(a, b) (a > b ? b : a)
+
+int32_t YCbCr_Cr_to_R[256];
+int32_t YCbCr_Cb_to_G[256];
+int32_t YCbCr_Cr_to_G[256];
+int32_t YCbCr_Cb_to_B[256];
+
+void YCbCrToRGB(int y, int cb, int cr, uint8_t * r, uint8_t * g, uint8_t * b)
+{
+    double Y = (double)y;
+    double Cb = (double)cb;
+    double Cr = (double)cr;
+
+    int R = (int)(Y + 1.40200 * (Cr - 0x80));
+    int G = (int)(Y - 0.34414 * (Cb - 0x80) - 0.71414 * (Cr - 0x80));
+    int B = (int)(Y + 1.77200 * (Cb - 0x80));
+
+    *r = max(0, min(255, R));
+    *g = max(0, min(255, G));
+    *b = max(0, min(255, B));
+}
+
+static int32_t floor_int(double x)
+{
+    int32_t v = (int32_t)x;
+
+    if (v > x)
+        v--;
+
+    return v;
+}
+
+static int32_t round_int(double x)
+{
+    return floor_int(x + 0.5);
+}
+
+/*
+ * Red and blue depend on a single chroma sample each, so adding Y to the
+ * floored chroma term gives the same result as truncating the full sum
+ * (negative sums clamp to 0 either way). Green mixes both chroma samples,
+ * so its terms are kept in fixed point and floored after the addition.
+ */
+void generate_YCbCr_to_RGB_lookup(void)
+{
+    int c;
+
+    for (c = 0; c < 256; c++)
+    {
+        double C = (double)(c - 0x80);
+
+        YCbCr_Cr_to_R[c] = floor_int(1.40200 * C);
+        YCbCr_Cb_to_G[c] = round_int(-0.34414 * C * (1 << YCBCR_FIX_BITS));
+        YCbCr_Cr_to_G[c] = round_int(-0.71414 * C * (1 << YCBCR_FIX_BITS));
+        YCbCr_Cb_to_B[c] = floor_int(1.77200 * C);
+    }
+}
+
+static void yuyv_to_rgb24_row_c(uint8_t * dst, const uint8_t * src,
+                                size_t width)
+{
+    size_t x;
+
+    for (x = 0; x + 1 < width; x += 2)
+        YUV422_to_RGB(dst + x * 3, src + x * 2);
+}
+
+static void yuyv_to_rgb565x_row_c(uint16_t * dst, const uint8_t * src,
+                                  size_t width)
+{
+    size_t x;
+
+    for (x = 0; x + 1 < width; x += 2)
+        YUV422_to_RGB565(dst + x, src + x * 2);
+}
+
+static void yuyv_to_rgb565x_dual_row_c(uint16_t * dst, uint16_t * dst_v4l2,
+                                       const uint8_t * src, size_t width)
+{
+    size_t x;
+
+    for (x = 0; x + 1 < width; x += 2)
+    {
+        YUV422_to_RGB565(dst + x, src + x * 2);
+        dst_v4l2[x] = RGB565X_swap_green(dst[x]);
+        dst_v4l2[x + 1] = RGB565X_swap_green(dst[x + 1]);
+    }
+}
+
+static void rgb565x_swap_green_row_c(uint16_t * dst, const uint16_t * src,
+                                     size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++)
+        dst[i] = RGB565X_swap_green(src[i]);
+}
+
+static void rgb565x_swap_green_inplace_c(uint16_t * buf, size_t n)
+{
+    rgb565x_swap_green_row_c(buf, buf, n);
+}
+
+/* Pixels to go before p is aligned to align bytes, at most n */
+static inline size_t head_pixels(const uint16_t * p, size_t align, size_t n)
+{
+    return min(((align - ((uintptr_t) p & (align - 1))) & (align - 1)) / 2,
+               n);
+}
+
+static void yuv420_to_yuyv_row_c(uint8_t * dst, const uint8_t * y,
+                                 const uint8_t * u, const uint8_t * v,
+                                 size_t chroma_step, size_t width)
+{
+    size_t x;
+
+    for (x = 0; x + 1 < width; x += 2)
+    {
+        dst[x * 2] = y[x];
+        dst[x * 2 + 1] = u[x / 2 * chroma_step];
+        dst[x * 2 + 2] = y[x + 1];
+        dst[x * 2 + 3] = v[x / 2 * chroma_step];
+    }
+}
+
+static void yuyv_downscale2_row_c(uint8_t * dst, const uint8_t * src0,
+                                  const uint8_t * src1, size_t width)
+{
+    size_t x;
+
+    /* Four source pixels (8 bytes) per destination pixel pair */
+    for (x = 0; x + 4 <= width; x += 4)
+    {
+        const uint8_t *a = src0 + x * 2;
+        const uint8_t *b = src1 + x * 2;
+        uint8_t *out = dst + x;
+
+        out[0] = (a[0] + a[2] + b[0] + b[2] + 2) >> 2;
+        out[1] = (a[1] + a[5] + b[1] + b[5] + 2) >> 2;
+        out[2] = (a[4] + a[6] + b[4] + b[6] + 2) >> 2;
+        out[3] = (a[3] + a[7] + b[3] + b[7] + 2) >> 2;
+    }
+}
+
+#ifdef CONVERT_X86
+/*
+ * Chroma coefficients in 2.14 fixed point, ordered to match the Cb, Cr
+ * pairs left in 16 bit lanes after shifting out Y. Red and blue are
+ * bit-exact with the scalar path, green differs by 1 for 159 of the
+ * 65536 Cb, Cr pairs.
+ */
+#define SIMD_FIX_BITS 14
+#define SIMD_K_R   22970        /*  1.40200 */
+#define SIMD_K_GU  (-5638)      /* -0.34414 */
+#define SIMD_K_GV  (-11700)     /* -0.71414 */
+#define SIMD_K_B   29032        /*  1.77200 */
+
+#define PAIR16(lo, hi) ((int32_t)(((uint32_t)(uint16_t)(hi) << 16) | \
+                                  (uint16_t)(lo)))
+
+/*
+ * Unclamped 16 bit R, G, B of 16 YUYV pixels, lo holds pixels 0-7
+ * and hi pixels 8-15.
+ */
+struct rgb16_sse2
+{
+    __m128i r_lo, r_hi;
+    __m128i g_lo, g_hi;
+    __m128i b_lo, b_hi;
+};
+
+__attribute__((target("sse2")))
+static inline void yuyv_to_rgb16_sse2(struct rgb16_sse2 *out,
+                                      __m128i a, __m128i b)
+{
+    const __m128i mask_y = _mm_set1_epi16(0x00FF);
+    const __m128i bias = _mm_set1_epi16(128);
+    const __m128i k_r = _mm_set1_epi32(PAIR16(0, SIMD_K_R));
+    const __m128i k_g = _mm_set1_epi32(PAIR16(SIMD_K_GU, SIMD_K_GV));
+    const __m128i k_b = _mm_set1_epi32(PAIR16(SIMD_K_B, 0));
+
+    __m128i ya = _mm_and_si128(a, mask_y);
+    __m128i yb = _mm_and_si128(b, mask_y);
+    __m128i uva = _mm_sub_epi16(_mm_srli_epi16(a, 8), bias);
+    __m128i uvb = _mm_sub_epi16(_mm_srli_epi16(b, 8), bias);
+
+    /* One chroma term per macropixel, 8 macropixels */
+    __m128i cr = _mm_packs_epi32(
+        _mm_srai_epi32(_mm_madd_epi16(uva, k_r), SIMD_FIX_BITS),
+        _mm_srai_epi32(_mm_madd_epi16(uvb, k_r), SIMD_FIX_BITS));
+    __m128i cg = _mm_packs_epi32(
+        _mm_srai_epi32(_mm_madd_epi16(uva, k_g), SIMD_FIX_BITS),
+        _mm_srai_epi32(_mm_madd_epi16(uvb, k_g), SIMD_FIX_BITS));
+    __m128i cb = _mm_packs_epi32(
+        _mm_srai_epi32(_mm_madd_epi16(uva, k_b), SIMD_FIX_BITS),
+        _mm_srai_epi32(_mm_madd_epi16(uvb, k_b), SIMD_FIX_BITS));
+
+    /* Both pixels of a macropixel share its chroma term */
+    out->r_lo = _mm_adds_epi16(ya, _mm_unpacklo_epi16(cr, cr));
+    out->r_hi = _mm_adds_epi16(yb, _mm_unpackhi_epi16(cr, cr));
+    out->g_lo = _mm_adds_epi16(ya, _mm_unpacklo_epi16(cg, cg));
+    out->g_hi = _mm_adds_epi16(yb, _mm_unpackhi_epi16(cg, cg));
+    out->b_lo = _mm_adds_epi16(ya, _mm_unpacklo_epi16(cb, cb));
+    out->b_hi = _mm_adds_epi16(yb, _mm_unpackhi_epi16(cb, cb));
+}
+
+/*
+ * Packs four 0RGB pixels held in 32 bit lanes into 12 consecutive bytes
+ * at the bottom of the register.
+ */
+__attribute__((target("sse2")))
+static inline __m128i pack_rgb24_sse2(__m128i px)
+{
+    const __m128i lo24 = _mm_set1_epi64x(0x0000000000FFFFFFLL);
+    const __m128i hi24 = _mm_set1_epi64x(0x0000FFFFFF000000LL);
+    const __m128i lo6 = _mm_set_epi32(0, 0, 0x0000FFFF, -1);
+
+    px = _mm_or_si128(_mm_and_si128(px, lo24),
+                      _mm_and_si128(_mm_srli_epi64(px, 8), hi24));
+
+    return _mm_or_si128(_mm_and_si128(px, lo6),
+                        _mm_andnot_si128(lo6, _mm_srli_si128(px, 2)));
+}
+
+/* Converts 16 pixels (32 bytes of YUYV) into 48 bytes of RGB24 */
+__attribute__((target("sse2")))
+static inline void yuyv_to_rgb24_16_sse2(uint8_t * dst, __m128i a, __m128i b)
+{
+    const __m128i zero = _mm_setzero_si128();
+    struct rgb16_sse2 c;
+
+    yuyv_to_rgb16_sse2(&c, a, b);
+
+    __m128i r = _mm_packus_epi16(c.r_lo, c.r_hi);
+    __m128i g = _mm_packus_epi16(c.g_lo, c.g_hi);
+    __m128i bl = _mm_packus_epi16(c.b_lo, c.b_hi);
+
+    __m128i rg_lo = _mm_unpacklo_epi8(r, g);
+    __m128i rg_hi = _mm_unpackhi_epi8(r, g);
+    __m128i b0_lo = _mm_unpacklo_epi8(bl, zero);
+    __m128i b0_hi = _mm_unpackhi_epi8(bl, zero);
+
+    __m128i p0 = pack_rgb24_sse2(_mm_unpacklo_epi16(rg_lo, b0_lo));
+    __m128i p1 = pack_rgb24_sse2(_mm_unpackhi_epi16(rg_lo, b0_lo));
+    __m128i p2 = pack_rgb24_sse2(_mm_unpacklo_epi16(rg_hi, b0_hi));
+    __m128i p3 = pack_rgb24_sse2(_mm_unpackhi_epi16(rg_hi, b0_hi));
+
+    _mm_storeu_si128((__m128i *) (dst + 0),
+                     _mm_or_si128(p0, _mm_slli_si128(p1, 12)));
+    _mm_storeu_si128((__m128i *) (dst + 16),
+                     _mm_or_si128(_mm_srli_si128(p1, 4),
+                                  _mm_slli_si128(p2, 8)));
+    _mm_storeu_si128((__m128i *) (dst + 32),
+                     _mm_or_si128(_mm_srli_si128(p2, 8),
+                                  _mm_slli_si128(p3, 4)));
+}
+
+__attribute__((target("sse2")))
+static void yuyv_to_rgb24_row_sse2(uint8_t * dst, const uint8_t * src,
+                                   size_t width)
+{
+    size_t x;
+
+    for (x = 0; x + 16 <= width; x += 16)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)(src + x * 2));
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + x * 2 + 16));
+
+        yuyv_to_rgb24_16_sse2(dst + x * 3, a, b);
+    }
+
+    yuyv_to_rgb24_row_c(dst + x * 3, src + x * 2, width - x);
+}
+
+/*
+ * Packs clamped 16 bit R, G, B into the layout RGB888_to_RGB565() stores
+ * on little endian hosts. The byte swap is folded into the shifts:
+ *
+ *   bits 15-13  green 4-2
+ *   bits 12-8   red 7-3
+ *   bits 7-3    blue 7-3
+ *   bits 2-0    green 7-5
+ */
+__attribute__((target("sse2")))
+static inline __m128i pack_rgb565x_sse2(__m128i r, __m128i g, __m128i b)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i max = _mm_set1_epi16(255);
+    const __m128i mask_g = _mm_set1_epi16(0x1C);
+    const __m128i mask_rb = _mm_set1_epi16(0xF8);
+
+    r = _mm_min_epi16(_mm_max_epi16(r, zero), max);
+    g = _mm_min_epi16(_mm_max_epi16(g, zero), max);
+    b = _mm_min_epi16(_mm_max_epi16(b, zero), max);
+
+    return _mm_or_si128(
+        _mm_or_si128(_mm_slli_epi16(_mm_and_si128(g, mask_g), 11),
+                     _mm_slli_epi16(_mm_and_si128(r, mask_rb), 5)),
+        _mm_or_si128(_mm_and_si128(b, mask_rb), _mm_srli_epi16(g, 5)));
+}
+
+/* SSE2 version of RGB565X_swap_green() */
+__attribute__((target("sse2")))
+static inline __m128i swap_green_sse2(__m128i px)
+{
+    const __m128i keep = _mm_set1_epi16(0x1FF8);
+
+    return _mm_or_si128(_mm_and_si128(px, keep),
+                        _mm_or_si128(_mm_srli_epi16(px, 13),
+                                     _mm_slli_epi16(px, 13)));
+}
+
+/* dst_v4l2, when set, also receives the frame in real RGB565X */
+__attribute__((target("sse2")))
+static inline void yuyv_to_rgb565x_sse2(uint16_t * dst, uint16_t * dst_v4l2,
+                                        const uint8_t * src, size_t width)
+{
+    size_t x;
+
+    for (x = 0; x + 16 <= width; x += 16)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)(src + x * 2));
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + x * 2 + 16));
+        struct rgb16_sse2 c;
+
+        yuyv_to_rgb16_sse2(&c, a, b);
+
+        __m128i lo = pack_rgb565x_sse2(c.r_lo, c.g_lo, c.b_lo);
+        __m128i hi = pack_rgb565x_sse2(c.r_hi, c.g_hi, c.b_hi);
+
+        _mm_storeu_si128((__m128i *) (dst + x), lo);
+        _mm_storeu_si128((__m128i *) (dst + x + 8), hi);
+
+        if (dst_v4l2)
+        {
+            _mm_storeu_si128((__m128i *) (dst_v4l2 + x),
+                             swap_green_sse2(lo));
+            _mm_storeu_si128((__m128i *) (dst_v4l2 + x + 8),
+                             swap_green_sse2(hi));
+        }
+    }
+
+    if (dst_v4l2)
+        yuyv_to_rgb565x_dual_row_c(dst + x, dst_v4l2 + x, src + x * 2,
+                                   width - x);
+    else
+        yuyv_to_rgb565x_row_c(dst + x, src + x * 2, width - x);
+}
+
+__attribute__((target("sse2")))
+static void yuyv_to_rgb565x_row_sse2(uint16_t * dst, const uint8_t * src,
+                                     size_t width)
+{
+    yuyv_to_rgb565x_sse2(dst, NULL, src, width);
+}
+
+__attribute__((target("sse2")))
+static void yuyv_to_rgb565x_dual_row_sse2(uint16_t * dst, uint16_t * dst_v4l2,
+                                          const uint8_t * src, size_t width)
+{
+    yuyv_to_rgb565x_sse2(dst, dst_v4l2, src, width);
+}
+
+/*
+ * Halves 8 pixels (16 bytes of YUYV, already averaged with the row below)
+ * into 4, returned in the low 8 bytes. In every Y0 Cb Y1 Cr dword the two
+ * lumas are averaged, chroma is averaged with the next dword.
+ */
+__attribute__((target("sse2")))
+static inline __m128i downscale2_sse2(__m128i v)
+{
+    const __m128i lo8 = _mm_set1_epi32(0xFF);
+    const __m128i chroma = _mm_set1_epi32(0xFF00FF00);
+
+    __m128i y = _mm_avg_epu8(v, _mm_srli_epi32(v, 16));
+    __m128i c = _mm_avg_epu8(v, _mm_srli_epi64(v, 32));
+
+    y = _mm_and_si128(y, lo8);
+    y = _mm_or_si128(y, _mm_srli_epi64(y, 16));
+
+    /* Results sit in dwords 0 and 2 */
+    return _mm_shuffle_epi32(_mm_or_si128(y, _mm_and_si128(c, chroma)),
+                             _MM_SHUFFLE(3, 1, 2, 0));
+}
+
+__attribute__((target("sse2")))
+static void yuyv_downscale2_row_sse2(uint8_t * dst, const uint8_t * src0,
+                                     const uint8_t * src1, size_t width)
+{
+    size_t x;
+
+    for (x = 0; x + 16 <= width; x += 16)
+    {
+        __m128i a = _mm_avg_epu8(_mm_loadu_si128((const __m128i *)
+                                                 (src0 + x * 2)),
+                                 _mm_loadu_si128((const __m128i *)
+                                                 (src1 + x * 2)));
+        __m128i b = _mm_avg_epu8(_mm_loadu_si128((const __m128i *)
+                                                 (src0 + x * 2 + 16)),
+                                 _mm_loadu_si128((const __m128i *)
+                                                 (src1 + x * 2 + 16)));
+
+        _mm_storeu_si128((__m128i *) (dst + x),
+                         _mm_unpacklo_epi64(downscale2_sse2(a),
+                                            downscale2_sse2(b)));
+    }
+
+    yuyv_downscale2_row_c(dst + x, src0 + x * 2, src1 + x * 2, width - x);
+}
+
+/*
+ * Interleaved Cb, Cr bytes of 16 pixels. NV12 is in that order already,
+ * NV21 has the bytes of every pair swapped and planar chroma is merged.
+ * Returns 0 for chroma layouts the SIMD kernels do not handle.
+ */
+__attribute__((target("sse2")))
+static inline int load_uv8_sse2(__m128i * uv, const uint8_t * u,
+                                const uint8_t * v, size_t chroma_step)
+{
+    if (1 == chroma_step)
+    {
+        *uv = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)u),
+                                _mm_loadl_epi64((const __m128i *)v));
+        return 1;
+    }
+
+    if (2 == chroma_step && v == u + 1)
+    {
+        *uv = _mm_loadu_si128((const __m128i *)u);
+        return 1;
+    }
+
+    if (2 == chroma_step && u == v + 1)
+    {
+        __m128i vu = _mm_loadu_si128((const __m128i *)v);
+
+        *uv = _mm_or_si128(_mm_slli_epi16(vu, 8), _mm_srli_epi16(vu, 8));
+        return 1;
+    }
+
+    return 0;
+}
+
+__attribute__((target("sse2")))
+static void yuv420_to_yuyv_row_sse2(uint8_t * dst, const uint8_t * y,
+                                    const uint8_t * u, const uint8_t * v,
+                                    size_t chroma_step, size_t width)
+{
+    size_t x;
+
+    for (x = 0; x + 16 <= width; x += 16)
+    {
+        __m128i luma = _mm_loadu_si128((const __m128i *)(y + x));
+        __m128i uv;
+
+        if (!load_uv8_sse2(&uv, u + x / 2 * chroma_step,
+                           v + x / 2 * chroma_step, chroma_step))
+            break;
+
+        _mm_storeu_si128((__m128i *) (dst + x * 2),
+                         _mm_unpacklo_epi8(luma, uv));
+        _mm_storeu_si128((__m128i *) (dst + x * 2 + 16),
+                         _mm_unpackhi_epi8(luma, uv));
+    }
+
+    yuv420_to_yuyv_row_c(dst + x * 2, y + x, u + x / 2 * chroma_step,
+                         v + x / 2 * chroma_step, chroma_step, width - x);
+}
+
+__attribute__((target("sse2")))
+static void rgb565x_swap_green_row_sse2(uint16_t * dst, const uint16_t * src,
+                                        size_t n)
+{
+    size_t i;
+
+    for (i = 0; i + 8 <= n; i += 8)
+        _mm_storeu_si128((__m128i *) (dst + i),
+                         swap_green_sse2(_mm_loadu_si128((const __m128i *)
+                                                         (src + i))));
+
+    rgb565x_swap_green_row_c(dst + i, src + i, n - i);
+}
+
+/* Streaming stores want 16 byte alignment, the C version does the head */
+__attribute__((target("sse2")))
+static void rgb565x_swap_green_row_nt_sse2(uint16_t * dst,
+                                           const uint16_t * src, size_t n)
+{
+    size_t i = head_pixels(dst, 16, n);
+
+    rgb565x_swap_green_row_c(dst, src, i);
+
+    for (; i + 8 <= n; i += 8)
+        _mm_stream_si128((__m128i *) (dst + i),
+                         swap_green_sse2(_mm_loadu_si128((const __m128i *)
+                                                         (src + i))));
+
+    /* Order the streaming stores before whatever hands dst to the device */
+    _mm_sfence();
+
+    rgb565x_swap_green_row_c(dst + i, src + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static void rgb565x_swap_green_inplace_sse2(uint16_t * buf, size_t n)
+{
+    size_t i = head_pixels(buf, 16, n);
+
+    rgb565x_swap_green_row_c(buf, buf, i);
+
+    for (; i + 8 <= n; i += 8)
+    {
+        __m128i *p = (__m128i *) (buf + i);
+
+        _mm_store_si128(p, swap_green_sse2(_mm_load_si128(p)));
+    }
+
+    rgb565x_swap_green_row_c(buf + i, buf + i, n - i);
+}
+
+/* AVX2 counterpart of struct rgb16_sse2, see yuyv_to_rgb16_avx2() */
+struct rgb16_avx2
+{
+    __m256i r_lo, r_hi;
+    __m256i g_lo, g_hi;
+    __m256i b_lo, b_hi;
+};
+
+/*
+ * Same algorithm as the SSE2 kernel, run on both 128 bit lanes at once.
+ * Inputs are permuted so each lane sees 16 consecutive pixels, lane 0
+ * pixels 0-15 and lane 1 pixels 16-31.
+ */
+__attribute__((target("avx2")))
+static inline void yuyv_to_rgb16_avx2(struct rgb16_avx2 *out,
+                                      const uint8_t * src)
+{
+    const __m256i mask_y = _mm256_set1_epi16(0x00FF);
+    const __m256i bias = _mm256_set1_epi16(128);
+    const __m256i k_r = _mm256_set1_epi32(PAIR16(0, SIMD_K_R));
+    const __m256i k_g = _mm256_set1_epi32(PAIR16(SIMD_K_GU, SIMD_K_GV));
+    const __m256i k_b = _mm256_set1_epi32(PAIR16(SIMD_K_B, 0));
+
+    __m256i in0 = _mm256_loadu_si256((const __m256i *)src);
+    __m256i in1 = _mm256_loadu_si256((const __m256i *)(src + 32));
+    __m256i a = _mm256_permute2x128_si256(in0, in1, 0x20);
+    __m256i b = _mm256_permute2x128_si256(in0, in1, 0x31);
+
+    __m256i ya = _mm256_and_si256(a, mask_y);
+    __m256i yb = _mm256_and_si256(b, mask_y);
+    __m256i uva = _mm256_sub_epi16(_mm256_srli_epi16(a, 8), bias);
+    __m256i uvb = _mm256_sub_epi16(_mm256_srli_epi16(b, 8), bias);
+
+    __m256i cr = _mm256_packs_epi32(
+        _mm256_srai_epi32(_mm256_madd_epi16(uva, k_r), SIMD_FIX_BITS),
+        _mm256_srai_epi32(_mm256_madd_epi16(uvb, k_r), SIMD_FIX_BITS));
+    __m256i cg = _mm256_packs_epi32(
+        _mm256_srai_epi32(_mm256_madd_epi16(uva, k_g), SIMD_FIX_BITS),
+        _mm256_srai_epi32(_mm256_madd_epi16(uvb, k_g), SIMD_FIX_BITS));
+    __m256i cb = _mm256_packs_epi32(
+        _mm256_srai_epi32(_mm256_madd_epi16(uva, k_b), SIMD_FIX_BITS),
+        _mm256_srai_epi32(_mm256_madd_epi16(uvb, k_b), SIMD_FIX_BITS));
+
+    out->r_lo = _mm256_adds_epi16(ya, _mm256_unpacklo_epi16(cr, cr));
+    out->r_hi = _mm256_adds_epi16(yb, _mm256_unpackhi_epi16(cr, cr));
+    out->g_lo = _mm256_adds_epi16(ya, _mm256_unpacklo_epi16(cg, cg));
+    out->g_hi = _mm256_adds_epi16(yb, _mm256_unpackhi_epi16(cg, cg));
+    out->b_lo = _mm256_adds_epi16(ya, _mm256_unpacklo_epi16(cb, cb));
+    out->b_hi = _mm256_adds_epi16(yb, _mm256_unpackhi_epi16(cb, cb));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i pack_rgb24_avx2(__m256i px)
+{
+    const __m256i lo24 = _mm256_set1_epi64x(0x0000000000FFFFFFLL);
+    const __m256i hi24 = _mm256_set1_epi64x(0x0000FFFFFF000000LL);
+    const __m256i lo6 = _mm256_set_epi32(0, 0, 0x0000FFFF, -1,
+                                         0, 0, 0x0000FFFF, -1);
+
+    px = _mm256_or_si256(_mm256_and_si256(px, lo24),
+                         _mm256_and_si256(_mm256_srli_epi64(px, 8), hi24));
+
+    return _mm256_or_si256(_mm256_and_si256(px, lo6),
+                           _mm256_andnot_si256(lo6,
+                                               _mm256_srli_si256(px, 2)));
+}
+
+__attribute__((target("avx2")))
+static void yuyv_to_rgb24_row_avx2(uint8_t * dst, const uint8_t * src,
+                                   size_t width)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    size_t x;
+
+    for (x = 0; x + 32 <= width; x += 32)
+    {
+        struct rgb16_avx2 c;
+
+        yuyv_to_rgb16_avx2(&c, src + x * 2);
+
+        __m256i r = _mm256_packus_epi16(c.r_lo, c.r_hi);
+        __m256i g = _mm256_packus_epi16(c.g_lo, c.g_hi);
+        __m256i bl = _mm256_packus_epi16(c.b_lo, c.b_hi);
+
+        __m256i rg_lo = _mm256_unpacklo_epi8(r, g);
+        __m256i rg_hi = _mm256_unpackhi_epi8(r, g);
+        __m256i b0_lo = _mm256_unpacklo_epi8(bl, zero);
+        __m256i b0_hi = _mm256_unpackhi_epi8(bl, zero);
+
+        __m256i p0 = pack_rgb24_avx2(_mm256_unpacklo_epi16(rg_lo, b0_lo));
+        __m256i p1 = pack_rgb24_avx2(_mm256_unpackhi_epi16(rg_lo, b0_lo));
+        __m256i p2 = pack_rgb24_avx2(_mm256_unpacklo_epi16(rg_hi, b0_hi));
+        __m256i p3 = pack_rgb24_avx2(_mm256_unpackhi_epi16(rg_hi, b0_hi));
+
+        /* 48 bytes per lane, in three 16 byte pieces */
+        __m256i o0 = _mm256_or_si256(p0, _mm256_slli_si256(p1, 12));
+        __m256i o1 = _mm256_or_si256(_mm256_srli_si256(p1, 4),
+                                     _mm256_slli_si256(p2, 8));
+        __m256i o2 = _mm256_or_si256(_mm256_srli_si256(p2, 8),
+                                     _mm256_slli_si256(p3, 4));
+
+        uint8_t *out = dst + x * 3;
+
+        _mm256_storeu_si256((__m256i *) (out + 0),
+                            _mm256_permute2x128_si256(o0, o1, 0x20));
+        _mm256_storeu_si256((__m256i *) (out + 32),
+                            _mm256_permute2x128_si256(o2, o0, 0x30));
+        _mm256_storeu_si256((__m256i *) (out + 64),
+                            _mm256_permute2x128_si256(o1, o2, 0x31));
+    }
+
+    yuyv_to_rgb24_row_sse2(dst + x * 3, src + x * 2, width - x);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i pack_rgb565x_avx2(__m256i r, __m256i g, __m256i b)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i max = _mm256_set1_epi16(255);
+    const __m256i mask_g = _mm256_set1_epi16(0x1C);
+    const __m256i mask_rb = _mm256_set1_epi16(0xF8);
+
+    r = _mm256_min_epi16(_mm256_max_epi16(r, zero), max);
+    g = _mm256_min_epi16(_mm256_max_epi16(g, zero), max);
+    b = _mm256_min_epi16(_mm256_max_epi16(b, zero), max);
+
+    return _mm256_or_si256(
+        _mm256_or_si256(_mm256_slli_epi16(_mm256_and_si256(g, mask_g), 11),
+                        _mm256_slli_epi16(_mm256_and_si256(r, mask_rb), 5)),
+        _mm256_or_si256(_mm256_and_si256(b, mask_rb),
+                        _mm256_srli_epi16(g, 5)));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i swap_green_avx2(__m256i px)
+{
+    const __m256i keep = _mm256_set1_epi16(0x1FF8);
+
+    return _mm256_or_si256(_mm256_and_si256(px, keep),
+                           _mm256_or_si256(_mm256_srli_epi16(px, 13),
+                                           _mm256_slli_epi16(px, 13)));
+}
+
+__attribute__((target("avx2")))
+static inline void yuyv_to_rgb565x_avx2(uint16_t * dst, uint16_t * dst_v4l2,
+                                        const uint8_t * src, size_t width)
+{
+    size_t x;
+
+    for (x = 0; x + 32 <= width; x += 32)
+    {
+        struct rgb16_avx2 c;
+
+        yuyv_to_rgb16_avx2(&c, src + x * 2);
+
+        __m256i lo = pack_rgb565x_avx2(c.r_lo, c.g_lo, c.b_lo);
+        __m256i hi = pack_rgb565x_avx2(c.r_hi, c.g_hi, c.b_hi);
+
+        /* Lane 0 holds pixels 0-15, lane 1 pixels 16-31 */
+        __m256i p0 = _mm256_permute2x128_si256(lo, hi, 0x20);
+        __m256i p1 = _mm256_permute2x128_si256(lo, hi, 0x31);
+
+        _mm256_storeu_si256((__m256i *) (dst + x), p0);
+        _mm256_storeu_si256((__m256i *) (dst + x + 16), p1);
+
+        if (dst_v4l2)
+        {
+            _mm256_storeu_si256((__m256i *) (dst_v4l2 + x),
+                                swap_green_avx2(p0));
+            _mm256_storeu_si256((__m256i *) (dst_v4l2 + x + 16),
+                                swap_green_avx2(p1));
+        }
+    }
+
+    if (dst_v4l2)
+        yuyv_to_rgb565x_dual_row_sse2(dst + x, dst_v4l2 + x, src + x * 2,
+                                      width - x);
+    else
+        yuyv_to_rgb565x_row_sse2(dst + x, src + x * 2, width - x);
+}
+
+__attribute__((target("avx2")))
+static void yuyv_to_rgb565x_row_avx2(uint16_t * dst, const uint8_t * src,
+                                     size_t width)
+{
+    yuyv_to_rgb565x_avx2(dst, NULL, src, width);
+}
+
+__attribute__((target("avx2")))
+static void yuyv_to_rgb565x_dual_row_avx2(uint16_t * dst, uint16_t * dst_v4l2,
+                                          const uint8_t * src, size_t width)
+{
+    yuyv_to_rgb565x_avx2(dst, dst_v4l2, src, width);
+}
+/* Per 128 bit lane the same as downscale2_sse2() */
+__attribute__((target("avx2")))
+static inline __m256i downscale2_avx2(__m256i v)
+{
+    const __m256i lo8 = _mm256_set1_epi32(0xFF);
+    const __m256i chroma = _mm256_set1_epi32(0xFF00FF00);
+
+    __m256i y = _mm256_avg_epu8(v, _mm256_srli_epi32(v, 16));
+    __m256i c = _mm256_avg_epu8(v, _mm256_srli_epi64(v, 32));
+
+    y = _mm256_and_si256(y, lo8);
+    y = _mm256_or_si256(y, _mm256_srli_epi64(y, 16));
+
+    return _mm256_shuffle_epi32(_mm256_or_si256(y,
+                                                _mm256_and_si256(c, chroma)),
+                                _MM_SHUFFLE(3, 1, 2, 0));
+}
+
+__attribute__((target("avx2")))
+static void yuyv_downscale2_row_avx2(uint8_t * dst, const uint8_t * src0,
+                                     const uint8_t * src1, size_t width)
+{
+    size_t x;
+
+    for (x = 0; x + 32 <= width; x += 32)
+    {
+        __m256i a = _mm256_avg_epu8(_mm256_loadu_si256((const __m256i *)
+                                                       (src0 + x * 2)),
+                                    _mm256_loadu_si256((const __m256i *)
+                                                       (src1 + x * 2)));
+        __m256i b = _mm256_avg_epu8(_mm256_loadu_si256((const __m256i *)
+                                                       (src0 + x * 2 + 32)),
+                                    _mm256_loadu_si256((const __m256i *)
+                                                       (src1 + x * 2 + 32)));
+
+        /* Lane results come out as a0 b0 a1 b1 */
+        __m256i out = _mm256_unpacklo_epi64(downscale2_avx2(a),
+                                            downscale2_avx2(b));
+
+        _mm256_storeu_si256((__m256i *) (dst + x),
+                            _mm256_permute4x64_epi64(out,
+                                                     _MM_SHUFFLE(3, 1, 2, 0)));
+    }
+
+    yuyv_downscale2_row_sse2(dst + x, src0 + x * 2, src1 + x * 2, width - x);
+}
+
+__attribute__((target("avx2")))
+static void yuv420_to_yuyv_row_avx2(uint8_t * dst, const uint8_t * y,
+                                    const uint8_t * u, const uint8_t * v,
+                                    size_t chroma_step, size_t width)
+{
+    size_t x;
+
+    for (x = 0; x + 32 <= width; x += 32)
+    {
+        size_t c = x / 2 * chroma_step;
+        __m256i luma = _mm256_loadu_si256((const __m256i *)(y + x));
+        __m128i uv_lo, uv_hi;
+        __m256i uv, lo, hi;
+
+        if (!load_uv8_sse2(&uv_lo, u + c, v + c, chroma_step) ||
+            !load_uv8_sse2(&uv_hi, u + c + 8 * chroma_step,
+                           v + c + 8 * chroma_step, chroma_step))
+            break;
+
+        uv = _mm256_inserti128_si256(_mm256_castsi128_si256(uv_lo), uv_hi, 1);
+
+        /* Unpacking works per 128 bit lane, put the halves back in order */
+        lo = _mm256_unpacklo_epi8(luma, uv);
+        hi = _mm256_unpackhi_epi8(luma, uv);
+
+        _mm256_storeu_si256((__m256i *) (dst + x * 2),
+                            _mm256_permute2x128_si256(lo, hi, 0x20));
+        _mm256_storeu_si256((__m256i *) (dst + x * 2 + 32),
+                            _mm256_permute2x128_si256(lo, hi, 0x31));
+    }
+
+    yuv420_to_yuyv_row_sse2(dst + x * 2, y + x, u + x / 2 * chroma_step,
+                            v + x / 2 * chroma_step, chroma_step, width - x);
+}
+
+__attribute__((target("avx2")))
+static void rgb565x_swap_green_row_avx2(uint16_t * dst, const uint16_t * src,
+                                        size_t n)
+{
+    size_t i;
+
+    for (i = 0; i + 16 <= n; i += 16)
+        _mm256_storeu_si256((__m256i *) (dst + i),
+                            swap_green_avx2(_mm256_loadu_si256((const __m256i *)
+                                                               (src + i))));
+
+    rgb565x_swap_green_row_sse2(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void rgb565x_swap_green_row_nt_avx2(uint16_t * dst,
+                                           const uint16_t * src, size_t n)
+{
+    size_t i = head_pixels(dst, 32, n);
+
+    rgb565x_swap_green_row_c(dst, src, i);
+
+    for (; i + 16 <= n; i += 16)
+        _mm256_stream_si256((__m256i *) (dst + i),
+                            swap_green_avx2(_mm256_loadu_si256((const __m256i *)
+                                                               (src + i))));
+
+    _mm_sfence();
+
+    rgb565x_swap_green_row_c(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void rgb565x_swap_green_inplace_avx2(uint16_t * buf, size_t n)
+{
+    size_t i = head_pixels(buf, 32, n);
+
+    rgb565x_swap_green_row_c(buf, buf, i);
+
+    for (; i + 16 <= n; i += 16)
+    {
+        __m256i *p = (__m256i *) (buf + i);
+
+        _mm256_store_si256(p, swap_green_avx2(_mm256_load_si256(p)));
+    }
+
+    rgb565x_swap_green_inplace_sse2(buf + i, n - i);
+}
+#endif /* CONVERT_X86 */
+
+void (*yuyv_to_rgb24_row) (uint8_t * dst, const uint8_t * src,
+                           size_t width) = yuyv_to_rgb24_row_c;
+
+void (*yuyv_to_rgb565x_row) (uint16_t * dst, const uint8_t * src,
+                             size_t width) = yuyv_to_rgb565x_row_c;
+
+void (*yuyv_to_rgb565x_dual_row) (uint16_t * dst, uint16_t * dst_v4l2,
+                                  const uint8_t * src, size_t width) =
+    yuyv_to_rgb565x_dual_row_c;
+
+void (*yuyv_downscale2_row) (uint8_t * dst, const uint8_t * src0,
+                             const uint8_t * src1, size_t width) =
+    yuyv_downscale2_row_c;
+
+void (*rgb565x_swap_green_row) (uint16_t * dst, const uint16_t * src,
+                                size_t n) = rgb565x_swap_green_row_c;
+
+void (*rgb565x_swap_green_row_nt) (uint16_t * dst, const uint16_t * src,
+                                   size_t n) = rgb565x_swap_green_row_c;
+
+void (*rgb565x_swap_green_inplace) (uint16_t * buf, size_t n) =
+    rgb565x_swap_green_inplace_c;
+
+void (*yuv420_to_yuyv_row) (uint8_t * dst, const uint8_t * y,
+                            const uint8_t * u, const uint8_t * v,
+                            size_t chroma_step, size_t width) =
+    yuv420_to_yuyv_row_c;
+
+/* Pixels per round trip through the YUYV kernels, small enough for L1 */
+#define YUV420_CHUNK 512
+
+void yuv420_to_rgb24_row(uint8_t * dst, const uint8_t * y, const uint8_t * u,
+                         const uint8_t * v, size_t chroma_step, size_t width)
+{
+    uint8_t yuyv[YUV420_CHUNK * 2] __attribute__((aligned(32)));
+    size_t x, n;
+
+    for (x = 0; x < width; x += n)
+    {
+        n = min(width - x, YUV420_CHUNK);
+
+        yuv420_to_yuyv_row(yuyv, y + x, u + x / 2 * chroma_step,
+                           v + x / 2 * chroma_step, chroma_step, n);
+        yuyv_to_rgb24_row(dst + x * 3, yuyv, n);
+    }
+}
+
+void yuv420_to_rgb565x_row(uint16_t * dst, const uint8_t * y,
+                           const uint8_t * u, const uint8_t * v,
+                           size_t chroma_step, size_t width)
+{
+    uint8_t yuyv[YUV420_CHUNK * 2] __attribute__((aligned(32)));
+    size_t x, n;
+
+    for (x = 0; x < width; x += n)
+    {
+        n = min(width - x, YUV420_CHUNK);
+
+        yuv420_to_yuyv_row(yuyv, y + x, u + x / 2 * chroma_step,
+                           v + x / 2 * chroma_step, chroma_step, n);
+        yuyv_to_rgb565x_row(dst + x, yuyv, n);
+    }
+}
+
+const char *convert_simd_name = "c";
+
+struct kernel_set
+{
+    const char *name;
+    const char *feature;        /* for __builtin_cpu_supports(), or NULL */
+    void (*rgb24) (uint8_t *, const uint8_t *, size_t);
+    void (*rgb565x) (uint16_t *, const uint8_t *, size_t);
+    void (*rgb565x_dual) (uint16_t *, uint16_t *, const uint8_t *, size_t);
+    void (*downscale2) (uint8_t *, const uint8_t *, const uint8_t *, size_t);
+    void (*swap_green) (uint16_t *, const uint16_t *, size_t);
+    void (*swap_green_nt) (uint16_t *, const uint16_t *, size_t);
+    void (*swap_green_inplace) (uint16_t *, size_t);
+    void (*yuv420_pack) (uint8_t *, const uint8_t *, const uint8_t *,
+                         const uint8_t *, size_t, size_t);
+};
+
+/* Fastest first */
+static const struct kernel_set kernel_sets[] = {
+#ifdef CONVERT_X86
+    {"avx2", "avx2", yuyv_to_rgb24_row_avx2, yuyv_to_rgb565x_row_avx2,
+     yuyv_to_rgb565x_dual_row_avx2, yuyv_downscale2_row_avx2,
+     rgb565x_swap_green_row_avx2, rgb565x_swap_green_row_nt_avx2,
+     rgb565x_swap_green_inplace_avx2, yuv420_to_yuyv_row_avx2},
+    {"sse2", "sse2", yuyv_to_rgb24_row_sse2, yuyv_to_rgb565x_row_sse2,
+     yuyv_to_rgb565x_dual_row_sse2, yuyv_downscale2_row_sse2,
+     rgb565x_swap_green_row_sse2, rgb565x_swap_green_row_nt_sse2,
+     rgb565x_swap_green_inplace_sse2, yuv420_to_yuyv_row_sse2},
+#endif
+    {"c", NULL, yuyv_to_rgb24_row_c, yuyv_to_rgb565x_row_c,
+     yuyv_to_rgb565x_dual_row_c, yuyv_downscale2_row_c,
+     rgb565x_swap_green_row_c, rgb565x_swap_green_row_c,
+     rgb565x_swap_green_inplace_c, yuv420_to_yuyv_row_c},
+};
+
+#define N_KERNEL_SETS (sizeof(kernel_sets) / sizeof(kernel_sets[0]))
+
+static int kernel_set_supported(const struct kernel_set *k)
+{
+    if (!k->feature)
+        return 1;
+
+#ifdef CONVERT_X86
+    __builtin_cpu_init();
+
+    /* __builtin_cpu_supports() only takes string literals */
+    if (!strcmp(k->feature, "avx2"))
+        return __builtin_cpu_supports("avx2");
+    if (!strcmp(k->feature, "sse2"))
+        return __builtin_cpu_supports("sse2");
+#endif
+
+    return 0;
+}
+
+static void kernel_set_use(const struct kernel_set *k)
+{
+    yuyv_to_rgb24_row = k->rgb24;
+    yuyv_to_rgb565x_row = k->rgb565x;
+    yuyv_to_rgb565x_dual_row = k->rgb565x_dual;
+    yuyv_downscale2_row = k->downscale2;
+    rgb565x_swap_green_row = k->swap_green;
+    rgb565x_swap_green_row_nt = k->swap_green_nt;
+    rgb565x_swap_green_inplace = k->swap_green_inplace;
+    yuv420_to_yuyv_row = k->yuv420_pack;
+    convert_simd_name = k->name;
+}
+
+const char *convert_simd_names(unsigned int i)
+{
+    return i < N_KERNEL_SETS ? kernel_sets[i].name : NULL;
+}
+
+int convert_select(const char *name)
+{
+    unsigned int i;
+
+    for (i = 0; i < N_KERNEL_SETS; i++)
+    {
+        if (strcmp(kernel_sets[i].name, name))
+            continue;
+
+        if (!kernel_set_supported(&kernel_sets[i]))
+            return -1;
+
+        kernel_set_use(&kernel_sets[i]);
+        return 0;
+    }
+
+    return -1;
+}
+
+void convert_init(void)
+{
+    unsigned int i;
+
+    generate_YCbCr_to_RGB_lookup();
+
+    for (i = 0; i < N_KERNEL_SETS; i++)
+    {
+        if (kernel_set_supported(&kernel_sets[i]))
+        {
+            kernel_set_use(&kernel_sets[i]);
+            break;
+        }
+    }
+}
@@ -0,0 +1,228 @@
+/*
+ * Copyright (C) 2012 by Tomasz Moń <desowin@gmail.com>
+ *
+ * Colorspace conversion helpers shared by the viewers.
+ *
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright
+ * notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+ * OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name of a copyright holder shall not
+ * be used in advertising or otherwise to promote the sale, use or other dealings
+ * in this Software without prior written authorization of the copyright holder.
+ */
+
+#ifndef CONVERT_H
+#define CONVERT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <endian.h>
+
+/* Fractional bits of the green contribution tables */
+#define YCBCR_FIX_BITS 20
+
+/*
+ * Per-channel YCbCr to RGB contribution tables (4 KiB in total)
+ *
+ * Indexes are Cb or Cr, range 0-255.
+ * Red and blue entries are whole numbers, green entries are fixed point
+ * with YCBCR_FIX_BITS fractional bits.
+ */
+extern int32_t YCbCr_Cr_to_R[256];
+extern int32_t YCbCr_Cb_to_G[256];
+extern int32_t YCbCr_Cr_to_G[256];
+extern int32_t YCbCr_Cb_to_B[256];
+
+void YCbCrToRGB(int y, int cb, int cr, uint8_t * r, uint8_t * g, uint8_t * b);
+
+void generate_YCbCr_to_RGB_lookup(void);
+
+/*
+ * Builds the lookup tables and selects the fastest row kernels the CPU
+ * supports. Call once before using any of the converters below.
+ */
+void convert_init(void);
+
+/* Name of the selected kernel set ("c", "sse2" or "avx2") */
+extern const char *convert_simd_name;
+
+/*
+ * Name of the i-th kernel set built in, fastest first, or NULL past the
+ * last one. Not every set has to be supported by the running CPU.
+ */
+const char *convert_simd_names(unsigned int i);
+
+/*
+ * Switches all row kernels to the named set. Returns -1 if there is no
+ * such set or the CPU does not support it. Mostly useful for comparing
+ * the sets, convert_init() already picks the fastest.
+ */
+int convert_select(const char *name);
+
+/*
+ * Converts one row of width YUYV pixels to packed RGB24.
+ * width must be even.
+ */
+extern void (*yuyv_to_rgb24_row) (uint8_t * dst, const uint8_t * src,
+                                  size_t width);
+
+/*
+ * Converts one row of width YUYV pixels to the RGB565X-like layout of
+ * YUV422_to_RGB565(). width must be even.
+ */
+extern void (*yuyv_to_rgb565x_row) (uint16_t * dst, const uint8_t * src,
+                                    size_t width);
+
+/*
+ * Same as yuyv_to_rgb565x_row(), and in the same pass also writes the
+ * row in real V4L2_PIX_FMT_RGB565X to dst_v4l2 (see RGB565X_swap_green()).
+ */
+extern void (*yuyv_to_rgb565x_dual_row) (uint16_t * dst, uint16_t * dst_v4l2,
+                                         const uint8_t * src, size_t width);
+
+/*
+ * Halves a YUYV image in both directions: src0 and src1 are two adjacent
+ * source rows of width pixels, dst receives (width / 4) * 2 pixels, each
+ * the average of a 2x2 block. The SIMD versions round twice and may come
+ * out 1 higher than the C version.
+ */
+extern void (*yuyv_downscale2_row) (uint8_t * dst, const uint8_t * src0,
+                                    const uint8_t * src1, size_t width);
+
+/*
+ * 4:2:0 rows: y holds width luma samples, u and v the chroma samples of
+ * the row pair, chroma_step bytes apart. That is 1 for planar YUV420,
+ * 2 for NV12 (v == u + 1) and NV21 (u == v + 1). width must be even.
+ *
+ * yuv420_to_yuyv_row() repacks a row as YUYV, the other two convert it
+ * through the YUYV kernels a cache sized chunk at a time, so they give
+ * the same results as those.
+ */
+extern void (*yuv420_to_yuyv_row) (uint8_t * dst, const uint8_t * y,
+                                   const uint8_t * u, const uint8_t * v,
+                                   size_t chroma_step, size_t width);
+
+void yuv420_to_rgb24_row(uint8_t * dst, const uint8_t * y, const uint8_t * u,
+                         const uint8_t * v, size_t chroma_step, size_t width);
+
+void yuv420_to_rgb565x_row(uint16_t * dst, const uint8_t * y,
+                           const uint8_t * u, const uint8_t * v,
+                           size_t chroma_step, size_t width);
+
+/*
+ * Applies RGB565X_swap_green() to n pixels, converting between
+ * V4L2_PIX_FMT_RGB565X and the SDL surface layout. dst may equal src.
+ */
+extern void (*rgb565x_swap_green_row) (uint16_t * dst, const uint16_t * src,
+                                       size_t n);
+
+/*
+ * Same as rgb565x_swap_green_row() but with streaming stores, which skip
+ * the cache. For buffers the CPU does not read back, such as mmap'd
+ * OUTPUT buffers of a device. dst must not overlap src.
+ */
+extern void (*rgb565x_swap_green_row_nt) (uint16_t * dst,
+                                          const uint16_t * src, size_t n);
+
+/* rgb565x_swap_green_row() with dst == src, aligned loads and stores */
+extern void (*rgb565x_swap_green_inplace) (uint16_t * buf, size_t n);
+
+static inline uint8_t clamp_u8(int v)
+{
+    if ((unsigned int)v > 255)
+        return v < 0 ? 0 : 255;
+    return v;
+}
+
+/**
+ *  Converts single YCbCr sample to RGB
+ *  Before first use call generate_YCbCr_to_RGB_lookup();
+ *
+ *  Red and blue match YCbCrToRGB() exactly. Green matches it in all but 72
+ *  of the 2^24 inputs, where the exact result is a whole number that the
+ *  double precision reference rounds down below; those differ by 1.
+ */
+static inline void YCbCr_to_RGB(uint8_t * rgb, int y, int cb, int cr)
+{
+    rgb[0] = clamp_u8(y + YCbCr_Cr_to_R[cr]);
+    rgb[1] = clamp_u8(y + ((YCbCr_Cb_to_G[cb] + YCbCr_Cr_to_G[cr])
+                           >> YCBCR_FIX_BITS));
+    rgb[2] = clamp_u8(y + YCbCr_Cb_to_B[cb]);
+}
+
+/**
+ *  Converts YUV422 to RGB
+ *  Before first use call generate_YCbCr_to_RGB_lookup();
+ *
+ *  input is pointer to YUV422 encoded data in following order: Y0, Cb, Y1, Cr.
+ *  output is pointer to 24 bit RGB buffer.
+ *  Output data is written in following order: R1, G1, B1, R2, G2, B2.
+ */
+static inline void YUV422_to_RGB(uint8_t * output, const uint8_t * input)
+{
+    YCbCr_to_RGB(&output[0], input[0], input[1], input[3]);
+    YCbCr_to_RGB(&output[3], input[2], input[1], input[3]);
+}
+
+/**
+ * Converts RGB888 color to RGB565
+ */
+static inline uint16_t RGB888_to_RGB565(uint32_t rgb)
+{
+    uint16_t tmp;
+
+    tmp = ((rgb >> 3) & 0x1F) << 11 |   /* Blue */
+        ((rgb >> 10) & 0x3F) << 5 | /* Green */
+        ((rgb >> 19) & 0x1F);   /* Red */
+
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+    /* In LE lower byte is stored under lower address */
+    tmp = ((tmp >> 8) & 0xFF) | ((tmp & 0xFF) << 8);
+#elif __BYTE_ORDER == __BIG_ENDIAN
+    /* Nothing to do */
+#else
+#error "Unknown Endianess"
+#endif
+
+    return tmp;
+}
+
+/**
+ * Swaps the higher and lower three bits of green, converting between
+ * V4L2_PIX_FMT_RGB565X and the layout SDL is told about. V4L2 stores
+ * the most significant green bits in byte 0, SDL expects them otherwise.
+ */
+static inline uint16_t RGB565X_swap_green(uint16_t px)
+{
+    return ((px & 0xE000) >> 13) | ((px & 0x0007) << 13) | (px & 0x1FF8);
+}
+
+/**
+ *  Converts YUV422 to RGB565
+ *  Before first use call generate_YCbCr_to_RGB_lookup();
+ *
+ *  input is pointer to YUV422 encoded data in following order: Y0, Cb, Y1, Cr.
+ *  output is pointer to 16 bit RGB565X buffer.
+ */
+static inline void YUV422_to_RGB565(uint16_t * output, const uint8_t * input)
+{
+    uint8_t rgb[6];
+
+    YUV422_to_RGB(rgb, input);
+
+    output[0] = RGB888_to_RGB565(rgb[0] << 16 | rgb[1] << 8 | rgb[2]);
+    output[1] = RGB888_to_RGB565(rgb[3] << 16 | rgb[4] << 8 | rgb[5]);
+}
+
+#endif /* CONVERT_H */
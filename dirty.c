@@ -0,0 +1,163 @@
+/*
+ * Copyright (C) 2012 by Tomasz Moń <desowin@gmail.com>
+ *
+ * Change detection on fixed size tiles, by per tile hashes.
+ *
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright
+ * notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+ * OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name of a copyright holder shall not
+ * be used in advertising or otherwise to promote the sale, use or other dealings
+ * in this Software without prior written authorization of the copyright holder.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dirty.h"
+
+/* xxHash64 primes, good enough mixing at a few cycles per 8 bytes */
+#define PRIME1 0x9E3779B185EBCA87ULL
+#define PRIME2 0xC2B2AE3D27D4EB4FULL
+
+static inline uint64_t rotl64(uint64_t v, int n)
+{
+    return v << n | v >> (64 - n);
+}
+
+static inline uint64_t round64(uint64_t acc, uint64_t v)
+{
+    return rotl64(acc + v * PRIME2, 31) * PRIME1;
+}
+
+static inline uint64_t load64(const uint8_t * p)
+{
+    uint64_t v;
+
+    memcpy(&v, p, sizeof(v));
+
+    return v;
+}
+
+/*
+ * Four independent lanes keep the multiplier busy. Rows are folded in
+ * one after the other, so a change anywhere in the tile shows.
+ */
+static uint64_t hash_tile(const uint8_t * src, size_t stride, size_t bytes,
+                          size_t rows)
+{
+    uint64_t acc[4] = { PRIME1, PRIME2, ~PRIME1, ~PRIME2 };
+    size_t y, i;
+
+    for (y = 0; y < rows; y++, src += stride)
+    {
+        for (i = 0; i + 32 <= bytes; i += 32)
+        {
+            acc[0] = round64(acc[0], load64(src + i));
+            acc[1] = round64(acc[1], load64(src + i + 8));
+            acc[2] = round64(acc[2], load64(src + i + 16));
+            acc[3] = round64(acc[3], load64(src + i + 24));
+        }
+
+        for (; i + 8 <= bytes; i += 8)
+            acc[0] = round64(acc[0], load64(src + i));
+
+        /* YUYV rows are a multiple of 4 bytes */
+        if (i < bytes)
+        {
+            uint32_t tail;
+
+            memcpy(&tail, src + i, sizeof(tail));
+            acc[1] = round64(acc[1], tail);
+        }
+    }
+
+    return rotl64(acc[0], 1) + rotl64(acc[1], 7) + rotl64(acc[2], 12) +
+        rotl64(acc[3], 18);
+}
+
+int dirty_init(struct dirty *d, size_t width, size_t height)
+{
+    memset(d, 0, sizeof(*d));
+
+    d->width = width;
+    d->height = height;
+    d->cols = (width + DIRTY_TILE - 1) / DIRTY_TILE;
+    d->rows = (height + DIRTY_TILE - 1) / DIRTY_TILE;
+
+    d->hashes = calloc(d->cols * d->rows, sizeof(*d->hashes));
+    d->changed = calloc(d->cols * d->rows, sizeof(*d->changed));
+
+    if (!d->hashes || !d->changed)
+    {
+        dirty_free(d);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    return 0;
+}
+
+void dirty_free(struct dirty *d)
+{
+    free(d->hashes);
+    free(d->changed);
+
+    d->hashes = NULL;
+    d->changed = NULL;
+}
+
+void dirty_tile(const struct dirty *d, unsigned int col, unsigned int row,
+                size_t * x, size_t * y, size_t * w, size_t * h)
+{
+    *x = col * DIRTY_TILE;
+    *y = row * DIRTY_TILE;
+    *w = d->width - *x < DIRTY_TILE ? d->width - *x : DIRTY_TILE;
+    *h = d->height - *y < DIRTY_TILE ? d->height - *y : DIRTY_TILE;
+}
+
+int dirty_check(struct dirty *d, unsigned int col, unsigned int row,
+                const uint8_t * src, size_t stride)
+{
+    unsigned int tile = row * d->cols + col;
+    size_t x, y, w, h;
+    uint64_t hash;
+
+    dirty_tile(d, col, row, &x, &y, &w, &h);
+
+    hash = hash_tile(src, stride, w * 2, h);
+
+    d->changed[tile] = !d->primed || hash != d->hashes[tile];
+    d->hashes[tile] = hash;
+
+    return d->changed[tile];
+}
+
+unsigned int dirty_commit(struct dirty *d)
+{
+    unsigned int i, changed = 0;
+
+    for (i = 0; i < d->cols * d->rows; i++)
+        changed += d->changed[i];
+
+    d->primed = 1;
+    d->frames++;
+    d->tiles_changed += changed;
+
+    if (!changed)
+        d->frames_static++;
+
+    return changed;
+}
@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2012 by Tomasz Moń <desowin@gmail.com>
+ *
+ * Change detection on fixed size tiles, by per tile hashes.
+ *
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright
+ * notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+ * OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name of a copyright holder shall not
+ * be used in advertising or otherwise to promote the sale, use or other dealings
+ * in this Software without prior written authorization of the copyright holder.
+ */
+
+#ifndef DIRTY_H
+#define DIRTY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Tile edge in pixels, the last row and column of tiles may be smaller */
+#define DIRTY_TILE 64
+
+/*
+ * One 64 bit hash per tile of the previous frame. A tile counts as
+ * changed when its hash differs, so a collision (odds of 2^-64 per tile)
+ * would leave it stale until it changes again.
+ */
+struct dirty
+{
+    size_t width;
+    size_t height;
+    unsigned int cols;
+    unsigned int rows;
+
+    uint64_t *hashes;
+    uint8_t *changed;           /* by tile, for the frame being checked */
+    int primed;                 /* hashes hold a frame */
+
+    unsigned long frames;
+    unsigned long frames_static;    /* no tile changed */
+    unsigned long tiles_changed;
+};
+
+int dirty_init(struct dirty *d, size_t width, size_t height);
+
+void dirty_free(struct dirty *d);
+
+/* Tile col, row covers w x h pixels from x, y */
+void dirty_tile(const struct dirty *d, unsigned int col, unsigned int row,
+                size_t * x, size_t * y, size_t * w, size_t * h);
+
+/*
+ * Hashes tile col, row of a YUYV frame, src pointing to its top left
+ * pixel and stride bytes between rows. Returns non-zero if it changed
+ * since the previous frame, always before the first dirty_commit().
+ * Threads may check different tiles of the same frame at once.
+ */
+int dirty_check(struct dirty *d, unsigned int col, unsigned int row,
+                const uint8_t * src, size_t stride);
+
+/* Ends a frame once all its tiles were checked, returns those changed */
+unsigned int dirty_commit(struct dirty *d);
+
+/* Forgets the previous frame, the next one is changed everywhere */
+static inline void dirty_reset(struct dirty *d)
+{
+    d->primed = 0;
+}
+
+#endif /* DIRTY_H */
@@ -0,0 +1,120 @@
+/*
+ * Copyright (C) 2012 by Tomasz Moń <desowin@gmail.com>
+ *
+ * Log-linear latency histograms.
+ *
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright
+ * notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+ * OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name of a copyright holder shall not
+ * be used in advertising or otherwise to promote the sale, use or other dealings
+ * in this Software without prior written authorization of the copyright holder.
+ */
+
+#include "latency.h"
+
+static unsigned int bucket_index(uint64_t v)
+{
+    unsigned int e;
+
+    if (v < LATENCY_SUB)
+        return v;
+
+    e = 63 - __builtin_clzll(v);
+
+    return (e - LATENCY_SUB_BITS + 1) * LATENCY_SUB +
+        ((v >> (e - LATENCY_SUB_BITS)) & (LATENCY_SUB - 1));
+}
+
+/* Highest value that falls into bucket i */
+static uint64_t bucket_value(unsigned int i)
+{
+    unsigned int e, m;
+
+    if (i < LATENCY_SUB)
+        return i;
+
+    e = i / LATENCY_SUB + LATENCY_SUB_BITS - 1;
+    m = i % LATENCY_SUB;
+
+    return ((uint64_t)(LATENCY_SUB + m + 1) << (e - LATENCY_SUB_BITS)) - 1;
+}
+
+/*
+ * Counter by counter, recorders may be running on other threads. A sample
+ * landing mid reset may be kept or dropped, it is never torn.
+ */
+void latency_reset(struct latency *l)
+{
+    unsigned int i;
+
+    for (i = 0; i < LATENCY_BUCKETS; i++)
+        __atomic_store_n(&l->counts[i], 0, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&l->total, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&l->max, 0, __ATOMIC_RELAXED);
+}
+
+void latency_record(struct latency *l, uint64_t ns)
+{
+    uint64_t max = __atomic_load_n(&l->max, __ATOMIC_RELAXED);
+
+    __atomic_fetch_add(&l->counts[bucket_index(ns)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&l->total, 1, __ATOMIC_RELAXED);
+
+    while (ns > max &&
+           !__atomic_compare_exchange_n(&l->max, &max, ns, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+uint64_t latency_percentile(const struct latency *l, double pct)
+{
+    uint64_t total = __atomic_load_n(&l->total, __ATOMIC_RELAXED);
+    uint64_t wanted = total * pct / 100.0 + 0.5;
+    uint64_t seen = 0;
+    unsigned int i;
+
+    if (wanted == 0)
+        wanted = 1;
+
+    for (i = 0; i < LATENCY_BUCKETS; i++)
+    {
+        seen += __atomic_load_n(&l->counts[i], __ATOMIC_RELAXED);
+
+        if (seen >= wanted)
+        {
+            uint64_t v = bucket_value(i);
+            uint64_t max = __atomic_load_n(&l->max, __ATOMIC_RELAXED);
+
+            return v < max ? v : max;
+        }
+    }
+
+    return __atomic_load_n(&l->max, __ATOMIC_RELAXED);
+}
+
+void latency_print(const struct latency *l, FILE * fp, const char *name)
+{
+    uint64_t total = __atomic_load_n(&l->total, __ATOMIC_RELAXED);
+
+    if (!total)
+        return;
+
+    fprintf(fp, "  %-16s %8llu  p50 %7.2f  p90 %7.2f  p99 %7.2f  "
+            "max %7.2f ms\n", name, (unsigned long long)total,
+            latency_percentile(l, 50) / 1e6, latency_percentile(l, 90) / 1e6,
+            latency_percentile(l, 99) / 1e6,
+            __atomic_load_n(&l->max, __ATOMIC_RELAXED) / 1e6);
+}
@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2012 by Tomasz Moń <desowin@gmail.com>
+ *
+ * Log-linear latency histograms.
+ *
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright
+ * notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+ * OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name of a copyright holder shall not
+ * be used in advertising or otherwise to promote the sale, use or other dealings
+ * in this Software without prior written authorization of the copyright holder.
+ */
+
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <sys/time.h>
+
+/*
+ * Sub-buckets per power of two. 16 keeps every bucket within 1/16 (6%) of
+ * the values it holds, from 1 ns up to the full 64 bit range.
+ */
+#define LATENCY_SUB_BITS 4
+#define LATENCY_SUB (1 << LATENCY_SUB_BITS)
+#define LATENCY_BUCKETS ((64 - LATENCY_SUB_BITS + 1) * LATENCY_SUB)
+
+/*
+ * Fixed size histogram of nanosecond values, in the spirit of HdrHistogram.
+ * Recording is lock free, so several threads may record into one while
+ * another resets or reads it.
+ */
+struct latency
+{
+    uint32_t counts[LATENCY_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+};
+
+void latency_reset(struct latency *l);
+
+void latency_record(struct latency *l, uint64_t ns);
+
+/* Smallest value that pct percent of the samples do not exceed */
+uint64_t latency_percentile(const struct latency *l, double pct);
+
+/* One line with name, sample count, p50, p90, p99 and max in ms */
+void latency_print(const struct latency *l, FILE * fp, const char *name);
+
+static inline uint64_t latency_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* For v4l2_buffer.timestamp, see V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC */
+static inline uint64_t latency_timeval(const struct timeval *tv)
+{
+    return tv->tv_sec * 1000000000ull + tv->tv_usec * 1000ull;
+}
+
+static inline struct timeval latency_to_timeval(uint64_t ns)
+{
+    struct timeval tv;
+
+    tv.tv_sec = ns / 1000000000ull;
+    tv.tv_usec = ns % 1000000000ull / 1000;
+
+    return tv;
+}
+
+#endif /* LATENCY_H */
@@ -0,0 +1,969 @@
+/*
+ * Copyright (C) 2012 by Tomasz Moń <desowin@gmail.com>
+ *
+ * mem2mem device backends: the kernel driver or an in-process emulator.
+ *
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright
+ * notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+ * OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name of a copyright holder shall not
+ * be used in advertising or otherwise to promote the sale, use or other dealings
+ * in this Software without prior written authorization of the copyright holder.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include "m2m.h"
+
+#define EMU_MAX_BUFS VIDEO_MAX_FRAME
+
+/* CAPTURE buffer offsets start here, as with v4l2-mem2mem */
+#define EMU_DST_OFFSET (1 << 30)
+
+/* mem2mem_testdev limits, except that transactions may take no time */
+#define EMU_MIN_DIM 32
+#define EMU_MAX_DIM 8192
+#define EMU_DEF_TRANSTIME 1000
+#define EMU_MAX_TRANSTIME 10000
+
+static const struct
+{
+    uint32_t pixelformat;
+    const char *description;
+} emu_formats[] = {
+    {V4L2_PIX_FMT_RGB565X, "RGB565 (BE)"},
+    {V4L2_PIX_FMT_YUYV, "4:2:2, packed, YUYV"},
+};
+
+#define EMU_N_FORMATS (sizeof(emu_formats) / sizeof(emu_formats[0]))
+
+/* Buffer indexes in the order they were queued or finished */
+struct emu_fifo
+{
+    unsigned int index[EMU_MAX_BUFS];
+    unsigned int head;
+    unsigned int n;
+};
+
+struct emu_buf
+{
+    uint32_t flags;
+    uint32_t bytesused;
+    uint32_t sequence;
+    struct timeval timestamp;
+};
+
+struct emu_queue
+{
+    enum v4l2_buf_type type;
+    const char *name;
+    struct v4l2_pix_format pix;
+
+    /* count buffers of buf_size bytes each, offset apart from 0 */
+    off_t offset;
+    int memfd;
+    uint8_t *mem;
+    size_t buf_size;
+    unsigned int count;
+
+    int streaming;
+    uint32_t sequence;
+    struct emu_buf bufs[EMU_MAX_BUFS];
+
+    struct emu_fifo queued;
+    struct emu_fifo done;
+};
+
+struct emu
+{
+    /* eventfd, readable while dst.done is not empty */
+    int fd;
+    int nonblock;
+    struct emu *next;
+
+    pthread_t *threads;
+    unsigned int n_threads;
+
+    /* Everything below is under lock */
+    pthread_mutex_t lock;
+    /* A job may be ready, or quit set */
+    pthread_cond_t work;
+    /* A job finished or a queue stopped */
+    pthread_cond_t changed;
+    int quit;
+
+    struct emu_queue src;
+    struct emu_queue dst;
+
+    int hflip;
+    int vflip;
+    int transtime;
+    int translen;
+
+    /* Jobs are numbered as they start and finish in that order */
+    uint64_t jobs_started;
+    uint64_t jobs_finished;
+};
+
+static pthread_mutex_t emus_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct emu *emus = NULL;
+
+static struct emu *emu_find(int fd)
+{
+    struct emu *e;
+
+    /* Kernel devices only */
+    if (!__atomic_load_n(&emus, __ATOMIC_ACQUIRE))
+        return NULL;
+
+    pthread_mutex_lock(&emus_lock);
+
+    for (e = emus; e && e->fd != fd; e = e->next)
+        ;
+
+    pthread_mutex_unlock(&emus_lock);
+
+    return e;
+}
+
+static void fifo_push(struct emu_fifo *f, unsigned int index)
+{
+    f->index[(f->head + f->n++) % EMU_MAX_BUFS] = index;
+}
+
+static unsigned int fifo_pop(struct emu_fifo *f)
+{
+    unsigned int index = f->index[f->head];
+
+    f->head = (f->head + 1) % EMU_MAX_BUFS;
+    f->n--;
+
+    return index;
+}
+
+static struct emu_queue *emu_queue(struct emu *e, uint32_t type)
+{
+    switch (type)
+    {
+    case V4L2_BUF_TYPE_VIDEO_OUTPUT:
+        return &e->src;
+
+    case V4L2_BUF_TYPE_VIDEO_CAPTURE:
+        return &e->dst;
+
+    default:
+        return NULL;
+    }
+}
+
+static void emu_clear_done(struct emu *e, struct emu_queue *q)
+{
+    eventfd_t value;
+
+    q->done.n = 0;
+
+    if (q == &e->dst)
+        eventfd_read(e->fd, &value);
+}
+
+static int emu_job_ready(const struct emu *e)
+{
+    return e->src.streaming && e->dst.streaming &&
+        e->src.queued.n >= e->translen && e->dst.queued.n >= e->translen;
+}
+
+/* Copies a source buffer to a destination buffer as mem2mem_testdev does */
+static void emu_process(const struct v4l2_pix_format *spix,
+                        const uint8_t * src,
+                        const struct v4l2_pix_format *dpix, uint8_t * dst,
+                        int hflip, int vflip)
+{
+    size_t width = spix->width < dpix->width ? spix->width : dpix->width;
+    size_t height = spix->height < dpix->height ? spix->height :
+        dpix->height;
+    size_t x, y;
+
+    /* Both formats have 16 bit pixels, which is all the flips look at */
+    for (y = 0; y < height; y++)
+    {
+        const uint16_t *s = (const uint16_t *)(src + spix->bytesperline *
+                                               (vflip ? height - 1 - y : y));
+        uint16_t *d = (uint16_t *) (dst + dpix->bytesperline * y);
+
+        if (!hflip)
+        {
+            memcpy(d, s, width * 2);
+            continue;
+        }
+
+        for (x = 0; x < width; x++)
+            d[x] = s[width - 1 - x];
+    }
+}
+
+static void emu_sleep_ms(int ms)
+{
+    struct timespec ts = {
+        .tv_sec = ms / 1000,
+        .tv_nsec = ms % 1000 * 1000000l,
+    };
+
+    while (EINTR == clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, &ts))
+        ;
+}
+
+static void emu_finish(struct emu *e, unsigned int s, unsigned int d)
+{
+    struct emu_buf *sb = &e->src.bufs[s];
+    struct emu_buf *db = &e->dst.bufs[d];
+
+    db->timestamp = sb->timestamp;
+    db->bytesused = e->dst.pix.sizeimage;
+    sb->sequence = e->src.sequence++;
+    db->sequence = e->dst.sequence++;
+    sb->flags = V4L2_BUF_FLAG_DONE;
+    db->flags = V4L2_BUF_FLAG_DONE;
+
+    fifo_push(&e->src.done, s);
+    fifo_push(&e->dst.done, d);
+
+    if (e->dst.done.n == 1)
+        eventfd_write(e->fd, 1);
+}
+
+/*
+ * Runs one job of translen buffer pairs at a time, like the device. Each
+ * pair takes transtime milliseconds on top of the copy.
+ */
+static void *emu_thread(void *arg)
+{
+    struct emu *e = arg;
+    unsigned int src[EMU_MAX_BUFS];
+    unsigned int dst[EMU_MAX_BUFS];
+    struct v4l2_pix_format spix, dpix;
+    const uint8_t *smem;
+    uint8_t *dmem;
+    size_t ssize, dsize;
+    int hflip, vflip, transtime;
+    unsigned int i, n;
+    uint64_t job;
+
+    pthread_mutex_lock(&e->lock);
+
+    for (;;)
+    {
+        while (!e->quit && !emu_job_ready(e))
+            pthread_cond_wait(&e->work, &e->lock);
+
+        if (e->quit)
+            break;
+
+        n = e->translen;
+
+        for (i = 0; i < n; i++)
+        {
+            src[i] = fifo_pop(&e->src.queued);
+            dst[i] = fifo_pop(&e->dst.queued);
+        }
+
+        job = e->jobs_started++;
+
+        /* Buffers cannot go away while a job runs, see emu_streamoff() */
+        spix = e->src.pix;
+        dpix = e->dst.pix;
+        smem = e->src.mem;
+        dmem = e->dst.mem;
+        ssize = e->src.buf_size;
+        dsize = e->dst.buf_size;
+        hflip = e->hflip;
+        vflip = e->vflip;
+        transtime = e->transtime;
+
+        /* More than one job may have become ready */
+        if (emu_job_ready(e))
+            pthread_cond_signal(&e->work);
+
+        pthread_mutex_unlock(&e->lock);
+
+        for (i = 0; i < n; i++)
+        {
+            emu_process(&spix, smem + src[i] * ssize, &dpix,
+                        dmem + dst[i] * dsize, hflip, vflip);
+
+            if (transtime)
+                emu_sleep_ms(transtime);
+        }
+
+        pthread_mutex_lock(&e->lock);
+
+        while (e->jobs_finished != job)
+            pthread_cond_wait(&e->changed, &e->lock);
+
+        for (i = 0; i < n; i++)
+            emu_finish(e, src[i], dst[i]);
+
+        e->jobs_finished++;
+        pthread_cond_broadcast(&e->changed);
+    }
+
+    pthread_mutex_unlock(&e->lock);
+
+    return NULL;
+}
+
+static void emu_try_fmt(struct v4l2_pix_format *pix)
+{
+    unsigned int i;
+
+    for (i = 0; i < EMU_N_FORMATS; i++)
+        if (emu_formats[i].pixelformat == pix->pixelformat)
+            break;
+
+    if (i == EMU_N_FORMATS)
+        pix->pixelformat = emu_formats[0].pixelformat;
+
+    if (pix->width < EMU_MIN_DIM)
+        pix->width = EMU_MIN_DIM;
+    if (pix->width > EMU_MAX_DIM)
+        pix->width = EMU_MAX_DIM;
+    if (pix->height < EMU_MIN_DIM)
+        pix->height = EMU_MIN_DIM;
+    if (pix->height > EMU_MAX_DIM)
+        pix->height = EMU_MAX_DIM;
+
+    /* The device works in blocks of 8 pixels */
+    pix->width &= ~7;
+
+    pix->field = V4L2_FIELD_NONE;
+    pix->bytesperline = pix->width * 2;
+    pix->sizeimage = pix->bytesperline * pix->height;
+    pix->colorspace = V4L2_COLORSPACE_SRGB;
+    pix->priv = 0;
+}
+
+static void emu_free_bufs(struct emu_queue *q)
+{
+    if (q->mem)
+        munmap(q->mem, q->count * q->buf_size);
+
+    if (q->memfd >= 0)
+        close(q->memfd);
+
+    q->mem = NULL;
+    q->memfd = -1;
+    q->count = 0;
+    q->queued.n = 0;
+    q->done.n = 0;
+    memset(q->bufs, 0, sizeof(q->bufs));
+}
+
+/* Buffers live in a memfd, so the application can map them on its own */
+static int emu_alloc_bufs(struct emu_queue *q, unsigned int count)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    int ret;
+
+    q->buf_size = (q->pix.sizeimage + page - 1) / page * page;
+
+    q->memfd = memfd_create(q->name, MFD_CLOEXEC);
+    if (q->memfd < 0)
+        return errno;
+
+    if (-1 == ftruncate(q->memfd, q->buf_size * count))
+    {
+        ret = errno;
+        emu_free_bufs(q);
+        return ret;
+    }
+
+    q->mem = mmap(NULL, q->buf_size * count, PROT_READ | PROT_WRITE,
+                  MAP_SHARED, q->memfd, 0);
+    if (MAP_FAILED == q->mem)
+    {
+        ret = errno;
+        q->mem = NULL;
+        emu_free_bufs(q);
+        return ret;
+    }
+
+    q->count = count;
+
+    return 0;
+}
+
+static void emu_fill_buf(const struct emu_queue *q, unsigned int index,
+                         struct v4l2_buffer *buf)
+{
+    const struct emu_buf *b = &q->bufs[index];
+
+    buf->index = index;
+    buf->type = q->type;
+    buf->memory = V4L2_MEMORY_MMAP;
+    buf->bytesused = b->bytesused;
+    buf->flags = b->flags | V4L2_BUF_FLAG_TIMESTAMP_COPY;
+    buf->field = V4L2_FIELD_NONE;
+    buf->timestamp = b->timestamp;
+    buf->sequence = b->sequence;
+    buf->m.offset = q->offset + index * q->buf_size;
+    buf->length = q->pix.sizeimage;
+}
+
+static int emu_querycap(struct emu *e, struct v4l2_capability *cap)
+{
+    memset(cap, 0, sizeof(*cap));
+
+    strncpy((char *)cap->driver, "m2m-emu", sizeof(cap->driver) - 1);
+    strncpy((char *)cap->card, "mem2mem testdev emulator",
+            sizeof(cap->card) - 1);
+    strncpy((char *)cap->bus_info, "platform:m2m-emu",
+            sizeof(cap->bus_info) - 1);
+
+    cap->version = 1;
+    cap->device_caps = V4L2_CAP_VIDEO_CAPTURE | V4L2_CAP_VIDEO_OUTPUT |
+        V4L2_CAP_STREAMING;
+    cap->capabilities = cap->device_caps | V4L2_CAP_DEVICE_CAPS;
+
+    return 0;
+}
+
+static int emu_enum_fmt(struct emu *e, struct v4l2_fmtdesc *f)
+{
+    if (!emu_queue(e, f->type) || f->index >= EMU_N_FORMATS)
+        return EINVAL;
+
+    f->flags = 0;
+    f->pixelformat = emu_formats[f->index].pixelformat;
+    strncpy((char *)f->description, emu_formats[f->index].description,
+            sizeof(f->description) - 1);
+
+    return 0;
+}
+
+static int emu_fmt(struct emu *e, unsigned long request, struct v4l2_format *f)
+{
+    struct emu_queue *q = emu_queue(e, f->type);
+
+    if (!q)
+        return EINVAL;
+
+    if (VIDIOC_G_FMT == request)
+    {
+        f->fmt.pix = q->pix;
+        return 0;
+    }
+
+    emu_try_fmt(&f->fmt.pix);
+
+    if (VIDIOC_S_FMT == request)
+    {
+        if (q->count)
+            return EBUSY;
+
+        q->pix = f->fmt.pix;
+    }
+
+    return 0;
+}
+
+static int emu_ctrl(struct emu *e, unsigned long request,
+                    struct v4l2_control *c)
+{
+    int *value;
+    int lo, hi;
+
+    switch (c->id)
+    {
+    case V4L2_CID_HFLIP:
+        value = &e->hflip;
+        lo = 0;
+        hi = 1;
+        break;
+
+    case V4L2_CID_VFLIP:
+        value = &e->vflip;
+        lo = 0;
+        hi = 1;
+        break;
+
+    case V4L2_CID_TRANS_TIME_MSEC:
+        value = &e->transtime;
+        lo = 0;
+        hi = EMU_MAX_TRANSTIME;
+        break;
+
+    case V4L2_CID_TRANS_NUM_BUFS:
+        value = &e->translen;
+        lo = 1;
+        hi = EMU_MAX_BUFS;
+        break;
+
+    default:
+        return EINVAL;
+    }
+
+    if (VIDIOC_G_CTRL == request)
+    {
+        c->value = *value;
+        return 0;
+    }
+
+    if (c->value < lo || c->value > hi)
+        return ERANGE;
+
+    *value = c->value;
+
+    /* A shorter transaction may make a job ready */
+    pthread_cond_broadcast(&e->work);
+
+    return 0;
+}
+
+static int emu_reqbufs(struct emu *e, struct v4l2_requestbuffers *req)
+{
+    struct emu_queue *q = emu_queue(e, req->type);
+
+    if (!q || req->memory != V4L2_MEMORY_MMAP)
+        return EINVAL;
+
+    if (q->streaming)
+        return EBUSY;
+
+    emu_free_bufs(q);
+
+    if (q == &e->dst)
+        emu_clear_done(e, q);
+
+    if (!req->count)
+        return 0;
+
+    if (req->count > EMU_MAX_BUFS)
+        req->count = EMU_MAX_BUFS;
+
+    return emu_alloc_bufs(q, req->count);
+}
+
+static int emu_querybuf(struct emu *e, struct v4l2_buffer *buf)
+{
+    struct emu_queue *q = emu_queue(e, buf->type);
+
+    if (!q || buf->index >= q->count)
+        return EINVAL;
+
+    emu_fill_buf(q, buf->index, buf);
+
+    return 0;
+}
+
+static int emu_qbuf(struct emu *e, struct v4l2_buffer *buf)
+{
+    struct emu_queue *q = emu_queue(e, buf->type);
+    struct emu_buf *b;
+
+    if (!q || buf->memory != V4L2_MEMORY_MMAP || buf->index >= q->count)
+        return EINVAL;
+
+    b = &q->bufs[buf->index];
+
+    if (b->flags & (V4L2_BUF_FLAG_QUEUED | V4L2_BUF_FLAG_DONE))
+        return EINVAL;
+
+    /* Copied to the CAPTURE buffer the source ends up in */
+    if (q == &e->src)
+    {
+        b->timestamp = buf->timestamp;
+        b->bytesused = buf->bytesused ? buf->bytesused : q->pix.sizeimage;
+    }
+
+    b->flags = V4L2_BUF_FLAG_QUEUED;
+    fifo_push(&q->queued, buf->index);
+
+    emu_fill_buf(q, buf->index, buf);
+
+    if (emu_job_ready(e))
+        pthread_cond_signal(&e->work);
+
+    return 0;
+}
+
+static int emu_dqbuf(struct emu *e, struct v4l2_buffer *buf)
+{
+    struct emu_queue *q = emu_queue(e, buf->type);
+    unsigned int index;
+
+    if (!q || buf->memory != V4L2_MEMORY_MMAP)
+        return EINVAL;
+
+    while (!q->done.n)
+    {
+        if (e->nonblock)
+            return EAGAIN;
+
+        if (!q->streaming)
+            return EINVAL;
+
+        pthread_cond_wait(&e->changed, &e->lock);
+    }
+
+    index = fifo_pop(&q->done);
+
+    emu_fill_buf(q, index, buf);
+    q->bufs[index].flags = 0;
+
+    if (!q->done.n)
+        emu_clear_done(e, q);
+
+    return 0;
+}
+
+static int emu_streamon(struct emu *e, const uint32_t * type)
+{
+    struct emu_queue *q = emu_queue(e, *type);
+
+    if (!q || !q->count)
+        return EINVAL;
+
+    q->streaming = 1;
+    pthread_cond_broadcast(&e->work);
+
+    return 0;
+}
+
+/* Waits for running jobs, then hands every buffer back */
+static int emu_streamoff(struct emu *e, const uint32_t * type)
+{
+    struct emu_queue *q = emu_queue(e, *type);
+    unsigned int i;
+
+    if (!q)
+        return EINVAL;
+
+    q->streaming = 0;
+
+    while (e->jobs_started != e->jobs_finished)
+        pthread_cond_wait(&e->changed, &e->lock);
+
+    q->queued.n = 0;
+    emu_clear_done(e, q);
+    q->sequence = 0;
+
+    for (i = 0; i < q->count; i++)
+        q->bufs[i].flags = 0;
+
+    /* Blocking DQBUF gives up */
+    pthread_cond_broadcast(&e->changed);
+
+    return 0;
+}
+
+/* Returns 0 or an errno value, called with e->lock held */
+static int emu_ioctl(struct emu *e, unsigned long request, void *arg)
+{
+    switch (request)
+    {
+    case VIDIOC_QUERYCAP:
+        return emu_querycap(e, arg);
+
+    case VIDIOC_ENUM_FMT:
+        return emu_enum_fmt(e, arg);
+
+    case VIDIOC_G_FMT:
+    case VIDIOC_S_FMT:
+    case VIDIOC_TRY_FMT:
+        return emu_fmt(e, request, arg);
+
+    case VIDIOC_G_CTRL:
+    case VIDIOC_S_CTRL:
+        return emu_ctrl(e, request, arg);
+
+    case VIDIOC_REQBUFS:
+        return emu_reqbufs(e, arg);
+
+    case VIDIOC_QUERYBUF:
+        return emu_querybuf(e, arg);
+
+    case VIDIOC_QBUF:
+        return emu_qbuf(e, arg);
+
+    case VIDIOC_DQBUF:
+        return emu_dqbuf(e, arg);
+
+    case VIDIOC_STREAMON:
+        return emu_streamon(e, arg);
+
+    case VIDIOC_STREAMOFF:
+        return emu_streamoff(e, arg);
+
+    default:
+        return ENOTTY;
+    }
+}
+
+static void emu_init_queue(struct emu_queue *q, enum v4l2_buf_type type,
+                           const char *name, off_t offset)
+{
+    q->type = type;
+    q->name = name;
+    q->offset = offset;
+    q->memfd = -1;
+
+    /* mem2mem_testdev starts out with this */
+    q->pix.width = 640;
+    q->pix.height = 480;
+    q->pix.pixelformat = V4L2_PIX_FMT_RGB565X;
+    emu_try_fmt(&q->pix);
+}
+
+static void emu_free(struct emu *e)
+{
+    emu_free_bufs(&e->src);
+    emu_free_bufs(&e->dst);
+
+    pthread_cond_destroy(&e->work);
+    pthread_cond_destroy(&e->changed);
+    pthread_mutex_destroy(&e->lock);
+
+    close(e->fd);
+    free(e->threads);
+    free(e);
+}
+
+static void emu_stop(struct emu *e)
+{
+    unsigned int i;
+
+    pthread_mutex_lock(&e->lock);
+    e->quit = 1;
+    pthread_cond_broadcast(&e->work);
+    pthread_mutex_unlock(&e->lock);
+
+    for (i = 0; i < e->n_threads; i++)
+        pthread_join(e->threads[i], NULL);
+}
+
+static int emu_open(int flags, unsigned int threads)
+{
+    struct emu *e = calloc(1, sizeof(*e));
+    pthread_condattr_t attr;
+    int ret;
+
+    if (!e)
+        return -1;
+
+    e->threads = calloc(threads, sizeof(*e->threads));
+    e->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if (!e->threads || e->fd < 0)
+    {
+        ret = e->threads ? errno : ENOMEM;
+        if (e->fd >= 0)
+            close(e->fd);
+        free(e->threads);
+        free(e);
+        errno = ret;
+        return -1;
+    }
+
+    e->nonblock = flags & O_NONBLOCK;
+    e->transtime = EMU_DEF_TRANSTIME;
+    e->translen = 1;
+
+    emu_init_queue(&e->src, V4L2_BUF_TYPE_VIDEO_OUTPUT, "m2m-emu-output", 0);
+    emu_init_queue(&e->dst, V4L2_BUF_TYPE_VIDEO_CAPTURE, "m2m-emu-capture",
+                   EMU_DST_OFFSET);
+
+    /* m2m_poll() timeouts are on the monotonic clock */
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&e->changed, &attr);
+    pthread_condattr_destroy(&attr);
+
+    pthread_cond_init(&e->work, NULL);
+    pthread_mutex_init(&e->lock, NULL);
+
+    for (e->n_threads = 0; e->n_threads < threads; e->n_threads++)
+    {
+        ret = pthread_create(&e->threads[e->n_threads], NULL, emu_thread, e);
+        if (ret)
+        {
+            emu_stop(e);
+            emu_free(e);
+            errno = ret;
+            return -1;
+        }
+    }
+
+    pthread_mutex_lock(&emus_lock);
+    e->next = emus;
+    __atomic_store_n(&emus, e, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&emus_lock);
+
+    return e->fd;
+}
+
+int m2m_open(const char *name, int flags, unsigned int emulate)
+{
+    if (emulate)
+        return emu_open(flags, emulate);
+
+    return open(name, flags, 0);
+}
+
+int m2m_close(int fd)
+{
+    struct emu *e = emu_find(fd);
+    struct emu **p;
+
+    if (!e)
+        return close(fd);
+
+    pthread_mutex_lock(&emus_lock);
+
+    for (p = &emus; *p != e; p = &(*p)->next)
+        ;
+
+    __atomic_store_n(p, e->next, __ATOMIC_RELEASE);
+
+    pthread_mutex_unlock(&emus_lock);
+
+    emu_stop(e);
+    emu_free(e);
+
+    return 0;
+}
+
+int m2m_ioctl(int fd, unsigned long request, void *arg)
+{
+    struct emu *e = emu_find(fd);
+    int ret;
+
+    if (!e)
+        return ioctl(fd, request, arg);
+
+    pthread_mutex_lock(&e->lock);
+    ret = emu_ioctl(e, request, arg);
+    pthread_mutex_unlock(&e->lock);
+
+    if (ret)
+    {
+        errno = ret;
+        return -1;
+    }
+
+    return 0;
+}
+
+void *m2m_mmap(void *addr, size_t length, int prot, int flags, int fd,
+               off_t offset)
+{
+    struct emu *e = emu_find(fd);
+    struct emu_queue *q;
+    int memfd;
+
+    if (!e)
+        return mmap(addr, length, prot, flags, fd, offset);
+
+    pthread_mutex_lock(&e->lock);
+
+    q = offset >= EMU_DST_OFFSET ? &e->dst : &e->src;
+    offset -= q->offset;
+    memfd = q->memfd;
+
+    if (memfd < 0 || offset < 0 || offset + length > q->count * q->buf_size)
+        memfd = -1;
+
+    pthread_mutex_unlock(&e->lock);
+
+    if (memfd < 0)
+    {
+        errno = EINVAL;
+        return MAP_FAILED;
+    }
+
+    return mmap(addr, length, prot, flags, memfd, offset);
+}
+
+static short emu_ready(const struct emu *e, short events)
+{
+    short revents = 0;
+
+    if ((events & POLLIN) && e->dst.done.n)
+        revents |= POLLIN;
+
+    if ((events & POLLOUT) && e->src.done.n)
+        revents |= POLLOUT;
+
+    return revents;
+}
+
+int m2m_poll(int fd, short events, int timeout_ms)
+{
+    struct emu *e = emu_find(fd);
+    struct pollfd pfd;
+    struct timespec deadline;
+    int revents;
+    int r;
+
+    if (!e)
+    {
+        pfd.fd = fd;
+        pfd.events = events;
+
+        r = poll(&pfd, 1, timeout_ms);
+
+        return r > 0 ? pfd.revents : r;
+    }
+
+    if (timeout_ms > 0)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += timeout_ms / 1000;
+        deadline.tv_nsec += timeout_ms % 1000 * 1000000l;
+
+        if (deadline.tv_nsec >= 1000000000l)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000l;
+        }
+    }
+
+    pthread_mutex_lock(&e->lock);
+
+    while (!(revents = emu_ready(e, events)) && timeout_ms)
+    {
+        if (timeout_ms < 0)
+            pthread_cond_wait(&e->changed, &e->lock);
+        else if (ETIMEDOUT == pthread_cond_timedwait(&e->changed, &e->lock,
+                                                     &deadline))
+        {
+            revents = emu_ready(e, events);
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&e->lock);
+
+    return revents;
+}
@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2012 by Tomasz Moń <desowin@gmail.com>
+ *
+ * mem2mem device backends: the kernel driver or an in-process emulator.
+ *
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright
+ * notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+ * OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name of a copyright holder shall not
+ * be used in advertising or otherwise to promote the sale, use or other dealings
+ * in this Software without prior written authorization of the copyright holder.
+ */
+
+#ifndef M2M_H
+#define M2M_H
+
+#include <poll.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include <linux/videodev2.h>
+
+/* mem2mem_testdev controls, also understood by the emulator */
+#define V4L2_CID_TRANS_TIME_MSEC        (V4L2_CID_PRIVATE_BASE)
+#define V4L2_CID_TRANS_NUM_BUFS         (V4L2_CID_PRIVATE_BASE + 1)
+
+/*
+ * Opens the mem2mem device name, or with emulate non-zero an in-process
+ * emulation of mem2mem_testdev instead, which processes transactions on
+ * emulate worker threads. The emulator supports MMAP buffers only. It
+ * completes transactions in order, whichever thread finishes first.
+ *
+ * Every other call below takes the returned fd and falls through to the
+ * system call of the same name for kernel devices.
+ */
+int m2m_open(const char *name, int flags, unsigned int emulate);
+
+int m2m_close(int fd);
+
+/* Sets errno and returns -1 on failure, like ioctl() */
+int m2m_ioctl(int fd, unsigned long request, void *arg);
+
+/*
+ * Maps a buffer at the offset VIDIOC_QUERYBUF returned. The mapping
+ * outlives m2m_close() and is undone with plain munmap().
+ */
+void *m2m_mmap(void *addr, size_t length, int prot, int flags, int fd,
+               off_t offset);
+
+/*
+ * poll() on a single device, POLLIN when a CAPTURE buffer is done and
+ * POLLOUT when an OUTPUT buffer is. Returns the ready events, 0 on
+ * timeout or -1 on error.
+ *
+ * An emulated fd is an eventfd, readable whenever a CAPTURE buffer is
+ * done, so it can go into epoll for EPOLLIN too. Only this call knows
+ * about its POLLOUT.
+ */
+int m2m_poll(int fd, short events, int timeout_ms);
+
+#endif /* M2M_H */
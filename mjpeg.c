@@ -0,0 +1,337 @@
+/*
+ * Copyright (C) 2012 by Tomasz Moń <desowin@gmail.com>
+ *
+ * MJPEG decoding on a thread pool, frames handed back in capture order.
+ *
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright
+ * notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+ * OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name of a copyright holder shall not
+ * be used in advertising or otherwise to promote the sale, use or other dealings
+ * in this Software without prior written authorization of the copyright holder.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include <jpeglib.h>
+
+#include "mjpeg.h"
+
+/* libjpeg reports errors through error_exit(), which must not return */
+struct decoder_error
+{
+    struct jpeg_error_mgr pub;
+    jmp_buf jump;
+};
+
+struct decoder
+{
+    struct jpeg_decompress_struct cinfo;
+    struct decoder_error error;
+};
+
+static void decoder_error_exit(j_common_ptr cinfo)
+{
+    struct decoder_error *error = (struct decoder_error *)cinfo->err;
+
+    longjmp(error->jump, 1);
+}
+
+/* USB transfers often cut frames short, decode() counts those instead */
+static void decoder_output_message(j_common_ptr cinfo)
+{
+}
+
+static void decoder_init(struct decoder *d)
+{
+    d->cinfo.err = jpeg_std_error(&d->error.pub);
+    d->error.pub.error_exit = decoder_error_exit;
+    d->error.pub.output_message = decoder_output_message;
+
+    jpeg_create_decompress(&d->cinfo);
+}
+
+/*
+ * Returns 0 if the frame is corrupt, cut short or not width x height.
+ * libjpeg only warns about the latter two and pads them. Frames without
+ * Huffman tables, as most cameras send them, get the standard ones from
+ * libjpeg-turbo.
+ */
+static int decode(struct mjpeg *m, struct decoder *d,
+                  const struct mjpeg_job *job)
+{
+    struct jpeg_decompress_struct *cinfo = &d->cinfo;
+    size_t stride = m->width * 3;
+
+    if (setjmp(d->error.jump))
+    {
+        jpeg_abort_decompress(cinfo);
+        return 0;
+    }
+
+    d->error.pub.num_warnings = 0;
+
+    jpeg_mem_src(cinfo, job->data, job->size);
+    jpeg_read_header(cinfo, TRUE);
+
+    if (cinfo->image_width != m->width || cinfo->image_height != m->height)
+    {
+        jpeg_abort_decompress(cinfo);
+        return 0;
+    }
+
+    cinfo->out_color_space = JCS_RGB;
+
+    jpeg_start_decompress(cinfo);
+
+    while (cinfo->output_scanline < cinfo->output_height)
+    {
+        JSAMPROW rows[16];
+        unsigned int n = cinfo->output_height - cinfo->output_scanline;
+        unsigned int i;
+
+        if (n > 16)
+            n = 16;
+
+        for (i = 0; i < n; i++)
+            rows[i] = job->rgb + (cinfo->output_scanline + i) * stride;
+
+        jpeg_read_scanlines(cinfo, rows, n);
+    }
+
+    jpeg_finish_decompress(cinfo);
+
+    return d->error.pub.num_warnings == 0;
+}
+
+static void kick(int efd)
+{
+    uint64_t one = 1;
+
+    if (write(efd, &one, sizeof(one)) < 0)
+    {
+        /* Counter saturated, the reader is awake anyway */
+    }
+}
+
+static void *decode_thread(void *arg)
+{
+    struct mjpeg *m = arg;
+    struct decoder d;
+
+    decoder_init(&d);
+
+    pthread_mutex_lock(&m->lock);
+
+    for (;;)
+    {
+        struct mjpeg_job *job;
+        unsigned int cookie;
+        int ok;
+
+        while (!m->quit && m->queue_head == m->queue_tail)
+            pthread_cond_wait(&m->wake, &m->lock);
+
+        if (m->quit)
+            break;
+
+        cookie = m->queue[m->queue_tail++ % MJPEG_MAX_INFLIGHT];
+        job = &m->jobs[cookie];
+        job->state = MJPEG_DECODING;
+
+        pthread_mutex_unlock(&m->lock);
+        ok = decode(m, &d, job);
+        pthread_mutex_lock(&m->lock);
+
+        job->ok = ok;
+        job->state = MJPEG_DONE;
+
+        kick(m->efd);
+    }
+
+    pthread_mutex_unlock(&m->lock);
+
+    jpeg_destroy_decompress(&d.cinfo);
+
+    return NULL;
+}
+
+int mjpeg_init(struct mjpeg *m, unsigned int threads, size_t width,
+               size_t height, mjpeg_done_fn done, void *arg)
+{
+    unsigned int i;
+
+    memset(m, 0, sizeof(*m));
+
+    if (threads == 0)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+        threads = cpus > 0 ? cpus : 1;
+    }
+
+    m->width = width;
+    m->height = height;
+    m->done = done;
+    m->done_arg = arg;
+
+    m->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if (m->efd < 0)
+        return -1;
+
+    m->threads = calloc(threads, sizeof(*m->threads));
+
+    if (!m->threads)
+    {
+        close(m->efd);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    pthread_mutex_init(&m->lock, NULL);
+    pthread_cond_init(&m->wake, NULL);
+
+    for (i = 0; i < threads; i++)
+    {
+        int err = pthread_create(&m->threads[i], NULL, decode_thread, m);
+
+        if (err)
+        {
+            mjpeg_exit(m);
+            errno = err;
+            return -1;
+        }
+
+        m->n_threads++;
+    }
+
+    return 0;
+}
+
+int mjpeg_decode(struct mjpeg *m, unsigned int cookie, uint32_t sequence,
+                 const void *data, size_t size, uint8_t * rgb)
+{
+    struct mjpeg_job *job;
+
+    if (cookie >= MJPEG_MAX_INFLIGHT)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&m->lock);
+
+    job = &m->jobs[cookie];
+
+    if (job->state != MJPEG_FREE)
+    {
+        pthread_mutex_unlock(&m->lock);
+        errno = EBUSY;
+        return -1;
+    }
+
+    job->state = MJPEG_QUEUED;
+    job->sequence = sequence;
+    job->data = data;
+    job->size = size;
+    job->rgb = rgb;
+
+    m->queue[m->queue_head++ % MJPEG_MAX_INFLIGHT] = cookie;
+
+    pthread_cond_signal(&m->wake);
+    pthread_mutex_unlock(&m->lock);
+
+    return 0;
+}
+
+/* Sequence numbers wrap around */
+static int older(uint32_t a, uint32_t b)
+{
+    return (int32_t) (a - b) < 0;
+}
+
+void mjpeg_complete(struct mjpeg *m)
+{
+    uint64_t count;
+
+    if (read(m->efd, &count, sizeof(count)) < 0)
+    {
+        /* EAGAIN, nothing was pending */
+    }
+
+    pthread_mutex_lock(&m->lock);
+
+    for (;;)
+    {
+        struct mjpeg_job *oldest = NULL;
+        unsigned int i;
+        int ok;
+
+        for (i = 0; i < MJPEG_MAX_INFLIGHT; i++)
+            if (m->jobs[i].state != MJPEG_FREE &&
+                (!oldest || older(m->jobs[i].sequence, oldest->sequence)))
+                oldest = &m->jobs[i];
+
+        /* Later frames wait until this one is decoded */
+        if (!oldest || oldest->state != MJPEG_DONE)
+            break;
+
+        oldest->state = MJPEG_FREE;
+        ok = oldest->ok;
+
+        if (ok)
+            m->decoded++;
+        else
+            m->corrupt++;
+
+        /* done() may queue the next frame */
+        pthread_mutex_unlock(&m->lock);
+        m->done(m->done_arg, oldest - m->jobs, ok);
+        pthread_mutex_lock(&m->lock);
+    }
+
+    pthread_mutex_unlock(&m->lock);
+}
+
+void mjpeg_exit(struct mjpeg *m)
+{
+    unsigned int i;
+
+    pthread_mutex_lock(&m->lock);
+    m->quit = 1;
+    pthread_cond_broadcast(&m->wake);
+    pthread_mutex_unlock(&m->lock);
+
+    for (i = 0; i < m->n_threads; i++)
+        pthread_join(m->threads[i], NULL);
+
+    pthread_mutex_destroy(&m->lock);
+    pthread_cond_destroy(&m->wake);
+
+    close(m->efd);
+    m->efd = -1;
+
+    free(m->threads);
+    m->threads = NULL;
+    m->n_threads = 0;
+}
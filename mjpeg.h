@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2012 by Tomasz Moń <desowin@gmail.com>
+ *
+ * MJPEG decoding on a thread pool, frames handed back in capture order.
+ *
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright
+ * notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+ * OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name of a copyright holder shall not
+ * be used in advertising or otherwise to promote the sale, use or other dealings
+ * in this Software without prior written authorization of the copyright holder.
+ */
+
+#ifndef MJPEG_H
+#define MJPEG_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Cookies are below this, e.g. V4L2 buffer indices */
+#define MJPEG_MAX_INFLIGHT 64
+
+/*
+ * Called from mjpeg_complete() for each frame, in v4l2_buffer.sequence
+ * order whichever thread finished first. ok is 0 if the frame could not
+ * be decoded, rgb then holds garbage.
+ */
+typedef void (*mjpeg_done_fn) (void *arg, unsigned int cookie, int ok);
+
+enum mjpeg_state
+{
+    MJPEG_FREE,
+    MJPEG_QUEUED,
+    MJPEG_DECODING,
+    MJPEG_DONE,
+};
+
+struct mjpeg_job
+{
+    enum mjpeg_state state;
+    int ok;
+    uint32_t sequence;
+    const uint8_t *data;
+    size_t size;
+    uint8_t *rgb;
+};
+
+struct mjpeg
+{
+    size_t width;
+    size_t height;
+
+    mjpeg_done_fn done;
+    void *done_arg;
+
+    /* Readable whenever mjpeg_complete() may have frames to hand back */
+    int efd;
+
+    unsigned long decoded;
+    unsigned long corrupt;
+
+    pthread_t *threads;
+    unsigned int n_threads;
+
+    /* Everything below is under lock, queue holds cookies to decode */
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    struct mjpeg_job jobs[MJPEG_MAX_INFLIGHT];
+    unsigned int queue[MJPEG_MAX_INFLIGHT];
+    unsigned int queue_head;
+    unsigned int queue_tail;
+    int quit;
+};
+
+/*
+ * Starts threads decoders, one per CPU if 0, for width x height frames.
+ * Returns -1 with errno set on failure.
+ */
+int mjpeg_init(struct mjpeg *m, unsigned int threads, size_t width,
+               size_t height, mjpeg_done_fn done, void *arg);
+
+/*
+ * Queues size bytes of JPEG at data for decoding to packed RGB24 at rgb,
+ * width * height * 3 bytes. Both have to stay valid until done() is
+ * called for cookie. Returns -1 if cookie is still in flight.
+ */
+int mjpeg_decode(struct mjpeg *m, unsigned int cookie, uint32_t sequence,
+                 const void *data, size_t size, uint8_t * rgb);
+
+/*
+ * Calls done() for every decoded frame with no older one still being
+ * decoded, after efd fired.
+ */
+void mjpeg_complete(struct mjpeg *m);
+
+/* Stops the threads, frames still in flight are dropped without done() */
+void mjpeg_exit(struct mjpeg *m);
+
+#endif /* MJPEG_H */
@@ -0,0 +1,171 @@
+/*
+ * Copyright (C) 2012 by Tomasz Moń <desowin@gmail.com>
+ *
+ * epoll based event loop for V4L2 fds, timers and signals.
+ *
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright
+ * notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+ * OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name of a copyright holder shall not
+ * be used in advertising or otherwise to promote the sale, use or other dealings
+ * in this Software without prior written authorization of the copyright holder.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+
+#include "reactor.h"
+
+/* Events handled per epoll_wait() call */
+#define REACTOR_EVENTS 16
+
+int reactor_init(struct reactor *r)
+{
+    r->quit = 0;
+    r->epfd = epoll_create1(EPOLL_CLOEXEC);
+
+    return r->epfd < 0 ? -1 : 0;
+}
+
+void reactor_free(struct reactor *r)
+{
+    close(r->epfd);
+    r->epfd = -1;
+}
+
+static int reactor_watch(struct reactor *r, struct reactor_source *s,
+                         uint32_t events)
+{
+    struct epoll_event ev;
+
+    ev.events = events;
+    ev.data.ptr = s;
+
+    return epoll_ctl(r->epfd, EPOLL_CTL_ADD, s->fd, &ev);
+}
+
+int reactor_add(struct reactor *r, struct reactor_source *s, int fd,
+                uint32_t events, reactor_fn fn, void *arg)
+{
+    s->fd = fd;
+    s->kind = REACTOR_FD;
+    s->fn = fn;
+    s->arg = arg;
+
+    return reactor_watch(r, s, events);
+}
+
+int reactor_add_timer(struct reactor *r, struct reactor_source *s,
+                      unsigned int period_ms, reactor_fn fn, void *arg)
+{
+    struct itimerspec its;
+
+    s->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    s->kind = REACTOR_TIMER;
+    s->fn = fn;
+    s->arg = arg;
+
+    if (s->fd < 0)
+        return -1;
+
+    its.it_interval.tv_sec = period_ms / 1000;
+    its.it_interval.tv_nsec = (period_ms % 1000) * 1000000;
+    its.it_value = its.it_interval;
+
+    if (timerfd_settime(s->fd, 0, &its, NULL) || reactor_watch(r, s, EPOLLIN))
+    {
+        close(s->fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+int reactor_add_signals(struct reactor *r, struct reactor_source *s,
+                        const sigset_t * mask, reactor_fn fn, void *arg)
+{
+    if (pthread_sigmask(SIG_BLOCK, mask, NULL))
+        return -1;
+
+    s->fd = signalfd(-1, mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    s->kind = REACTOR_SIGNAL;
+    s->fn = fn;
+    s->arg = arg;
+
+    if (s->fd < 0)
+        return -1;
+
+    if (reactor_watch(r, s, EPOLLIN))
+    {
+        close(s->fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+void reactor_del(struct reactor *r, struct reactor_source *s)
+{
+    epoll_ctl(r->epfd, EPOLL_CTL_DEL, s->fd, NULL);
+
+    if (s->kind != REACTOR_FD)
+        close(s->fd);
+
+    s->fd = -1;
+}
+
+static void reactor_dispatch(struct reactor_source *s, uint32_t events)
+{
+    struct signalfd_siginfo si;
+    uint64_t expirations;
+
+    switch (s->kind)
+    {
+    case REACTOR_FD:
+        s->fn(s->arg, events);
+        break;
+
+    case REACTOR_TIMER:
+        if (read(s->fd, &expirations, sizeof(expirations)) ==
+            sizeof(expirations))
+            s->fn(s->arg, expirations);
+        break;
+
+    case REACTOR_SIGNAL:
+        while (read(s->fd, &si, sizeof(si)) == sizeof(si))
+            s->fn(s->arg, si.ssi_signo);
+        break;
+    }
+}
+
+int reactor_run(struct reactor *r, int timeout_ms)
+{
+    struct epoll_event ev[REACTOR_EVENTS];
+    int n, i;
+
+    n = epoll_wait(r->epfd, ev, REACTOR_EVENTS, timeout_ms);
+
+    if (n < 0)
+        return errno == EINTR ? 0 : -1;
+
+    for (i = 0; i < n; i++)
+        reactor_dispatch(ev[i].data.ptr, ev[i].events);
+
+    return n;
+}
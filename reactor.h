@@ -0,0 +1,106 @@
+/*
+ * Copyright (C) 2012 by Tomasz Moń <desowin@gmail.com>
+ *
+ * epoll based event loop for V4L2 fds, timers and signals.
+ *
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright
+ * notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+ * OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name of a copyright holder shall not
+ * be used in advertising or otherwise to promote the sale, use or other dealings
+ * in this Software without prior written authorization of the copyright holder.
+ */
+
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <signal.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+
+/*
+ * Called when a source is ready. For fd sources events holds the epoll
+ * events, for timers the number of expirations, for signals the signal
+ * number (once per delivered signal).
+ */
+typedef void (*reactor_fn) (void *arg, uint32_t events);
+
+enum reactor_kind
+{
+    REACTOR_FD,
+    REACTOR_TIMER,
+    REACTOR_SIGNAL,
+};
+
+/* Owned by the caller, must stay valid while it is registered */
+struct reactor_source
+{
+    int fd;
+    enum reactor_kind kind;
+    reactor_fn fn;
+    void *arg;
+};
+
+struct reactor
+{
+    int epfd;
+    int quit;
+};
+
+int reactor_init(struct reactor *r);
+void reactor_free(struct reactor *r);
+
+/*
+ * Watches fd for events. With EPOLLET the callback has to drain the fd
+ * (e.g. DQBUF until EAGAIN), as it is only called again on new activity.
+ */
+int reactor_add(struct reactor *r, struct reactor_source *s, int fd,
+                uint32_t events, reactor_fn fn, void *arg);
+
+/* Calls fn every period_ms milliseconds */
+int reactor_add_timer(struct reactor *r, struct reactor_source *s,
+                      unsigned int period_ms, reactor_fn fn, void *arg);
+
+/*
+ * Blocks the signals in mask for the calling thread and delivers them
+ * through fn instead. Call it before starting any other thread, so the
+ * threads inherit the mask.
+ */
+int reactor_add_signals(struct reactor *r, struct reactor_source *s,
+                        const sigset_t * mask, reactor_fn fn, void *arg);
+
+/* Unregisters s, closing the timer or signal fd it was given */
+void reactor_del(struct reactor *r, struct reactor_source *s);
+
+/*
+ * Waits up to timeout_ms (-1 forever) and dispatches every ready source.
+ * Returns the number of sources dispatched, 0 on timeout or -1 on error.
+ */
+int reactor_run(struct reactor *r, int timeout_ms);
+
+/*
+ * Makes reactor_running() return 0, for callbacks to end the loop. Other
+ * threads may call it too, the loop notices on its next wakeup.
+ */
+static inline void reactor_quit(struct reactor *r)
+{
+    __atomic_store_n(&r->quit, 1, __ATOMIC_RELEASE);
+}
+
+static inline int reactor_running(const struct reactor *r)
+{
+    return !__atomic_load_n(&r->quit, __ATOMIC_ACQUIRE);
+}
+
+#endif /* REACTOR_H */
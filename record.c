@@ -0,0 +1,700 @@
+/*
+ * Copyright (C) 2012 by Tomasz Moń <desowin@gmail.com>
+ *
+ * Raw frame recorder writing straight from the capture buffers.
+ *
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright
+ * notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+ * OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name of a copyright holder shall not
+ * be used in advertising or otherwise to promote the sale, use or other dealings
+ * in this Software without prior written authorization of the copyright holder.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "record.h"
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define RECORD_URING 1
+#endif
+#endif
+
+/* fallocate() granularity, about four seconds of 1080p60 */
+#define RECORD_PREALLOC (1ULL << 30)
+
+/* Frames between header rewrites, a killed recorder loses at most these */
+#define RECORD_CHECKPOINT 64
+
+static size_t round_up(size_t v, size_t align)
+{
+    return (v + align - 1) / align * align;
+}
+
+/* First error wins, later ones are usually a consequence */
+static void set_error(struct record *r, int err)
+{
+    int none = 0;
+
+    __atomic_compare_exchange_n(&r->error, &none, err, 0, __ATOMIC_RELAXED,
+                                __ATOMIC_RELAXED);
+}
+
+/* Makes sure the file has room up to end, a chunk at a time */
+static int reserve(struct record *r, uint64_t end)
+{
+    uint64_t size = r->allocated;
+
+    if (end <= size)
+        return 0;
+
+    while (size < end)
+        size += RECORD_PREALLOC;
+
+    if (fallocate(r->fd, 0, r->allocated, size - r->allocated))
+    {
+        if (EOPNOTSUPP != errno)
+            return -1;
+
+        /* Not worth retrying on every frame */
+        size = UINT64_MAX;
+    }
+
+    r->allocated = size;
+
+    return 0;
+}
+
+/* Synchronous write through an aligned bounce buffer, size may be odd */
+static int write_block(struct record *r, const void *data, size_t size,
+                       uint64_t offset)
+{
+    size_t padded = round_up(size, RECORD_ALIGN);
+    void *block;
+    ssize_t n;
+
+    if (posix_memalign(&block, RECORD_ALIGN, padded))
+        return -1;
+
+    memset(block, 0, padded);
+    memcpy(block, data, size);
+
+    n = pwrite(r->fd, block, padded, offset);
+    free(block);
+
+    if (n != (ssize_t) padded)
+    {
+        if (n >= 0)
+            errno = EIO;
+        return -1;
+    }
+
+    return 0;
+}
+
+static int write_header(struct record *r)
+{
+    return write_block(r, &r->header, sizeof(r->header), 0);
+}
+
+static int write_index(struct record *r)
+{
+    struct record_header *h = &r->header;
+    size_t size = h->frames * sizeof(*r->index);
+
+    h->index_offset = h->header_size + h->frames * h->frame_stride;
+
+    if (size && write_block(r, r->index, size, h->index_offset))
+        return -1;
+
+    return ftruncate(r->fd, h->index_offset + size);
+}
+
+/*
+ * Rewrites the header with the frames written so far, without an index.
+ * Replay falls back to the bare slots if record_close() never runs.
+ */
+static void checkpoint(struct record *r)
+{
+    struct record_header h = r->header;
+    unsigned int i;
+
+    if (r->error || h.frames < r->checkpointed + RECORD_CHECKPOINT)
+        return;
+
+    /* Writes complete out of order, count up to the oldest one pending */
+    for (i = 0; i < RECORD_MAX_INFLIGHT; i++)
+        if (r->reqs[i].busy && r->reqs[i].frame < h.frames)
+            h.frames = r->reqs[i].frame;
+
+    if (h.frames < r->checkpointed + RECORD_CHECKPOINT)
+        return;
+
+    if (write_block(r, &h, sizeof(h), 0))
+        set_error(r, errno);
+
+    r->checkpointed = h.frames;
+}
+
+static void finish(struct record *r, unsigned int cookie)
+{
+    r->reqs[cookie].busy = 0;
+    r->inflight--;
+    r->done(r->done_arg, cookie);
+}
+
+/* Copies a frame into the staging slot of cookie, the padding stays zero */
+static const uint8_t *stage(struct record *r, unsigned int cookie,
+                            const void *data)
+{
+    const struct record_header *h = &r->header;
+
+    if (!r->staging[cookie])
+    {
+        void *p;
+
+        if (posix_memalign(&p, RECORD_ALIGN, h->frame_stride))
+            return NULL;
+
+        memset(p, 0, h->frame_stride);
+        r->staging[cookie] = p;
+    }
+
+    memcpy(r->staging[cookie], data, h->frame_size);
+    __atomic_add_fetch(&r->staged, 1, __ATOMIC_RELAXED);
+
+    return r->staging[cookie];
+}
+
+/*
+ * O_DIRECT cannot pin VM_IO/VM_PFNMAP mappings, which is what
+ * vb2-dma-contig drivers hand out, so such a write fails with EFAULT.
+ * Moves the request to a staged copy to retry from there and keeps
+ * staging every later frame. Returns -1 if it was staged already.
+ */
+static int restage(struct record *r, unsigned int cookie)
+{
+    struct record_req *req = &r->reqs[cookie];
+    const uint8_t *data;
+
+    if (req->data == r->staging[cookie])
+        return -1;
+
+    __atomic_store_n(&r->stage_all, 1, __ATOMIC_RELAXED);
+
+    data = stage(r, cookie, req->data);
+    if (!data)
+        return -1;
+
+    req->data = data;
+
+    return 0;
+}
+
+#ifdef RECORD_URING
+static int uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned int submit, unsigned int wait,
+                       unsigned int flags)
+{
+    return syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+}
+
+static void *ring_map(int fd, size_t size, off_t offset)
+{
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd, offset);
+
+    return p == MAP_FAILED ? NULL : p;
+}
+
+static void uring_free(struct record *r)
+{
+    if (r->sqes)
+        munmap(r->sqes, r->sqes_size);
+    if (r->cq_ring && r->cq_ring != r->sq_ring)
+        munmap(r->cq_ring, r->cq_ring_size);
+    if (r->sq_ring)
+        munmap(r->sq_ring, r->sq_ring_size);
+    if (r->ring_fd >= 0)
+        close(r->ring_fd);
+
+    r->sqes = r->cq_ring = r->sq_ring = NULL;
+    r->ring_fd = -1;
+}
+
+static int uring_init(struct record *r)
+{
+    struct io_uring_params p;
+    uint8_t *sq, *cq;
+
+    memset(&p, 0, sizeof(p));
+
+    r->ring_fd = uring_setup(RECORD_MAX_INFLIGHT, &p);
+
+    if (r->ring_fd < 0)
+        return -1;
+
+    r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    r->cq_ring_size = p.cq_off.cqes +
+        p.cq_entries * sizeof(struct io_uring_cqe);
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (r->cq_ring_size > r->sq_ring_size)
+            r->sq_ring_size = r->cq_ring_size;
+        r->cq_ring_size = r->sq_ring_size;
+    }
+
+    r->sq_ring = ring_map(r->ring_fd, r->sq_ring_size, IORING_OFF_SQ_RING);
+
+    if (r->sq_ring && (p.features & IORING_FEAT_SINGLE_MMAP))
+        r->cq_ring = r->sq_ring;
+    else if (r->sq_ring)
+        r->cq_ring = ring_map(r->ring_fd, r->cq_ring_size,
+                              IORING_OFF_CQ_RING);
+
+    if (r->cq_ring)
+        r->sqes = ring_map(r->ring_fd, r->sqes_size, IORING_OFF_SQES);
+
+    if (!r->sqes)
+    {
+        uring_free(r);
+        return -1;
+    }
+
+    sq = r->sq_ring;
+    cq = r->cq_ring;
+
+    r->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned int *)(sq + p.sq_off.array);
+    r->cq_head = (unsigned int *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+    r->cqes = cq + p.cq_off.cqes;
+
+    r->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if (r->efd < 0 || syscall(__NR_io_uring_register, r->ring_fd,
+                              IORING_REGISTER_EVENTFD, &r->efd, 1))
+    {
+        if (r->efd >= 0)
+            close(r->efd);
+        r->efd = -1;
+        uring_free(r);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Queues the unwritten part of request cookie, WRITEV works on any kernel */
+static int uring_submit(struct record *r, unsigned int cookie)
+{
+    struct record_req *req = &r->reqs[cookie];
+    struct io_uring_sqe *sqe;
+    unsigned int tail = *r->sq_tail;
+    unsigned int index = tail & *r->sq_mask;
+
+    req->iov.iov_base = (void *)(req->data + req->written);
+    req->iov.iov_len = req->length - req->written;
+
+    sqe = (struct io_uring_sqe *)r->sqes + index;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = r->fd;
+    sqe->addr = (uintptr_t) & req->iov;
+    sqe->len = 1;
+    sqe->off = req->offset + req->written;
+    sqe->user_data = cookie;
+
+    r->sq_array[index] = index;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    while (uring_enter(r->ring_fd, 1, 0, 0) < 0)
+        if (EINTR != errno)
+            return -1;
+
+    return 0;
+}
+
+static void uring_reap(struct record *r)
+{
+    unsigned int head = *r->cq_head;
+
+    while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+    {
+        const struct io_uring_cqe *cqe =
+            (struct io_uring_cqe *)r->cqes + (head & *r->cq_mask);
+        unsigned int cookie = cqe->user_data;
+        int res = cqe->res;
+        struct record_req *req = &r->reqs[cookie];
+
+        __atomic_store_n(r->cq_head, ++head, __ATOMIC_RELEASE);
+
+        if (-EFAULT == res && 0 == restage(r, cookie))
+        {
+            if (0 == uring_submit(r, cookie))
+                continue;
+
+            set_error(r, errno);
+        }
+        else if (res < 0)
+            set_error(r, -res);
+        else if (res == 0)
+            set_error(r, EIO);
+        else
+            req->written += res;
+
+        /* Short write, the rest goes out as a new request */
+        if (res > 0 && req->written < req->length &&
+            0 == uring_submit(r, cookie))
+            continue;
+
+        finish(r, cookie);
+    }
+}
+#else
+static int uring_init(struct record *r)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+static int uring_submit(struct record *r, unsigned int cookie)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+static void uring_reap(struct record *r)
+{
+}
+
+static void uring_free(struct record *r)
+{
+}
+#endif /* RECORD_URING */
+
+static void write_req(struct record *r, unsigned int cookie)
+{
+    struct record_req *req = &r->reqs[cookie];
+
+    while (req->written < req->length)
+    {
+        ssize_t n = pwrite(r->fd, req->data + req->written,
+                           req->length - req->written,
+                           req->offset + req->written);
+
+        if (n < 0 && EINTR == errno)
+            continue;
+
+        if (n < 0 && EFAULT == errno && 0 == restage(r, cookie))
+            continue;
+
+        if (n <= 0)
+        {
+            set_error(r, n < 0 ? errno : EIO);
+            return;
+        }
+
+        req->written += n;
+    }
+
+    /* Without O_DIRECT keep the page cache from filling up */
+    if (!r->direct)
+    {
+        sync_file_range(r->fd, req->offset, req->length,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                        SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(r->fd, req->offset, req->length, POSIX_FADV_DONTNEED);
+    }
+}
+
+static void *writer_thread(void *arg)
+{
+    struct record *r = arg;
+
+    while (!__atomic_load_n(&r->quit, __ATOMIC_ACQUIRE))
+    {
+        unsigned int cookie;
+
+        if (ring_pop(&r->submit_ring, &cookie))
+        {
+            ring_wait(&r->submit_ring, -1);
+            continue;
+        }
+
+        write_req(r, cookie);
+        ring_push(&r->done_ring, cookie);
+    }
+
+    return NULL;
+}
+
+static int thread_init(struct record *r)
+{
+    if (ring_init(&r->submit_ring))
+        return -1;
+
+    if (ring_init(&r->done_ring))
+    {
+        ring_free(&r->submit_ring);
+        return -1;
+    }
+
+    r->efd = r->done_ring.efd;
+
+    if (pthread_create(&r->thread, NULL, writer_thread, r))
+    {
+        ring_free(&r->submit_ring);
+        ring_free(&r->done_ring);
+        errno = EAGAIN;
+        return -1;
+    }
+
+    return 0;
+}
+
+int record_open(struct record *r, const char *path,
+                const struct record_header *format, record_done_fn done,
+                void *arg)
+{
+    memset(r, 0, sizeof(*r));
+
+    r->ring_fd = -1;
+    r->efd = -1;
+    r->done = done;
+    r->done_arg = arg;
+
+    r->header = *format;
+    memcpy(r->header.magic, RECORD_MAGIC, sizeof(r->header.magic));
+    r->header.header_size = RECORD_ALIGN;
+    r->header.frame_stride = round_up(format->frame_size, RECORD_ALIGN);
+    r->header.frames = 0;
+    r->header.index_offset = 0;
+
+    r->direct = 1;
+    r->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_DIRECT,
+                 0644);
+
+    /* tmpfs and some network filesystems refuse O_DIRECT */
+    if (r->fd < 0 && EINVAL == errno)
+    {
+        r->direct = 0;
+        r->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    }
+
+    if (r->fd < 0)
+        return -1;
+
+    if (reserve(r, r->header.header_size + r->header.frame_stride) ||
+        write_header(r))
+        goto fail;
+
+    /* Buffered writes need the writer thread to drop cached pages */
+    if (r->direct && 0 == uring_init(r))
+        r->uring = 1;
+    else if (thread_init(r))
+        goto fail;
+
+    return 0;
+
+  fail:
+    {
+        int err = errno;
+
+        close(r->fd);
+        r->fd = -1;
+        errno = err;
+    }
+    return -1;
+}
+
+int record_write(struct record *r, unsigned int cookie, const void *data,
+                 size_t mapped, const struct record_index *entry)
+{
+    const struct record_header *h = &r->header;
+    struct record_req *req;
+    uint64_t offset = h->header_size + h->frames * h->frame_stride;
+
+    if (r->error)
+    {
+        errno = r->error;
+        return -1;
+    }
+
+    if (cookie >= RECORD_MAX_INFLIGHT)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (reserve(r, offset + h->frame_stride))
+        return -1;
+
+    if (h->frames == r->index_alloc)
+    {
+        size_t alloc = r->index_alloc ? r->index_alloc * 2 : 1024;
+        struct record_index *index = realloc(r->index,
+                                             alloc * sizeof(*index));
+
+        if (!index)
+            return -1;
+
+        r->index = index;
+        r->index_alloc = alloc;
+    }
+
+    /* Padded slots have to be readable and O_DIRECT wants alignment */
+    if (mapped < h->frame_stride || (uintptr_t) data % RECORD_ALIGN ||
+        __atomic_load_n(&r->stage_all, __ATOMIC_RELAXED))
+    {
+        data = stage(r, cookie, data);
+        if (!data)
+            return -1;
+    }
+
+    req = &r->reqs[cookie];
+    req->data = data;
+    req->offset = offset;
+    req->length = h->frame_stride;
+    req->written = 0;
+    req->frame = h->frames;
+
+    if (r->uring)
+    {
+        if (uring_submit(r, cookie))
+            return -1;
+    }
+    else if (ring_push(&r->submit_ring, cookie))
+    {
+        errno = EBUSY;
+        return -1;
+    }
+
+    req->busy = 1;
+
+    r->index[h->frames] = *entry;
+    r->index[h->frames].offset = offset;
+
+    r->header.frames++;
+    r->inflight++;
+
+    return 0;
+}
+
+void record_complete(struct record *r)
+{
+    unsigned int cookie;
+
+    if (r->uring)
+    {
+        uint64_t count;
+
+        if (read(r->efd, &count, sizeof(count)) < 0)
+        {
+            /* EAGAIN, nothing was pending */
+        }
+
+        uring_reap(r);
+    }
+    else
+    {
+        ring_clear(&r->done_ring);
+
+        while (0 == ring_pop(&r->done_ring, &cookie))
+            finish(r, cookie);
+    }
+
+    checkpoint(r);
+}
+
+int record_close(struct record *r)
+{
+    unsigned int i;
+    int ret = 0;
+
+    while (r->inflight)
+    {
+#ifdef RECORD_URING
+        if (r->uring && uring_enter(r->ring_fd, 0, 1,
+                                    IORING_ENTER_GETEVENTS) < 0 &&
+            EINTR != errno)
+        {
+            set_error(r, errno);
+            break;
+        }
+#endif
+        if (!r->uring)
+            ring_wait(&r->done_ring, -1);
+
+        record_complete(r);
+    }
+
+    if (r->uring)
+    {
+        close(r->efd);
+        uring_free(r);
+    }
+    else
+    {
+        __atomic_store_n(&r->quit, 1, __ATOMIC_RELEASE);
+        ring_kick(&r->submit_ring);
+        pthread_join(r->thread, NULL);
+
+        ring_free(&r->submit_ring);
+        ring_free(&r->done_ring);
+    }
+
+    r->efd = -1;
+
+    for (i = 0; i < RECORD_MAX_INFLIGHT; i++)
+        free(r->staging[i]);
+
+    if (r->error)
+    {
+        errno = r->error;
+        ret = -1;
+    }
+    else if (write_index(r) || write_header(r))
+    {
+        ret = -1;
+    }
+
+    free(r->index);
+    r->index = NULL;
+
+    if (close(r->fd) && 0 == ret)
+        ret = -1;
+
+    r->fd = -1;
+
+    return ret;
+}
@@ -0,0 +1,167 @@
+/*
+ * Copyright (C) 2012 by Tomasz Moń <desowin@gmail.com>
+ *
+ * Raw frame recorder writing straight from the capture buffers.
+ *
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright
+ * notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+ * OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name of a copyright holder shall not
+ * be used in advertising or otherwise to promote the sale, use or other dealings
+ * in this Software without prior written authorization of the copyright holder.
+ */
+
+#ifndef RECORD_H
+#define RECORD_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "ring.h"
+
+#define RECORD_MAGIC "V4L2RAW1"
+
+/*
+ * Frames are stored in slots of frame_stride bytes after a header block.
+ * Slots are padded to RECORD_ALIGN so that every write stays O_DIRECT
+ * aligned, frame n starts at header_size + n * frame_stride. An index of
+ * struct record_index entries, one per frame, follows the last slot.
+ * Until record_close() writes it index_offset stays 0, frames then counts
+ * the leading slots known to be written when the header was last
+ * rewritten.
+ */
+#define RECORD_ALIGN 4096
+
+struct record_header
+{
+    char magic[8];              /* RECORD_MAGIC, no terminating 0 */
+    uint32_t header_size;
+    uint32_t pixelformat;       /* V4L2_PIX_FMT_* */
+    uint32_t width;
+    uint32_t height;
+    uint32_t bytesperline;
+    uint32_t reserved;
+    uint64_t frame_size;
+    uint64_t frame_stride;
+    uint64_t frames;            /* every so often, exact at record_close() */
+    uint64_t index_offset;      /* 0 until record_close() wrote it */
+};
+
+struct record_index
+{
+    uint64_t offset;            /* of the frame slot in the file */
+    uint64_t timestamp;         /* capture time, ns */
+    uint32_t sequence;          /* v4l2_buffer.sequence */
+    uint32_t bytesused;
+};
+
+/* Called once the frame submitted with cookie is on disk */
+typedef void (*record_done_fn) (void *arg, unsigned int cookie);
+
+/* Cookies are below this, e.g. V4L2 buffer indices */
+#define RECORD_MAX_INFLIGHT RING_SIZE
+
+struct record_req
+{
+    const uint8_t *data;
+    uint64_t offset;
+    size_t length;
+    size_t written;
+    uint64_t frame;             /* slot index */
+    int busy;                   /* until done() was called */
+    struct iovec iov;           /* io_uring only */
+};
+
+struct record
+{
+    int fd;
+    int direct;                 /* opened with O_DIRECT */
+    int uring;                  /* io_uring, otherwise the writer thread */
+    int error;                  /* first errno of a failed write */
+
+    struct record_header header;
+    uint64_t allocated;         /* file size set up by fallocate() */
+
+    struct record_index *index;
+    size_t index_alloc;
+
+    record_done_fn done;
+    void *done_arg;
+
+    /* Readable whenever record_complete() has something to reap */
+    int efd;
+
+    struct record_req reqs[RECORD_MAX_INFLIGHT];
+    uint8_t *staging[RECORD_MAX_INFLIGHT];
+    unsigned int inflight;
+    unsigned long staged;       /* frames that had to be copied */
+    uint64_t checkpointed;      /* frames in the header on disk */
+    int stage_all;              /* a direct write faulted, copy them all */
+
+    /* io_uring, set up with raw syscalls */
+    int ring_fd;
+    void *sq_ring;
+    void *cq_ring;
+    void *sqes;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    void *cqes;
+
+    /* Writer thread */
+    pthread_t thread;
+    struct ring submit_ring;
+    struct ring done_ring;
+    int quit;
+};
+
+/*
+ * Creates path and writes the header. Uses io_uring with O_DIRECT where
+ * available, else pwrite() on a writer thread. Returns -1 with errno set
+ * on failure.
+ */
+int record_open(struct record *r, const char *path,
+                const struct record_header *format, record_done_fn done,
+                void *arg);
+
+/*
+ * Queues one frame for writing. data has to stay untouched until done()
+ * is called for cookie; mapped is how many bytes are readable at data,
+ * if it is less than frame_stride the frame is copied first. Once the
+ * kernel refuses to write from a buffer directly (EFAULT), that frame and
+ * every later one go through a copy too. The offset of entry is filled
+ * in, the rest goes to the index as is.
+ */
+int record_write(struct record *r, unsigned int cookie, const void *data,
+                 size_t mapped, const struct record_index *entry);
+
+/* Reaps finished writes and calls done() for each, after efd fired */
+void record_complete(struct record *r);
+
+/*
+ * Waits for every write, calling done() as usual, then writes the index,
+ * rewrites the header and trims the preallocated tail. Returns -1 if any
+ * write failed.
+ */
+int record_close(struct record *r);
+
+#endif /* RECORD_H */
@@ -0,0 +1,263 @@
+/*
+ * Copyright (C) 2012 by Tomasz Moń <desowin@gmail.com>
+ *
+ * Plays back recordings made by record.c as a capture source.
+ *
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright
+ * notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+ * OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name of a copyright holder shall not
+ * be used in advertising or otherwise to promote the sale, use or other dealings
+ * in this Software without prior written authorization of the copyright holder.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+
+#include "replay.h"
+
+/* Pace of a recording without index, which has no timestamps */
+#define REPLAY_UNINDEXED_NS (1000000000ULL / 30)
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t due_ns(const struct replay *r, uint64_t n)
+{
+    uint64_t timestamp = r->index[n].timestamp;
+
+    if (!r->paced || timestamp < r->start_timestamp)
+        return r->start_ns;
+
+    return r->start_ns + (timestamp - r->start_timestamp);
+}
+
+/* Arms fd for frame pos, a deadline in the past fires at once */
+static void arm(struct replay *r)
+{
+    struct itimerspec its;
+    uint64_t due;
+
+    memset(&its, 0, sizeof(its));
+
+    if (!replay_ended(r))
+    {
+        due = due_ns(r, r->pos);
+
+        /* 0 would disarm the timer */
+        if (!due)
+            due = 1;
+
+        its.it_value.tv_sec = due / 1000000000ULL;
+        its.it_value.tv_nsec = due % 1000000000ULL;
+    }
+
+    timerfd_settime(r->fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+/*
+ * The recorder never got to record_close(), frames is as of its last
+ * checkpoint. Makes up an index of back to back slots at a fixed rate.
+ */
+static int make_index(struct replay *r)
+{
+    const struct record_header *h = &r->header;
+    struct record_index *index;
+    uint64_t i;
+
+    if (memcmp(h->magic, RECORD_MAGIC, sizeof(h->magic)) || !h->frames ||
+        !h->frame_stride || h->header_size > r->map_size ||
+        h->frames > (r->map_size - h->header_size) / h->frame_stride)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    index = calloc(h->frames, sizeof(*index));
+
+    if (!index)
+        return -1;
+
+    for (i = 0; i < h->frames; i++)
+    {
+        index[i].offset = h->header_size + i * h->frame_stride;
+        index[i].timestamp = i * REPLAY_UNINDEXED_NS;
+        index[i].sequence = i;
+        index[i].bytesused = h->frame_size;
+    }
+
+    r->slots = index;
+    r->index = index;
+
+    return 0;
+}
+
+/* Every slot and the index have to lie within the file */
+static int valid(const struct replay *r)
+{
+    const struct record_header *h = &r->header;
+    uint64_t end = h->index_offset ? h->index_offset : r->map_size;
+    uint64_t i;
+
+    if (memcmp(h->magic, RECORD_MAGIC, sizeof(h->magic)) ||
+        h->header_size < sizeof(*h) || h->frame_size > h->frame_stride)
+        return 0;
+
+    if (h->index_offset && (h->index_offset > r->map_size ||
+                            h->frames > (r->map_size - h->index_offset) /
+                            sizeof(*r->index)))
+        return 0;
+
+    for (i = 0; i < h->frames; i++)
+        if (r->index[i].offset > end ||
+            end - r->index[i].offset < h->frame_size)
+            return 0;
+
+    return 1;
+}
+
+int replay_open(struct replay *r, const char *path, int paced)
+{
+    struct stat st;
+    void *map;
+    int fd;
+
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+    r->paced = paced;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0)
+        return -1;
+
+    if (fstat(fd, &st))
+    {
+        close(fd);
+        return -1;
+    }
+
+    if (!S_ISREG(st.st_mode) || st.st_size < (off_t) sizeof(r->header))
+    {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (MAP_FAILED == map)
+        return -1;
+
+    r->map = map;
+    r->map_size = st.st_size;
+
+    memcpy(&r->header, r->map, sizeof(r->header));
+    r->index = (const struct record_index *)(r->map +
+                                             r->header.index_offset);
+
+    if (!r->header.index_offset && make_index(r))
+    {
+        int err = errno;
+
+        replay_close(r);
+        errno = err;
+        return -1;
+    }
+
+    if (!valid(r))
+    {
+        replay_close(r);
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* Mostly read front to back, drop what was shown */
+    madvise((void *)r->map, r->map_size, MADV_SEQUENTIAL);
+
+    r->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+    if (r->fd < 0)
+    {
+        replay_close(r);
+        return -1;
+    }
+
+    replay_seek(r, 0);
+
+    return 0;
+}
+
+void replay_close(struct replay *r)
+{
+    if (r->fd >= 0)
+        close(r->fd);
+
+    if (r->map)
+        munmap((void *)r->map, r->map_size);
+
+    free(r->slots);
+
+    r->fd = -1;
+    r->map = NULL;
+    r->slots = NULL;
+}
+
+int replay_seek(struct replay *r, uint64_t n)
+{
+    if (n >= r->header.frames)
+        return -1;
+
+    r->pos = n;
+    r->start_ns = now_ns();
+    r->start_timestamp = r->index[n].timestamp;
+
+    arm(r);
+
+    return 0;
+}
+
+int64_t replay_next(struct replay *r)
+{
+    uint64_t expirations;
+
+    if (read(r->fd, &expirations, sizeof(expirations)) < 0)
+    {
+        /* EAGAIN, checked against the clock below anyway */
+    }
+
+    if (replay_ended(r) || due_ns(r, r->pos) > now_ns())
+        return -1;
+
+    r->pos++;
+    arm(r);
+
+    return r->pos - 1;
+}
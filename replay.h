@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2012 by Tomasz Moń <desowin@gmail.com>
+ *
+ * Plays back recordings made by record.c as a capture source.
+ *
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright
+ * notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+ * OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name of a copyright holder shall not
+ * be used in advertising or otherwise to promote the sale, use or other dealings
+ * in this Software without prior written authorization of the copyright holder.
+ */
+
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "record.h"
+
+/*
+ * The whole recording is mapped read-only and frames are handed out as
+ * pointers into the mapping. fd is a timerfd that becomes readable when
+ * the next frame is due, either at the recorded rate (paced) or at once.
+ * A recording that was never closed has no index, its slots are played
+ * back at a fixed rate up to the frame count of its last checkpoint.
+ */
+struct replay
+{
+    int fd;
+    int paced;
+
+    const uint8_t *map;
+    size_t map_size;
+
+    struct record_header header;
+    const struct record_index *index;
+    struct record_index *slots; /* index made up for an unclosed recording */
+
+    uint64_t pos;               /* next frame */
+    uint64_t start_ns;          /* CLOCK_MONOTONIC when pos was due */
+    uint64_t start_timestamp;   /* recorded timestamp of that frame */
+};
+
+/* Returns -1 with errno set, EINVAL for anything that is not a recording */
+int replay_open(struct replay *r, const char *path, int paced);
+void replay_close(struct replay *r);
+
+/* Frame n as recorded, n below header.frames */
+static inline const void *replay_data(const struct replay *r, uint64_t n)
+{
+    return r->map + r->index[n].offset;
+}
+
+/*
+ * Continues from frame n, which is due at once. Returns -1 if there is no
+ * such frame.
+ */
+int replay_seek(struct replay *r, uint64_t n);
+
+/*
+ * Returns the index of the next frame and moves past it if it is due,
+ * -1 if it is not due yet (fd fires when it is) or the recording ended.
+ */
+int64_t replay_next(struct replay *r);
+
+static inline int replay_ended(const struct replay *r)
+{
+    return r->pos >= r->header.frames;
+}
+
+#endif /* REPLAY_H */
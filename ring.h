@@ -0,0 +1,128 @@
+/*
+ * Copyright (C) 2012 by Tomasz Moń <desowin@gmail.com>
+ *
+ * Lock-free single-producer, single-consumer ring of buffer indices.
+ *
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright
+ * notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+ * OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name of a copyright holder shall not
+ * be used in advertising or otherwise to promote the sale, use or other dealings
+ * in this Software without prior written authorization of the copyright holder.
+ */
+
+#ifndef RING_H
+#define RING_H
+
+#include <poll.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+/* Power of two, larger than any V4L2 buffer count */
+#define RING_SIZE 64
+
+/*
+ * head is only written by the producer and tail only by the consumer,
+ * each on its own cache line. The eventfd is a doorbell the consumer can
+ * sleep on (or add to a poll set) when the ring is empty.
+ */
+struct ring
+{
+    unsigned int head __attribute__((aligned(64)));
+    unsigned int tail __attribute__((aligned(64)));
+    unsigned int slots[RING_SIZE] __attribute__((aligned(64)));
+    int efd;
+};
+
+static inline int ring_init(struct ring *r)
+{
+    r->head = 0;
+    r->tail = 0;
+    r->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    return r->efd < 0 ? -1 : 0;
+}
+
+static inline void ring_free(struct ring *r)
+{
+    close(r->efd);
+    r->efd = -1;
+}
+
+/* Wakes up the consumer without pushing anything */
+static inline void ring_kick(struct ring *r)
+{
+    uint64_t one = 1;
+
+    if (write(r->efd, &one, sizeof(one)) < 0)
+    {
+        /* Counter saturated, the consumer is awake anyway */
+    }
+}
+
+/* Returns -1 if the ring is full */
+static inline int ring_push(struct ring *r, unsigned int v)
+{
+    unsigned int head = r->head;
+
+    if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == RING_SIZE)
+        return -1;
+
+    r->slots[head & (RING_SIZE - 1)] = v;
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+
+    ring_kick(r);
+
+    return 0;
+}
+
+/* Returns -1 if the ring is empty */
+static inline int ring_pop(struct ring *r, unsigned int *v)
+{
+    unsigned int tail = r->tail;
+
+    if (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == tail)
+        return -1;
+
+    *v = r->slots[tail & (RING_SIZE - 1)];
+    __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+/* Resets the doorbell after it fired in a poll set */
+static inline void ring_clear(struct ring *r)
+{
+    uint64_t count;
+
+    if (read(r->efd, &count, sizeof(count)) < 0)
+    {
+        /* EAGAIN, nothing was pending */
+    }
+}
+
+/* Sleeps until the producer pushes or kicks, or timeout_ms passes */
+static inline void ring_wait(struct ring *r, int timeout_ms)
+{
+    struct pollfd pfd;
+
+    pfd.fd = r->efd;
+    pfd.events = POLLIN;
+
+    if (poll(&pfd, 1, timeout_ms) > 0)
+        ring_clear(r);
+}
+
+#endif /* RING_H */
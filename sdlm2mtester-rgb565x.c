@@ -2,7 +2,8 @@
  * Copyright (C) 2012 by Tomasz Moń <desowin@gmail.com>
  *
  * compile with:
- *   gcc -o sdlm2mtester-rgb565x sdlm2mtester-rgb565x.c -lSDL
+ *   gcc -pthread -o sdlm2mtester-rgb565x sdlm2mtester-rgb565x.c arena.c \
+ *       convert.c latency.c m2m.c -lSDL
  *
  * Based on V4L2 video capture example and process-vmalloc.c
  * Capture+output (process) V4L2 device tester.
@@ -16,6 +17,8 @@
  * option) any later version
  */
 
+#define _GNU_SOURCE
+
 #include <SDL/SDL.h>
 #include <assert.h>
 #include <stdint.h>
@@ -35,6 +38,9 @@
 #include <unistd.h>
 #include <errno.h>
 #include <malloc.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/time.h>
@@ -45,6 +51,11 @@
 
 #include <linux/videodev2.h>
 
+#include "arena.h"
+#include "convert.h"
+#include "latency.h"
+#include "m2m.h"
+
 #define CLEAR(x) memset (&(x), 0, sizeof (x))
 
 static char *mem2mem_dev_name = NULL;
@@ -69,10 +80,7 @@ static uint16_t *buffer_m2m_sdl;
 SDL_Surface *data_sf;
 SDL_Surface *data_m2m_sf;
 
-#define V4L2_CID_TRANS_TIME_MSEC        (V4L2_CID_PRIVATE_BASE)
-#define V4L2_CID_TRANS_NUM_BUFS         (V4L2_CID_PRIVATE_BASE + 1)
-
-#define NUM_BUFS	4
+#define MAX_BUFS	32
 
 #define perror_exit(cond, func)\
 	if (cond) {\
@@ -97,19 +105,27 @@ SDL_Surface *data_m2m_sf;
 #define memzero(x)\
 	memset(&(x), 0, sizeof (x));
 
+/* Quiet with --bench */
 #define PROCESS_DEBUG 1
 #ifdef PROCESS_DEBUG
 #define debug(msg, ...)\
-	fprintf(stderr, "%s: " msg, __func__, ##__VA_ARGS__);
+	if (!bench) fprintf(stderr, "%s: " msg, __func__, ##__VA_ARGS__);
 #else
 #define debug(msg, ...)
 #endif
 
 static int mem2mem_fd;
-static char *p_src_buf[NUM_BUFS], *p_dst_buf[NUM_BUFS];
-static size_t src_buf_size[NUM_BUFS], dst_buf_size[NUM_BUFS];
+static char *p_src_buf[MAX_BUFS], *p_dst_buf[MAX_BUFS];
+static size_t src_buf_size[MAX_BUFS], dst_buf_size[MAX_BUFS];
 static uint32_t num_src_bufs = 0, num_dst_bufs = 0;
 
+/* Buffers queued so far on either side and results displayed */
+static int src_queued = 0, dst_queued = 0, dst_done = 0;
+static int m2m_quit = 0;
+
+/* Held while the input frame changes and while it is displayed */
+static pthread_mutex_t input_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /* transize = WIDTH*HEIGHT/translen*2 */
 static int transsize;
 
@@ -118,10 +134,32 @@ int translen = 1;
 /* For displaying multi-buffer transaction simulations, indicates current
    buffer in an ongoing transaction */
 int curr_buf = 0;
+/* The same for the source buffers, which run ahead of the results */
+int curr_src_buf = 0;
 int transtime = 1;
 int num_frames = 1000;
-
-static uint8_t *data;
+unsigned int num_bufs = 4;
+int pipelined = 0;
+/* Worker threads of the mem2mem_testdev emulator, 0 for the real device */
+unsigned int emulate = 0;
+
+/*
+ * --bench: no SDL, no per-frame output, only transactions completed
+ * between the end of the warmup and the end of the duration, or the
+ * --num-frames after the warmup, count.
+ */
+static int bench = 0;
+static int bench_json = 0;
+static double warmup = 1;
+static double duration = 0;
+
+/* On the latency_now() clock, bench_end is 0 without --duration */
+static uint64_t warmup_end, bench_end;
+static uint64_t bench_begin, bench_last;
+static unsigned long bench_transactions;
+static struct latency trans_latency;
+/* --num-frames of a --bench without --duration, to go after the warmup */
+static int bench_frames;
 
 static void render(SDL_Surface * pre, SDL_Surface * post)
 {
@@ -143,56 +181,155 @@ static void render(SDL_Surface * pre, SDL_Surface * post)
     SDL_UpdateRect(screen, 0, 0, 0, 0);
 }
 
-/**
- * Converts RGB888 color to RGB565
+/*
+ * Input frames are generated straight into buffer_sdl, or with --ring
+ * generated up front and only cycled through.
+ */
+static uint64_t seed = 1;
+static unsigned int ring_frames = 0;
+static uint16_t *frame_ring;
+
+/* Frame the source buffers are filled from */
+static uint16_t *input_frame;
+static uint64_t input_seq = 0;
+
+#define PRNG_LANES 4
+
+/*
+ * xorshift128+ in PRNG_LANES independent lanes. It takes only shifts,
+ * xors and adds, so the compiler keeps the lanes in vector registers.
+ * The state is never shared, whoever generates a row seeds its own.
  */
-static uint16_t inline RGB888_to_RGB565(uint32_t rgb)
+struct prng
 {
-    uint16_t tmp;
+    uint64_t s0[PRNG_LANES];
+    uint64_t s1[PRNG_LANES];
+};
 
-    tmp = ((rgb >> 3) & 0x1F) << 11 |   /* Blue */
-        ((rgb >> 10) & 0x3F) << 5 | /* Green */
-        ((rgb >> 19) & 0x1F);   /* Red */
+static uint64_t splitmix64(uint64_t * x)
+{
+    uint64_t z = (*x += 0x9E3779B97F4A7C15ull);
 
-#if __BYTE_ORDER == __LITTLE_ENDIAN
-    /* In LE lower byte is stored under lower address */
-    tmp = ((tmp >> 8) & 0xFF) | ((tmp & 0xFF) << 8);
-#elif __BYTE_ORDER == __BIG_ENDIAN
-    /* Nothing to do */
-#else
-#error "Unknown Endianess"
-#endif
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+static void prng_seed(struct prng *p, uint64_t x)
+{
+    int i;
 
-    return tmp;
+    for (i = 0; i < PRNG_LANES; i++)
+    {
+        p->s0[i] = splitmix64(&x);
+        p->s1[i] = splitmix64(&x);
+    }
 }
 
-static void init_input_data(uint8_t * data)
+static inline void prng_next(struct prng *p, uint64_t * out)
 {
-    size_t i;
-    for(i = WIDTH * HEIGHT * 3; i--; )
-        data[i] = (i % 3 == 0) ? (i / 3) % WIDTH :
-            (i % 3 == 1) ? (i / 3) / WIDTH : 0;
+    int i;
+
+    for (i = 0; i < PRNG_LANES; i++)
+    {
+        uint64_t s1 = p->s0[i];
+        const uint64_t s0 = p->s1[i];
+
+        out[i] = s0 + s1;
+        p->s0[i] = s0;
+        s1 ^= s1 << 23;
+        p->s1[i] = s1 ^ s0 ^ (s1 >> 17) ^ (s0 >> 26);
+    }
 }
 
-static void next_input_frame()
+/* Pixels per prng_next(), 16 bits of noise each */
+#define SYNTH_STEP (PRNG_LANES * 4)
+
+/*
+ * Row y of frame number frame of the test pattern, in the buffer_sdl
+ * layout: a gradient scrolling a pixel per frame, with up to 7 taken off
+ * every channel as noise. It depends only on seed, frame and y, so rows
+ * and frames can be generated in any order and on any thread.
+ */
+static void synth_row(uint16_t * dst, size_t y, uint64_t frame)
 {
-    size_t i;
-    size_t x;
-    size_t y;
+    struct prng p;
+    uint64_t r[PRNG_LANES];
+    uint16_t noise[SYNTH_STEP];
+    size_t x, i, n;
 
-    for(i = 0; i < WIDTH * HEIGHT * 3; i += 1 + rand() % 3)
-        data[i] -= rand() % 8;
+    prng_seed(&p, seed ^ frame << 32 ^ y);
+
+    for (x = 0; x < WIDTH; x += SYNTH_STEP)
+    {
+        prng_next(&p, r);
+        memcpy(noise, r, sizeof(noise));
+        n = WIDTH - x < SYNTH_STEP ? WIDTH - x : SYNTH_STEP;
+
+        for (i = 0; i < n; i++)
+        {
+            uint8_t c0 = x + i + frame - (noise[i] & 7);
+            uint8_t c1 = y - (noise[i] >> 3 & 7);
+            uint8_t c2 = frame - (noise[i] >> 6 & 7);
+
+            dst[x + i] = RGB888_to_RGB565(c0 | c1 << 8 | c2 << 16);
+        }
+    }
+}
 
-    uint32_t * data_rgb;
+static void synth_frame(uint16_t * dst, uint64_t frame)
+{
+    size_t y;
 
     for (y = 0; y < HEIGHT; y++)
+        synth_row(dst + y * WIDTH, y, frame);
+}
+
+static void init_input_frames(void)
+{
+    unsigned int i;
+
+    input_frame = buffer_sdl;
+
+    if (!ring_frames)
+        return;
+
+    frame_ring = arena_alloc((size_t)ring_frames * WIDTH * HEIGHT * 2);
+
+    if (!frame_ring)
+    {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < ring_frames; i++)
+        synth_frame(frame_ring + (size_t)i * WIDTH * HEIGHT, i);
+}
+
+/* Moves input_frame on to the next frame, buffer_sdl displays it */
+static void next_input_frame()
+{
+    if (ring_frames)
     {
-        for (x = 0; x < WIDTH; x++)
+        input_frame = frame_ring +
+            (size_t)(input_seq % ring_frames) * WIDTH * HEIGHT;
+
+        /* Costs nothing unless it is displayed */
+        if (!bench)
         {
-            data_rgb = (uint32_t*)&data[(y*WIDTH+x)*3];
-            buffer_sdl[y*WIDTH+x] = RGB888_to_RGB565(*data_rgb);
+            pthread_mutex_lock(&input_lock);
+            memcpy(buffer_sdl, input_frame, WIDTH * HEIGHT * 2);
+            pthread_mutex_unlock(&input_lock);
         }
     }
+    else
+    {
+        pthread_mutex_lock(&input_lock);
+        synth_frame(buffer_sdl, input_seq);
+        pthread_mutex_unlock(&input_lock);
+    }
+
+    ++input_seq;
 }
 
 static void init_mem2mem_dev()
@@ -202,14 +339,14 @@ static void init_mem2mem_dev()
     struct v4l2_format fmt;
     struct v4l2_control ctrl;
 
-    mem2mem_fd = open(mem2mem_dev_name, O_RDWR | O_NONBLOCK, 0);
+    mem2mem_fd = m2m_open(mem2mem_dev_name, O_RDWR | O_NONBLOCK, emulate);
     perror_exit(mem2mem_fd < 0, "open");
 
     if (hflip != 0)
     {
         ctrl.id = V4L2_CID_HFLIP;
         ctrl.value = 1;
-        ret = ioctl(mem2mem_fd, VIDIOC_S_CTRL, &ctrl);
+        ret = m2m_ioctl(mem2mem_fd, VIDIOC_S_CTRL, &ctrl);
         if (ret != 0)
             fprintf(stderr, "%s:%d: Set HFLIP failed\n",
                     __func__, __LINE__);
@@ -219,7 +356,7 @@ static void init_mem2mem_dev()
     {
         ctrl.id = V4L2_CID_VFLIP;
         ctrl.value = 1;
-        ret = ioctl(mem2mem_fd, VIDIOC_S_CTRL, &ctrl);
+        ret = m2m_ioctl(mem2mem_fd, VIDIOC_S_CTRL, &ctrl);
         if (ret != 0)
             fprintf(stderr, "%s:%d: Set VFLIP failed\n",
                     __func__, __LINE__);
@@ -227,15 +364,15 @@ static void init_mem2mem_dev()
 
     ctrl.id = V4L2_CID_TRANS_TIME_MSEC;
     ctrl.value = transtime;
-    ret = ioctl(mem2mem_fd, VIDIOC_S_CTRL, &ctrl);
+    ret = m2m_ioctl(mem2mem_fd, VIDIOC_S_CTRL, &ctrl);
     perror_exit(ret != 0, "ioctl");
 
     ctrl.id = V4L2_CID_TRANS_NUM_BUFS;
     ctrl.value = translen;
-    ret = ioctl(mem2mem_fd, VIDIOC_S_CTRL, &ctrl);
+    ret = m2m_ioctl(mem2mem_fd, VIDIOC_S_CTRL, &ctrl);
     perror_exit(ret != 0, "ioctl");
 
-    ret = ioctl(mem2mem_fd, VIDIOC_QUERYCAP, &cap);
+    ret = m2m_ioctl(mem2mem_fd, VIDIOC_QUERYCAP, &cap);
     perror_exit(ret != 0, "ioctl");
 
     if (!(cap.capabilities & V4L2_CAP_VIDEO_CAPTURE))
@@ -256,7 +393,7 @@ static void init_mem2mem_dev()
     fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_RGB565X;
     fmt.fmt.pix.field = V4L2_FIELD_ANY;
 
-    ret = ioctl(mem2mem_fd, VIDIOC_S_FMT, &fmt);
+    ret = m2m_ioctl(mem2mem_fd, VIDIOC_S_FMT, &fmt);
     perror_exit(ret != 0, "ioctl");
 
     /* The same format for output */
@@ -266,132 +403,300 @@ static void init_mem2mem_dev()
     fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_RGB565X;
     fmt.fmt.pix.field = V4L2_FIELD_ANY;
 
-    ret = ioctl(mem2mem_fd, VIDIOC_S_FMT, &fmt);
+    ret = m2m_ioctl(mem2mem_fd, VIDIOC_S_FMT, &fmt);
     perror_exit(ret != 0, "ioctl");
 }
 
 static void gen_buf(uint8_t * dst, uint8_t * src, size_t size)
 {
-    size_t i;
-    uint16_t tmp;
-    uint16_t *dst_buf = (uint16_t *) dst;
-    uint16_t *src_buf = (uint16_t *) src;
+    /* 
+     * V4L2_PIX_FMT_RGB565X stores most significant Green bits in
+     * byte 0. Since SDL displays otherwise, swap those here.
+     */
+    if (dst == src)
+        rgb565x_swap_green_inplace((uint16_t *) dst, size / 2);
+    else
+        rgb565x_swap_green_row((uint16_t *) dst, (const uint16_t *)src,
+                               size / 2);
+}
 
-    size /= 2;
+/* gen_buf() into a mmap'd source buffer, which only the device reads */
+static void gen_device_buf(uint8_t * dst, uint8_t * src, size_t size)
+{
+    rgb565x_swap_green_row_nt((uint16_t *) dst, (const uint16_t *)src,
+                              size / 2);
+}
 
-    for (i = 0; i < size; i++)
-    {
-        tmp = src_buf[i];
-
-        /* 
-         * V4L2_PIX_FMT_RGB565X stores most significant Green bits in
-         * byte 0. Since SDL displays otherwise, swap those here.
-         */
-        dst_buf[i] = ((tmp & 0xE000) >> 13) | ((tmp & 0x0007) << 13) |
-            (tmp & 0x1FF8);
-    }
+/* --duration lowers num_frames from the refill side once time is up */
+static inline int frames_wanted(void)
+{
+    return __atomic_load_n(&num_frames, __ATOMIC_ACQUIRE);
 }
 
-static int read_mem2mem_frame(int last)
+/* Fills source buffer index with the next chunk of the input and queues it */
+static int queue_src_buf(unsigned int index)
 {
     struct v4l2_buffer buf;
+    uint8_t *p_buf;
     int ret;
 
-    memzero(buf);
+    if (curr_src_buf == 0)
+        next_input_frame();
 
+    p_buf = (uint8_t *) input_frame + curr_src_buf * transsize;
+    gen_device_buf((uint8_t *) p_src_buf[index], p_buf, transsize);
+
+    if (++curr_src_buf >= translen)
+        curr_src_buf = 0;
+
+    memzero(buf);
     buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
     buf.memory = V4L2_MEMORY_MMAP;
+    buf.index = index;
+    /* Copied to the result, see V4L2_BUF_FLAG_TIMESTAMP_COPY */
+    buf.timestamp = latency_to_timeval(latency_now());
 
-    ret = ioctl(mem2mem_fd, VIDIOC_DQBUF, &buf);
-    debug("Dequeued source buffer, index: %d\n", buf.index);
-    if (ret)
+    ret = m2m_ioctl(mem2mem_fd, VIDIOC_QBUF, &buf);
+    perror_ret(ret != 0, "ioctl");
+
+    src_queued++;
+
+    return 0;
+}
+
+/*
+ * POLLOUT side: refills every source buffer the device is done with,
+ * without waiting for the results they belong to.
+ */
+static int refill_src_bufs(void)
+{
+    struct v4l2_buffer buf;
+    int ret;
+
+    while (src_queued < frames_wanted())
     {
-        switch (errno)
+        memzero(buf);
+        buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+        buf.memory = V4L2_MEMORY_MMAP;
+
+        ret = m2m_ioctl(mem2mem_fd, VIDIOC_DQBUF, &buf);
+        if (ret)
         {
-        case EAGAIN:
-            debug("Got EAGAIN\n");
-            return 0;
+            switch (errno)
+            {
+            case EAGAIN:
+                return 0;
+
+            case EIO:
+                debug("Got EIO\n");
+                return 0;
+
+            default:
+                perror("ioctl");
+                return -1;
+            }
+        }
+        debug("Dequeued source buffer, index: %d\n", buf.index);
 
-        case EIO:
-            debug("Got EIO\n");
-            return 0;
+        /* Verify we've got a correct buffer */
+        assert(buf.index < num_src_bufs);
 
-        default:
-            perror("ioctl");
+        /* Once --duration is up, end with the transaction just sent */
+        if (bench_end && curr_src_buf == 0 && latency_now() >= bench_end)
+        {
+            __atomic_store_n(&num_frames, src_queued, __ATOMIC_RELEASE);
             return 0;
         }
+
+        /* Enqueue back the buffer (note that the index is preserved) */
+        ret = queue_src_buf(buf.index);
+        if (ret)
+            return ret;
     }
 
-    /* Verify we've got a correct buffer */
-    assert(buf.index < num_src_bufs);
+    return 0;
+}
 
-    /* Enqueue back the buffer (note that the index is preserved) */
-    if (!last)
-    {
-        uint8_t *p_buf = (uint8_t *) buffer_sdl;
-        p_buf += curr_buf * transsize;
+/* Called as the last result of a transaction comes back */
+static void complete_transaction(uint64_t queued)
+{
+    uint64_t now = latency_now();
 
-        gen_buf((uint8_t *) p_src_buf[buf.index], p_buf, transsize);
+    if (now < warmup_end || (bench_end && now > bench_end))
+        return;
 
+    /* The first one only marks the start of the measurement */
+    if (!bench_begin)
+    {
+        bench_begin = now;
 
-        buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
-        buf.memory = V4L2_MEMORY_MMAP;
-        ret = ioctl(mem2mem_fd, VIDIOC_QBUF, &buf);
-        perror_ret(ret != 0, "ioctl");
+        /* Its last frame is not in dst_done yet */
+        if (bench_frames)
+            __atomic_store_n(&num_frames, dst_done + 1 + bench_frames,
+                             __ATOMIC_RELEASE);
+        return;
     }
 
+    bench_last = now;
+    ++bench_transactions;
 
-    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (queued)
+        latency_record(&trans_latency, now - queued);
+}
 
-    debug("Dequeuing destination buffer\n");
-    ret = ioctl(mem2mem_fd, VIDIOC_DQBUF, &buf);
-    if (ret)
+/*
+ * POLLIN side: displays every finished result and hands its buffer
+ * straight back to the device.
+ */
+static int drain_dst_bufs(void)
+{
+    struct v4l2_buffer buf;
+    int ret;
+    /* When the first source buffer of the transaction was queued */
+    static uint64_t trans_queued;
+
+    while (dst_done < frames_wanted())
     {
-        switch (errno)
+        memzero(buf);
+        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf.memory = V4L2_MEMORY_MMAP;
+
+        ret = m2m_ioctl(mem2mem_fd, VIDIOC_DQBUF, &buf);
+        if (ret)
         {
-        case EAGAIN:
-            debug("Got EAGAIN\n");
-            return 0;
+            switch (errno)
+            {
+            case EAGAIN:
+                return 0;
+
+            case EIO:
+                debug("Got EIO\n");
+                return 0;
+
+            default:
+                perror("ioctl");
+                return -1;
+            }
+        }
+        debug("Dequeued dst buffer, index: %d\n", buf.index);
+        /* Verify we've got a correct buffer */
+        assert(buf.index < num_dst_bufs);
 
-        case EIO:
-            debug("Got EIO\n");
-            return 0;
+        debug("Current buffer in the transaction: %d\n", curr_buf);
 
-        default:
-            perror("ioctl");
-            return 1;
+        if (curr_buf == 0)
+            trans_queued = (buf.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) ==
+                V4L2_BUF_FLAG_TIMESTAMP_COPY ?
+                latency_timeval(&buf.timestamp) : 0;
+
+        /* Display results */
+        if (!bench)
+        {
+            uint8_t *p_post = (uint8_t *) buffer_m2m_sdl;
+            p_post += curr_buf * transsize;
+
+            gen_buf(p_post, (uint8_t *) p_dst_buf[buf.index], transsize);
+        }
+
+        /* Once the whole frame is in */
+        if (++curr_buf >= translen)
+        {
+            curr_buf = 0;
+            complete_transaction(trans_queued);
+
+            if (!bench)
+            {
+                pthread_mutex_lock(&input_lock);
+                render(data_sf, data_m2m_sf);
+                pthread_mutex_unlock(&input_lock);
+            }
+        }
+
+        ++dst_done;
+        if (!bench)
+            printf("FRAMES LEFT: %d\n", frames_wanted() - dst_done);
+
+        /* Enqueue back the buffer */
+        if (dst_queued < frames_wanted())
+        {
+            ret = m2m_ioctl(mem2mem_fd, VIDIOC_QBUF, &buf);
+            perror_ret(ret != 0, "ioctl");
+            ++dst_queued;
+            debug("Enqueued back dst buffer\n");
         }
     }
-    debug("Dequeued dst buffer, index: %d\n", buf.index);
-    /* Verify we've got a correct buffer */
-    assert(buf.index < num_dst_bufs);
 
-    debug("Current buffer in the transaction: %d\n", curr_buf);
+    return 0;
+}
 
-    uint8_t *p_post = (uint8_t *) buffer_m2m_sdl;
-    p_post += curr_buf * transsize;
-    ++curr_buf;
-    if (curr_buf >= translen)
+static void print_bench(void)
+{
+    double secs = (bench_last - bench_begin) / 1e9;
+    double rate = secs > 0 ? bench_transactions / secs : 0;
+    /* Every transaction goes in and comes back out as one frame */
+    double mbytes = rate * translen * transsize * 2 / 1e6;
+
+    if (!bench_transactions || secs <= 0)
+        fprintf(stderr, "Warning: no transaction completed after the "
+                "warmup, nothing was measured\n");
+    else if (bench_transactions < 100)
+        fprintf(stderr, "Warning: only %lu transactions were measured\n",
+                bench_transactions);
+
+    if (bench_json)
     {
-        curr_buf = 0;
-        next_input_frame();
+        printf("{\"device\": \"%s\", \"width\": %zu, \"height\": %zu, "
+               "\"translen\": %d, \"transtime_ms\": %d, "
+               "\"src_buffers\": %u, \"dst_buffers\": %u, "
+               "\"pipeline\": %s, \"warmup_s\": %g, \"seconds\": %.6f, "
+               "\"transactions\": %lu, \"transactions_per_s\": %.2f, "
+               "\"mbytes_per_s\": %.2f, \"latency_ms\": {\"samples\": "
+               "%llu, \"p50\": %.4f, \"p90\": %.4f, \"p99\": %.4f, "
+               "\"p99.9\": %.4f, \"max\": %.4f}}\n", mem2mem_dev_name,
+               WIDTH, HEIGHT, translen, transtime, num_src_bufs,
+               num_dst_bufs, pipelined ? "true" : "false", warmup, secs,
+               bench_transactions, rate, mbytes,
+               (unsigned long long)trans_latency.total,
+               latency_percentile(&trans_latency, 50) / 1e6,
+               latency_percentile(&trans_latency, 90) / 1e6,
+               latency_percentile(&trans_latency, 99) / 1e6,
+               latency_percentile(&trans_latency, 99.9) / 1e6,
+               trans_latency.max / 1e6);
+        return;
     }
 
-    /* Display results */
-    gen_buf(p_post, (uint8_t *) p_dst_buf[buf.index], transsize);
+    printf("%s: %zux%zu, %d buffer(s) per transaction, %u/%u buffers\n",
+           mem2mem_dev_name, WIDTH, HEIGHT, translen, num_src_bufs,
+           num_dst_bufs);
+    printf("%lu transactions in %.3f s: %.1f transactions/s, "
+           "%.1f MB/s in + out\n", bench_transactions, secs, rate, mbytes);
+    latency_print(&trans_latency, stdout, "transaction");
+}
 
-    render(data_sf, data_m2m_sf);
+/* With --pipeline the source buffers are refilled on this thread */
+static void *refill_thread(void *arg)
+{
+    int revents;
 
-    /* Enqueue back the buffer */
-    if (!last)
+    while (src_queued < frames_wanted() &&
+           !__atomic_load_n(&m2m_quit, __ATOMIC_ACQUIRE))
     {
-        // gen_dst_buf(p_dst_buf[buf.index], dst_buf_size[buf.index]);
-        ret = ioctl(mem2mem_fd, VIDIOC_QBUF, &buf);
-        perror_ret(ret != 0, "ioctl");
-        debug("Enqueued back dst buffer\n");
+        /* Time out now and then to notice m2m_quit */
+        revents = m2m_poll(mem2mem_fd, POLLOUT, 100);
+        if (revents < 0 && errno != EINTR)
+        {
+            perror("poll");
+            break;
+        }
+
+        if (revents > 0 && (revents & POLLOUT) && refill_src_bufs())
+            break;
     }
 
-    return 0;
+    if (src_queued < frames_wanted())
+        __atomic_store_n(&m2m_quit, 1, __ATOMIC_RELEASE);
+
+    return NULL;
 }
 
 static void start_mem2mem()
@@ -401,45 +706,63 @@ static void start_mem2mem()
     struct v4l2_buffer buf;
     struct v4l2_requestbuffers reqbuf;
     enum v4l2_buf_type type;
-    int last = 0;
     SDL_Event event;
+    pthread_t refill;
+    struct timespec start, end;
+    double elapsed;
 
     init_mem2mem_dev();
 
     memzero(reqbuf);
-    reqbuf.count = NUM_BUFS;
+    reqbuf.count = num_bufs;
     reqbuf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
     type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
     reqbuf.memory = V4L2_MEMORY_MMAP;
-    ret = ioctl(mem2mem_fd, VIDIOC_REQBUFS, &reqbuf);
+    ret = m2m_ioctl(mem2mem_fd, VIDIOC_REQBUFS, &reqbuf);
     perror_exit(ret != 0, "ioctl");
-    num_src_bufs = reqbuf.count;
+    num_src_bufs = reqbuf.count < MAX_BUFS ? reqbuf.count : MAX_BUFS;
     debug("Got %d src buffers\n", num_src_bufs);
 
-    reqbuf.count = NUM_BUFS;
+    reqbuf.count = num_bufs;
     reqbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    ret = ioctl(mem2mem_fd, VIDIOC_REQBUFS, &reqbuf);
+    ret = m2m_ioctl(mem2mem_fd, VIDIOC_REQBUFS, &reqbuf);
     perror_exit(ret != 0, "ioctl");
-    num_dst_bufs = reqbuf.count;
+    num_dst_bufs = reqbuf.count < MAX_BUFS ? reqbuf.count : MAX_BUFS;
     debug("Got %d dst buffers\n", num_dst_bufs);
 
     transsize = WIDTH * HEIGHT / translen * 2;
 
+    /*
+     * The device only runs whole transactions, a partial last one would
+     * never come back.
+     */
+    if (duration > 0)
+        num_frames = INT_MAX / translen * translen;
+    else
+        num_frames = (num_frames + translen - 1) / translen * translen;
+
+    /* Run until the warmup is over, complete_transaction() sets the end */
+    if (bench && duration <= 0)
+    {
+        bench_frames = num_frames;
+        num_frames = INT_MAX / translen * translen;
+    }
+
     for (i = 0; i < num_src_bufs; ++i)
     {
         buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
         buf.memory = V4L2_MEMORY_MMAP;
         buf.index = i;
 
-        ret = ioctl(mem2mem_fd, VIDIOC_QUERYBUF, &buf);
+        ret = m2m_ioctl(mem2mem_fd, VIDIOC_QUERYBUF, &buf);
         perror_exit(ret != 0, "ioctl");
         debug("QUERYBUF returned offset: %x\n", buf.m.offset);
 
         src_buf_size[i] = buf.length;
-        p_src_buf[i] = mmap(NULL, buf.length,
-                            PROT_READ | PROT_WRITE, MAP_SHARED,
-                            mem2mem_fd, buf.m.offset);
+        p_src_buf[i] = m2m_mmap(NULL, buf.length,
+                                PROT_READ | PROT_WRITE, MAP_SHARED,
+                                mem2mem_fd, buf.m.offset);
         perror_exit(MAP_FAILED == p_src_buf[i], "mmap");
     }
 
@@ -449,87 +772,108 @@ static void start_mem2mem()
         buf.memory = V4L2_MEMORY_MMAP;
         buf.index = i;
 
-        ret = ioctl(mem2mem_fd, VIDIOC_QUERYBUF, &buf);
+        ret = m2m_ioctl(mem2mem_fd, VIDIOC_QUERYBUF, &buf);
         perror_exit(ret != 0, "ioctl");
         debug("QUERYBUF returned offset: %x\n", buf.m.offset);
 
         dst_buf_size[i] = buf.length;
-        p_dst_buf[i] = mmap(NULL, buf.length,
-                            PROT_READ | PROT_WRITE, MAP_SHARED,
-                            mem2mem_fd, buf.m.offset);
+        p_dst_buf[i] = m2m_mmap(NULL, buf.length,
+                                PROT_READ | PROT_WRITE, MAP_SHARED,
+                                mem2mem_fd, buf.m.offset);
         perror_exit(MAP_FAILED == p_dst_buf[i], "mmap");
     }
 
-    next_input_frame();
-    for (i = 0; i < num_src_bufs; ++i)
+    for (i = 0; i < num_src_bufs && src_queued < num_frames; ++i)
     {
-        uint8_t *p_buf = (uint8_t *) buffer_sdl;
-        p_buf += (i % translen) * transsize;
-
-        gen_buf((uint8_t *) p_src_buf[i], p_buf, transsize);
-
-
-        memzero(buf);
-        buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
-        buf.memory = V4L2_MEMORY_MMAP;
-        buf.index = i;
-
-        ret = ioctl(mem2mem_fd, VIDIOC_QBUF, &buf);
-        perror_exit(ret != 0, "ioctl");
+        ret = queue_src_buf(i);
+        error_exit(ret != 0, "queue_src_buf");
     }
 
-    for (i = 0; i < num_dst_bufs; ++i)
+    for (i = 0; i < num_dst_bufs && dst_queued < num_frames; ++i)
     {
         memzero(buf);
         buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
         buf.memory = V4L2_MEMORY_MMAP;
         buf.index = i;
 
-        ret = ioctl(mem2mem_fd, VIDIOC_QBUF, &buf);
+        ret = m2m_ioctl(mem2mem_fd, VIDIOC_QBUF, &buf);
         perror_exit(ret != 0, "ioctl");
+        ++dst_queued;
     }
 
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    warmup_end = latency_now() + warmup * 1e9;
+    if (duration > 0)
+        bench_end = warmup_end + duration * 1e9;
+
     type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
-    ret = ioctl(mem2mem_fd, VIDIOC_STREAMON, &type);
+    ret = m2m_ioctl(mem2mem_fd, VIDIOC_STREAMON, &type);
     debug("STREAMON (%ld): %d\n", VIDIOC_STREAMON, ret);
     perror_exit(ret != 0, "ioctl");
 
     type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    ret = ioctl(mem2mem_fd, VIDIOC_STREAMON, &type);
+    ret = m2m_ioctl(mem2mem_fd, VIDIOC_STREAMON, &type);
     debug("STREAMON (%ld): %d\n", VIDIOC_STREAMON, ret);
     perror_exit(ret != 0, "ioctl");
 
-    while (num_frames)
+    if (pipelined && pthread_create(&refill, NULL, refill_thread, NULL))
     {
-        fd_set read_fds;
-        int r;
+        fprintf(stderr, "Cannot create refill thread\n");
+        exit(EXIT_FAILURE);
+    }
 
+    /*
+     * Refilling sources (POLLOUT) and draining results (POLLIN) are
+     * independent, so every buffer can be in flight at once.
+     */
+    while (dst_done < frames_wanted() &&
+           !__atomic_load_n(&m2m_quit, __ATOMIC_ACQUIRE))
+    {
+        short events = POLLIN;
+        int revents;
 
-        while (SDL_PollEvent(&event))
+        while (!bench && SDL_PollEvent(&event))
             if (event.type == SDL_QUIT)
-                return;
+                __atomic_store_n(&m2m_quit, 1, __ATOMIC_RELEASE);
 
+        if (!pipelined && src_queued < frames_wanted())
+            events |= POLLOUT;
 
-        FD_ZERO(&read_fds);
-        FD_SET(mem2mem_fd, &read_fds);
+        /* Time out now and then to keep handling SDL events */
+        revents = m2m_poll(mem2mem_fd, events, 100);
+        if (revents < 0 && errno == EINTR)
+            continue;
+        perror_exit(revents < 0, "poll");
 
-        debug("Before select");
-        r = select(mem2mem_fd + 1, &read_fds, NULL, NULL, 0);
-        perror_exit(r < 0, "select");
-        debug("After select");
+        if ((revents & POLLOUT) && refill_src_bufs())
+            break;
 
-        if (num_frames == 1)
-            last = 1;
-        if (read_mem2mem_frame(last))
+        if ((revents & POLLIN) && drain_dst_bufs())
         {
             fprintf(stderr, "Read frame failed\n");
             break;
         }
-        --num_frames;
-        printf("FRAMES LEFT: %d\n", num_frames);
     }
 
-    close(mem2mem_fd);
+    __atomic_store_n(&m2m_quit, 1, __ATOMIC_RELEASE);
+
+    if (pipelined)
+        pthread_join(refill, NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    elapsed = (end.tv_sec - start.tv_sec) +
+        (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    if (bench)
+        print_bench();
+    else
+        fprintf(stderr, "Processed %d buffers in %.3f s (%.1f buffers/s), "
+                "%u source and %u destination buffers\n", dst_done,
+                elapsed, elapsed > 0 ? dst_done / elapsed : 0.0,
+                num_src_bufs, num_dst_bufs);
+
+    m2m_close(mem2mem_fd);
 
     for (i = 0; i < num_src_bufs; ++i)
         munmap(p_src_buf[i], src_buf_size[i]);
@@ -549,13 +893,31 @@ static void usage(FILE * fp, int argc, char **argv)
             "-y | --height              Video height\n"
             "-t | --translen            Transaction length [1]\n"
             "-T | --time                Transaction time in ms [1]\n"
-            "-n | --num-frames          Number of frames to process [1000]\n"
+            "-n | --num-frames          Number of frames to process, "
+            "after --warmup\n"
+            "                           with --bench [1000]\n"
+            "-b | --buffers num         Buffers per queue [4]\n"
+            "-p | --pipeline            Refill sources on a separate thread\n"
+            "-B | --bench               Measure throughput without SDL or "
+            "per-frame output\n"
+            "-w | --warmup sec          Transactions not counted by --bench "
+            "[1]\n"
+            "-d | --duration sec        Measure this long instead of "
+            "--num-frames\n"
+            "-j | --json                Print --bench results as JSON\n"
+            "-s | --seed num            Seed of the generated input [1]\n"
+            "-E | --emulate[=threads]   Emulate mem2mem_testdev in process "
+            "instead of\n"
+            "                           opening --m2m-device [1 thread]\n"
+            "-r | --ring num            Generate num input frames up front "
+            "and cycle\n"
+            "                           through them\n"
             "-f | --hflip               Horizontal Mirror\n"
             "-v | --flip                Vertical Mirror\n"
             "", argv[0]);
 }
 
-static const char short_options[] = "o:hx:y:t:T:n:fv";
+static const char short_options[] = "o:hx:y:t:T:n:b:pBw:d:js:r:E::fv";
 
 static const struct option long_options[] = {
     {"m2m-device", required_argument, NULL, 'o'},
@@ -565,6 +927,15 @@ static const struct option long_options[] = {
     {"translen", required_argument, NULL, 't'},
     {"time", required_argument, NULL, 'T'},
     {"num-frames", required_argument, NULL, 'n'},
+    {"buffers", required_argument, NULL, 'b'},
+    {"pipeline", no_argument, NULL, 'p'},
+    {"bench", no_argument, NULL, 'B'},
+    {"warmup", required_argument, NULL, 'w'},
+    {"duration", required_argument, NULL, 'd'},
+    {"json", no_argument, NULL, 'j'},
+    {"seed", required_argument, NULL, 's'},
+    {"ring", required_argument, NULL, 'r'},
+    {"emulate", optional_argument, NULL, 'E'},
     {"hflip", no_argument, NULL, 'f'},
     {"vflip", no_argument, NULL, 'v'},
     {0, 0, 0, 0}
@@ -622,6 +993,55 @@ int main(int argc, char **argv)
             num_frames = atoi(optarg);
             break;
 
+        case 'b':
+            num_bufs = atoi(optarg);
+
+            if (num_bufs < 1 || num_bufs > MAX_BUFS)
+            {
+                fprintf(stderr, "Buffer count must be between 1 and %d\n",
+                        MAX_BUFS);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'p':
+            pipelined = 1;
+            break;
+
+        case 'B':
+            bench = 1;
+            break;
+
+        case 'w':
+            warmup = atof(optarg);
+            break;
+
+        case 'd':
+            duration = atof(optarg);
+            break;
+
+        case 'j':
+            bench_json = 1;
+            break;
+
+        case 's':
+            seed = strtoull(optarg, NULL, 0);
+            break;
+
+        case 'r':
+            ring_frames = atoi(optarg);
+            break;
+
+        case 'E':
+            emulate = optarg ? atoi(optarg) : 1;
+
+            if (emulate < 1)
+            {
+                fprintf(stderr, "The emulator needs at least one thread\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+
         case 'f':
             hflip = 1;
             break;
@@ -636,38 +1056,62 @@ int main(int argc, char **argv)
         }
     }
 
-    atexit(SDL_Quit);
-    if (SDL_Init(SDL_INIT_VIDEO) < 0)
-        return 1;
+    if (translen < 1 || num_bufs < translen)
+    {
+        fprintf(stderr, "Need at least --translen buffers per queue\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (emulate)
+        mem2mem_dev_name = "emulated mem2mem_testdev";
 
-    SDL_WM_SetCaption("SDL mem2mem tester", NULL);
+    if (warmup < 0 || duration < 0)
+    {
+        fprintf(stderr, "--warmup and --duration cannot be negative\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (!bench)
+    {
+        atexit(SDL_Quit);
+        if (SDL_Init(SDL_INIT_VIDEO) < 0)
+            return 1;
 
-    data = (uint8_t*)malloc(WIDTH*HEIGHT*3);
-    init_input_data(data);
+        SDL_WM_SetCaption("SDL mem2mem tester", NULL);
+    }
 
-    buffer_sdl = (uint16_t *) malloc(WIDTH * HEIGHT * 2);
-    buffer_m2m_sdl = (uint16_t *) malloc(WIDTH * HEIGHT * 2);
+    buffer_sdl = arena_alloc(WIDTH * HEIGHT * 2);
+    buffer_m2m_sdl = arena_alloc(WIDTH * HEIGHT * 2);
 
-    SDL_SetVideoMode(WIDTH, HEIGHT * 2 + SEPARATOR, 16, SDL_HWSURFACE);
+    init_input_frames();
 
-    data_sf = SDL_CreateRGBSurfaceFrom(buffer_sdl, WIDTH, HEIGHT,
-                                       16, WIDTH * 2,
-                                       0x1F00, 0xE007, 0x00F8, 0);
+    if (!bench)
+    {
+        SDL_SetVideoMode(WIDTH, HEIGHT * 2 + SEPARATOR, 16, SDL_HWSURFACE);
 
-    data_m2m_sf = SDL_CreateRGBSurfaceFrom(buffer_m2m_sdl, WIDTH, HEIGHT,
+        data_sf = SDL_CreateRGBSurfaceFrom(buffer_sdl, WIDTH, HEIGHT,
                                            16, WIDTH * 2,
                                            0x1F00, 0xE007, 0x00F8, 0);
 
-    SDL_SetEventFilter(sdl_filter);
+        data_m2m_sf = SDL_CreateRGBSurfaceFrom(buffer_m2m_sdl, WIDTH, HEIGHT,
+                                               16, WIDTH * 2,
+                                               0x1F00, 0xE007, 0x00F8, 0);
+
+        SDL_SetEventFilter(sdl_filter);
+    }
 
     start_mem2mem();
 
-    free(data);
+    if (frame_ring)
+        arena_free(frame_ring);
 
-    SDL_FreeSurface(data_sf);
-    SDL_FreeSurface(data_m2m_sf);
-    free(buffer_sdl);
-    free(buffer_m2m_sdl);
+    if (!bench)
+    {
+        SDL_FreeSurface(data_sf);
+        SDL_FreeSurface(data_m2m_sf);
+    }
+    arena_free(buffer_sdl);
+    arena_free(buffer_m2m_sdl);
 
     exit(EXIT_SUCCESS);
 
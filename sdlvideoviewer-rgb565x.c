@@ -2,7 +2,8 @@
  * Copyright (C) 2012 by Tomasz Moń <desowin@gmail.com>
  *
  * compile with:
- *   gcc -o sdlvideoviewer-rgb565x sdlvideoviewer-rgb565x.c -lSDL
+ *   gcc -pthread -o sdlvideoviewer-rgb565x sdlvideoviewer-rgb565x.c arena.c \
+ *       convert.c latency.c m2m.c reactor.c workers.c -lSDL
  *
  * Based on V4L2 video capture example and process-vmalloc.c
  * Capture+output (process) V4L2 device tester.
@@ -16,6 +17,8 @@
  * option) any later version
  */
 
+#define _GNU_SOURCE
+
 #include <SDL/SDL.h>
 #include <assert.h>
 #include <stdint.h>
@@ -45,6 +48,13 @@
 
 #include <linux/videodev2.h>
 
+#include "arena.h"
+#include "convert.h"
+#include "latency.h"
+#include "m2m.h"
+#include "reactor.h"
+#include "workers.h"
+
 #define CLEAR(x) memset (&(x), 0, sizeof (x))
 
 #define max(a, b) (a > b ? a : b)
@@ -69,10 +79,75 @@ static io_method io = IO_METHOD_MMAP;
 static int fd = -1;
 struct buffer *buffers = NULL;
 static unsigned int n_buffers = 0;
+static unsigned int num_buffers = 4;
+static unsigned int num_m2m_buffers = 4;
 
 static int hflip = 0;
 static int vflip = 0;
 
+static unsigned int num_threads = 0;
+
+/* How captured frames reach the mem2mem OUTPUT queue */
+typedef enum
+{
+    SHARE_NONE,                 /* convert, then copy into OUTPUT buffers */
+    SHARE_DMABUF,               /* queue capture buffers as DMABUF */
+    SHARE_FUSED,                /* convert straight into OUTPUT buffers */
+} share_method;
+
+static int want_dmabuf = 0;
+/* Worker threads of the mem2mem_testdev emulator, 0 for the real device */
+static unsigned int emulate = 0;
+static share_method share = SHARE_NONE;
+static uint32_t capture_pixfmt = V4L2_PIX_FMT_YUYV;
+static int *dmabuf_fds = NULL;
+
+/* With SHARE_FUSED, OUTPUT buffer the next captured frame goes to */
+static uint16_t *fused_dst = NULL;
+
+/*
+ * loop drives the mem2mem side and handles signals. The capture fd has an
+ * epoll set of its own, used to sleep until the next frame when frames
+ * are read one at a time by read_input_frame().
+ */
+static struct reactor loop;
+static struct reactor capture_loop;
+static struct reactor_source signal_source;
+static struct reactor_source capture_source;
+static struct reactor_source capture_wait_source;
+static struct reactor_source m2m_source;
+
+/* Seconds between latency reports while running, 0 disables them */
+static unsigned int stats_interval = 0;
+static struct reactor_source stats_source;
+
+enum stage
+{
+    STAGE_WAIT,                 /* driver timestamp to capture DQBUF */
+    STAGE_CONVERT,              /* capture DQBUF to converted */
+    STAGE_REQUEUE,              /* converted to capture QBUF */
+    STAGE_M2M,                  /* mem2mem OUTPUT QBUF to CAPTURE DQBUF */
+    STAGE_RENDER,               /* result copy and render() */
+    N_STAGES
+};
+
+static const char *const stage_names[N_STAGES] = {
+    [STAGE_WAIT] = "driver to DQBUF",
+    [STAGE_CONVERT] = "conversion",
+    [STAGE_REQUEUE] = "to QBUF",
+    [STAGE_M2M] = "mem2mem",
+    [STAGE_RENDER] = "render",
+};
+
+/* Whole run and current interval */
+static struct latency latency[N_STAGES];
+static struct latency latency_interval[N_STAGES];
+
+/* Captured frame in flight, CLOCK_MONOTONIC ns, 0 if not taken */
+static uint64_t frame_driver;
+static uint64_t frame_dequeued;
+static uint64_t frame_converted;
+
 static size_t WIDTH = 640;
 static size_t HEIGHT = 240;
 /* Spacing between input and output display */
@@ -90,10 +165,12 @@ static uint16_t *buffer_m2m_sdl;
 SDL_Surface *data_sf;
 SDL_Surface *data_m2m_sf;
 
-#define V4L2_CID_TRANS_TIME_MSEC        (V4L2_CID_PRIVATE_BASE)
-#define V4L2_CID_TRANS_NUM_BUFS         (V4L2_CID_PRIVATE_BASE + 1)
+/* Same controls as exposed by vim2m */
+#define VIM2M_CID_TRANS_TIME_MSEC       (V4L2_CID_USER_BASE + 0x1000)
+#define VIM2M_CID_TRANS_NUM_BUFS        (V4L2_CID_USER_BASE + 0x1001)
 
-#define NUM_BUFS	4
+/* Upper limit for the --buffers and --m2m-buffers counts */
+#define MAX_BUFS	32
 
 #define perror_exit(cond, func)\
 	if (cond) {\
@@ -127,8 +204,8 @@ SDL_Surface *data_m2m_sf;
 #endif
 
 static int mem2mem_fd;
-static char *p_src_buf[NUM_BUFS], *p_dst_buf[NUM_BUFS];
-static size_t src_buf_size[NUM_BUFS], dst_buf_size[NUM_BUFS];
+static char *p_src_buf[MAX_BUFS], *p_dst_buf[MAX_BUFS];
+static size_t src_buf_size[MAX_BUFS], dst_buf_size[MAX_BUFS];
 static uint32_t num_src_bufs = 0, num_dst_bufs = 0;
 
 /* transize = WIDTH*HEIGHT/translen*2 */
@@ -186,124 +263,96 @@ static void render(SDL_Surface * pre, SDL_Surface * post)
 
 
 
-void YCbCrToRGB(int y, int cb, int cr, uint8_t * r, uint8_t * g, uint8_t * b)
+static void gen_buf(uint8_t * dst, uint8_t * src, size_t size);
+
+static void convert_stripe(void *arg, size_t first, size_t last)
 {
-    double Y = (double)y;
-    double Cb = (double)cb;
-    double Cr = (double)cr;
+    const uint8_t *buffer_yuv = arg;
 
-    int R = (int)(Y + 1.40200 * (Cr - 0x80));
-    int G = (int)(Y - 0.34414 * (Cb - 0x80) - 0.71414 * (Cr - 0x80));
-    int B = (int)(Y + 1.77200 * (Cb - 0x80));
+    size_t y;
 
-    *r = max(0, min(255, R));
-    *g = max(0, min(255, G));
-    *b = max(0, min(255, B));
+    for (y = first; y < last; y++)
+        if (fused_dst)
+            yuyv_to_rgb565x_dual_row(&buffer_sdl[y * WIDTH],
+                                     &fused_dst[y * WIDTH],
+                                     buffer_yuv + y * WIDTH * 2, WIDTH);
+        else
+            yuyv_to_rgb565x_row(&buffer_sdl[y * WIDTH],
+                                buffer_yuv + y * WIDTH * 2, WIDTH);
 }
 
-/* 
- * YCbCr to RGB lookup table
- *
- * Indexes are [Y][Cb][Cr]
- * Y, Cb, Cr range is 0-255
- *
- * Stored value bits:
- *   24-16 Red
- *   15-8  Green
- *   7-0   Blue
- */
-uint32_t YCbCr_to_RGB[256][256][256];
-
-static void generate_YCbCr_to_RGB_lookup()
+static void stage_record(enum stage stage, uint64_t from, uint64_t to)
 {
-    int y;
-    int cb;
-    int cr;
+    if (!from || !to)
+        return;
 
-    for (y = 0; y < 256; y++)
-    {
-        for (cb = 0; cb < 256; cb++)
-        {
-            for (cr = 0; cr < 256; cr++)
-            {
-                double Y = (double)y;
-                double Cb = (double)cb;
-                double Cr = (double)cr;
+    latency_record(&latency[stage], to - from);
+    latency_record(&latency_interval[stage], to - from);
+}
 
-                int R = (int)(Y + 1.40200 * (Cr - 0x80));
-                int G =
-                    (int)(Y - 0.34414 * (Cb - 0x80) - 0.71414 * (Cr - 0x80));
-                int B = (int)(Y + 1.77200 * (Cb - 0x80));
+static void print_latency(int interval)
+{
+    struct latency *l = interval ? latency_interval : latency;
+    unsigned int stage;
 
-                R = max(0, min(255, R));
-                G = max(0, min(255, G));
-                B = max(0, min(255, B));
+    fprintf(stderr, "Latency%s:\n", interval ? " (last interval)" : "");
 
-                YCbCr_to_RGB[y][cb][cr] = R << 16 | G << 8 | B;
-            }
-        }
+    for (stage = 0; stage < N_STAGES; stage++)
+    {
+        latency_print(&l[stage], stderr, stage_names[stage]);
+
+        if (interval)
+            latency_reset(&l[stage]);
     }
 }
 
-#define COLOR_GET_RED(color)   ((color >> 16) & 0xFF)
-#define COLOR_GET_GREEN(color) ((color >> 8) & 0xFF)
-#define COLOR_GET_BLUE(color)  (color & 0xFF)
-
-/**
- * Converts RGB888 color to RGB565
- */
-static uint16_t inline RGB888_to_RGB565(uint32_t rgb)
+/* buf is NULL for read() i/o */
+static void capture_dequeued(const struct v4l2_buffer *buf)
 {
-    uint16_t tmp;
+    frame_dequeued = latency_now();
+    frame_driver = 0;
+    frame_converted = 0;
 
-    tmp = ((rgb >> 3) & 0x1F) << 11 |   /* Blue */
-        ((rgb >> 10) & 0x3F) << 5 | /* Green */
-        ((rgb >> 19) & 0x1F);   /* Red */
-
-#if __BYTE_ORDER == __LITTLE_ENDIAN
-    /* In LE lower byte is stored under lower address */
-    tmp = ((tmp >> 8) & 0xFF) | ((tmp & 0xFF) << 8);
-#elif __BYTE_ORDER == __BIG_ENDIAN
-    /* Nothing to do */
-#else
-#error "Unknown Endianess"
-#endif
+    if (buf && (buf->flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) ==
+        V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC)
+        frame_driver = latency_timeval(&buf->timestamp);
 
-    return tmp;
+    stage_record(STAGE_WAIT, frame_driver, frame_dequeued);
 }
 
-/**
- *  Converts YUV422 to RGB565
- *  Before first use call generate_YCbCr_to_RGB_lookup();
- *
- *  input is pointer to YUV422 encoded data in following order: Y0, Cb, Y1, Cr.
- *  output is pointer to 16 bit RGB565X buffer.
- */
-static void inline YUV422_to_RGB565(uint16_t * output, const uint8_t * input)
+static void capture_queued(void)
 {
-    uint8_t y0 = input[0];
-    uint8_t cb = input[1];
-    uint8_t y1 = input[2];
-    uint8_t cr = input[3];
+    stage_record(STAGE_REQUEUE, frame_converted, latency_now());
+}
 
-    uint32_t rgb = YCbCr_to_RGB[y0][cb][cr];
-    output[0] = RGB888_to_RGB565(rgb);
+/* mem2mem drivers copy OUTPUT timestamps to the matching CAPTURE buffer */
+static void m2m_stamp(struct v4l2_buffer *buf)
+{
+    buf->timestamp = latency_to_timeval(latency_now());
+}
 
-    rgb = YCbCr_to_RGB[y1][cb][cr];
-    output[1] = RGB888_to_RGB565(rgb);
+static void m2m_dequeued(const struct v4l2_buffer *buf)
+{
+    if ((buf->flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) ==
+        V4L2_BUF_FLAG_TIMESTAMP_COPY)
+        stage_record(STAGE_M2M, latency_timeval(&buf->timestamp),
+                     latency_now());
 }
 
 static void process_image(const void *p)
 {
-    const uint8_t *buffer_yuv = p;
-
-    size_t x;
-    size_t y;
+    if (capture_pixfmt == V4L2_PIX_FMT_RGB565X)
+    {
+        /* Already in the mem2mem format, only the display copy is left */
+        gen_buf((uint8_t *) buffer_sdl, (uint8_t *) p, WIDTH * HEIGHT * 2);
+    }
+    else
+    {
+        workers_run(convert_stripe, (void *)p, HEIGHT);
+    }
 
-    for (y = 0; y < HEIGHT; y++)
-        for (x = 0; x < WIDTH; x += 2)
-            YUV422_to_RGB565(&buffer_sdl[y * WIDTH + x],
-                             buffer_yuv + (y * WIDTH + x) * 2);
+    frame_converted = latency_now();
+    stage_record(STAGE_CONVERT, frame_dequeued, frame_converted);
 }
 
 static int read_frame(void)
@@ -331,6 +380,8 @@ static int read_frame(void)
             }
         }
 
+        capture_dequeued(NULL);
+
         process_image(buffers[0].start);
 
         break;
@@ -360,11 +411,15 @@ static int read_frame(void)
 
         assert(buf.index < n_buffers);
 
+        capture_dequeued(&buf);
+
         process_image(buffers[buf.index].start);
 
         if (-1 == xioctl(fd, VIDIOC_QBUF, &buf))
             errno_exit("VIDIOC_QBUF");
 
+        capture_queued();
+
         break;
 
     case IO_METHOD_USERPTR:
@@ -397,52 +452,41 @@ static int read_frame(void)
 
         assert(i < n_buffers);
 
+        capture_dequeued(&buf);
+
         process_image((void *)buf.m.userptr);
 
         if (-1 == xioctl(fd, VIDIOC_QBUF, &buf))
             errno_exit("VIDIOC_QBUF");
 
+        capture_queued();
+
         break;
     }
 
     return 1;
 }
 
+static void on_capture_wait(void *arg, uint32_t events)
+{
+    /* Only wakes read_input_frame() up */
+}
+
 static void read_input_frame(void)
 {
-    for (;;)
+    /* Only sleep when no buffer is ready yet */
+    while (!read_frame())
     {
-        fd_set fds;
-        struct timeval tv;
-        int r;
-
-        FD_ZERO(&fds);
-        FD_SET(fd, &fds);
-
-        /* Timeout. */
-        tv.tv_sec = 2;
-        tv.tv_usec = 0;
-
-        r = select(fd + 1, &fds, NULL, NULL, &tv);
+        int r = reactor_run(&capture_loop, 2000);
 
         if (-1 == r)
-        {
-            if (EINTR == errno)
-                continue;
-
-            errno_exit("select");
-        }
+            errno_exit("epoll_wait");
 
         if (0 == r)
         {
-            fprintf(stderr, "select timeout\n");
+            fprintf(stderr, "capture timeout\n");
             exit(EXIT_FAILURE);
         }
-
-        if (read_frame())
-            break;
-
-        /* EAGAIN - continue select loop. */
     }
 }
 
@@ -533,7 +577,7 @@ static void uninit_device(void)
     switch (io)
     {
     case IO_METHOD_READ:
-        free(buffers[0].start);
+        arena_free(buffers[0].start);
         break;
 
     case IO_METHOD_MMAP:
@@ -544,10 +588,19 @@ static void uninit_device(void)
 
     case IO_METHOD_USERPTR:
         for (i = 0; i < n_buffers; ++i)
-            free(buffers[i].start);
+            arena_free(buffers[i].start);
         break;
     }
 
+    if (dmabuf_fds)
+    {
+        for (i = 0; i < n_buffers; ++i)
+            close(dmabuf_fds[i]);
+
+        free(dmabuf_fds);
+        dmabuf_fds = NULL;
+    }
+
     free(buffers);
 }
 
@@ -562,7 +615,7 @@ static void init_read(unsigned int buffer_size)
     }
 
     buffers[0].length = buffer_size;
-    buffers[0].start = malloc(buffer_size);
+    buffers[0].start = arena_alloc(buffer_size);
 
     if (!buffers[0].start)
     {
@@ -577,7 +630,7 @@ static void init_mmap(void)
 
     CLEAR(req);
 
-    req.count = 4;
+    req.count = num_buffers;
     req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     req.memory = V4L2_MEMORY_MMAP;
 
@@ -644,7 +697,7 @@ static void init_userp(unsigned int buffer_size)
 
     CLEAR(req);
 
-    req.count = 4;
+    req.count = num_buffers;
     req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     req.memory = V4L2_MEMORY_USERPTR;
 
@@ -662,7 +715,7 @@ static void init_userp(unsigned int buffer_size)
         }
     }
 
-    buffers = calloc(4, sizeof(*buffers));
+    buffers = calloc(num_buffers, sizeof(*buffers));
 
     if (!buffers)
     {
@@ -670,11 +723,10 @@ static void init_userp(unsigned int buffer_size)
         exit(EXIT_FAILURE);
     }
 
-    for (n_buffers = 0; n_buffers < 4; ++n_buffers)
+    for (n_buffers = 0; n_buffers < num_buffers; ++n_buffers)
     {
         buffers[n_buffers].length = buffer_size;
-        buffers[n_buffers].start = memalign( /* boundary */ page_size,
-                                            buffer_size);
+        buffers[n_buffers].start = arena_alloc(buffer_size);
 
         if (!buffers[n_buffers].start)
         {
@@ -765,16 +817,37 @@ static void init_device(void)
     }
 
 
-    CLEAR(fmt);
+    if (want_dmabuf && io == IO_METHOD_MMAP && translen == 1)
+    {
+        /* Frames in the mem2mem format can be passed on as they are */
+        CLEAR(fmt);
+
+        fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        fmt.fmt.pix.width = WIDTH;
+        fmt.fmt.pix.height = HEIGHT;
+        fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_RGB565X;
+        fmt.fmt.pix.field = V4L2_FIELD_NONE;
+
+        if (0 == xioctl(fd, VIDIOC_S_FMT, &fmt) &&
+            fmt.fmt.pix.pixelformat == V4L2_PIX_FMT_RGB565X &&
+            fmt.fmt.pix.width == WIDTH && fmt.fmt.pix.height == HEIGHT &&
+            fmt.fmt.pix.bytesperline == WIDTH * 2)
+            capture_pixfmt = V4L2_PIX_FMT_RGB565X;
+    }
 
-    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    fmt.fmt.pix.width = WIDTH;
-    fmt.fmt.pix.height = HEIGHT;
-    fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;
-    fmt.fmt.pix.field = V4L2_FIELD_INTERLACED;
+    if (capture_pixfmt == V4L2_PIX_FMT_YUYV)
+    {
+        CLEAR(fmt);
 
-    if (-1 == xioctl(fd, VIDIOC_S_FMT, &fmt))
-        errno_exit("VIDIOC_S_FMT");
+        fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        fmt.fmt.pix.width = WIDTH;
+        fmt.fmt.pix.height = HEIGHT;
+        fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;
+        fmt.fmt.pix.field = V4L2_FIELD_INTERLACED;
+
+        if (-1 == xioctl(fd, VIDIOC_S_FMT, &fmt))
+            errno_exit("VIDIOC_S_FMT");
+    }
 
     /* Note VIDIOC_S_FMT may change width and height. */
 
@@ -808,6 +881,78 @@ static void init_device(void)
     }
 }
 
+static int export_buffers(void)
+{
+    unsigned int i;
+
+    dmabuf_fds = calloc(n_buffers, sizeof(*dmabuf_fds));
+
+    if (!dmabuf_fds)
+    {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < n_buffers; ++i)
+    {
+        struct v4l2_exportbuffer expbuf;
+
+        CLEAR(expbuf);
+
+        expbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        expbuf.index = i;
+        expbuf.flags = O_RDWR | O_CLOEXEC;
+
+        if (-1 == xioctl(fd, VIDIOC_EXPBUF, &expbuf))
+        {
+            fprintf(stderr, "%s: VIDIOC_EXPBUF error %d, %s\n",
+                    dev_name, errno, strerror(errno));
+
+            while (i--)
+                close(dmabuf_fds[i]);
+
+            free(dmabuf_fds);
+            dmabuf_fds = NULL;
+
+            return -1;
+        }
+
+        dmabuf_fds[i] = expbuf.fd;
+    }
+
+    return 0;
+}
+
+static void select_share_method(void)
+{
+    static const char *names[] = {
+        [SHARE_NONE] = "copy",
+        [SHARE_DMABUF] = "dmabuf",
+        [SHARE_FUSED] = "fused conversion",
+    };
+
+    if (io != IO_METHOD_MMAP || translen != 1)
+    {
+        fprintf(stderr, "--dmabuf needs mmap i/o and a transaction length "
+                "of 1, copying frames\n");
+        return;
+    }
+
+    if (capture_pixfmt == V4L2_PIX_FMT_RGB565X)
+    {
+        /* The emulator has no dmabuf import */
+        if (!emulate && 0 == export_buffers())
+            share = SHARE_DMABUF;
+    }
+    else
+    {
+        share = SHARE_FUSED;
+    }
+
+    fprintf(stderr, "Passing frames to %s by %s\n", mem2mem_dev_name,
+            names[share]);
+}
+
 static void close_device(void)
 {
     if (-1 == close(fd))
@@ -850,14 +995,14 @@ static void init_mem2mem_dev()
     struct v4l2_format fmt;
     struct v4l2_control ctrl;
 
-    mem2mem_fd = open(mem2mem_dev_name, O_RDWR | O_NONBLOCK, 0);
+    mem2mem_fd = m2m_open(mem2mem_dev_name, O_RDWR | O_NONBLOCK, emulate);
     perror_exit(mem2mem_fd < 0, "open");
 
     if (hflip != 0)
     {
         ctrl.id = V4L2_CID_HFLIP;
         ctrl.value = 1;
-        ret = ioctl(mem2mem_fd, VIDIOC_S_CTRL, &ctrl);
+        ret = m2m_ioctl(mem2mem_fd, VIDIOC_S_CTRL, &ctrl);
         if (ret != 0)
             fprintf(stderr, "%s:%d: Set HFLIP failed\n",
                     __func__, __LINE__);
@@ -867,7 +1012,7 @@ static void init_mem2mem_dev()
     {
         ctrl.id = V4L2_CID_VFLIP;
         ctrl.value = 1;
-        ret = ioctl(mem2mem_fd, VIDIOC_S_CTRL, &ctrl);
+        ret = m2m_ioctl(mem2mem_fd, VIDIOC_S_CTRL, &ctrl);
         if (ret != 0)
             fprintf(stderr, "%s:%d: Set VFLIP failed\n",
                     __func__, __LINE__);
@@ -875,15 +1020,25 @@ static void init_mem2mem_dev()
 
     ctrl.id = V4L2_CID_TRANS_TIME_MSEC;
     ctrl.value = transtime;
-    ret = ioctl(mem2mem_fd, VIDIOC_S_CTRL, &ctrl);
+    ret = m2m_ioctl(mem2mem_fd, VIDIOC_S_CTRL, &ctrl);
+    if (ret != 0)
+    {
+        ctrl.id = VIM2M_CID_TRANS_TIME_MSEC;
+        ret = m2m_ioctl(mem2mem_fd, VIDIOC_S_CTRL, &ctrl);
+    }
     perror_exit(ret != 0, "ioctl");
 
     ctrl.id = V4L2_CID_TRANS_NUM_BUFS;
     ctrl.value = translen;
-    ret = ioctl(mem2mem_fd, VIDIOC_S_CTRL, &ctrl);
+    ret = m2m_ioctl(mem2mem_fd, VIDIOC_S_CTRL, &ctrl);
+    if (ret != 0)
+    {
+        ctrl.id = VIM2M_CID_TRANS_NUM_BUFS;
+        ret = m2m_ioctl(mem2mem_fd, VIDIOC_S_CTRL, &ctrl);
+    }
     perror_exit(ret != 0, "ioctl");
 
-    ret = ioctl(mem2mem_fd, VIDIOC_QUERYCAP, &cap);
+    ret = m2m_ioctl(mem2mem_fd, VIDIOC_QUERYCAP, &cap);
     perror_exit(ret != 0, "ioctl");
 
     if (!(cap.capabilities & V4L2_CAP_VIDEO_CAPTURE))
@@ -904,7 +1059,7 @@ static void init_mem2mem_dev()
     fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_RGB565X;
     fmt.fmt.pix.field = V4L2_FIELD_ANY;
 
-    ret = ioctl(mem2mem_fd, VIDIOC_S_FMT, &fmt);
+    ret = m2m_ioctl(mem2mem_fd, VIDIOC_S_FMT, &fmt);
     perror_exit(ret != 0, "ioctl");
 
     /* The same format for output */
@@ -914,36 +1069,35 @@ static void init_mem2mem_dev()
     fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_RGB565X;
     fmt.fmt.pix.field = V4L2_FIELD_ANY;
 
-    ret = ioctl(mem2mem_fd, VIDIOC_S_FMT, &fmt);
+    ret = m2m_ioctl(mem2mem_fd, VIDIOC_S_FMT, &fmt);
     perror_exit(ret != 0, "ioctl");
 }
 
 static void gen_buf(uint8_t * dst, uint8_t * src, size_t size)
 {
-    size_t i;
-    uint16_t tmp;
-    uint16_t *dst_buf = (uint16_t *) dst;
-    uint16_t *src_buf = (uint16_t *) src;
-
-    size /= 2;
-
-    for (i = 0; i < size; i++)
-    {
-        tmp = src_buf[i];
+    /* 
+     * V4L2_PIX_FMT_RGB565X stores most significant Green bits in
+     * byte 0. Since SDL displays otherwise, swap those here.
+     */
+    if (dst == src)
+        rgb565x_swap_green_inplace((uint16_t *) dst, size / 2);
+    else
+        rgb565x_swap_green_row((uint16_t *) dst, (const uint16_t *)src,
+                               size / 2);
+}
 
-        /* 
-         * V4L2_PIX_FMT_RGB565X stores most significant Green bits in
-         * byte 0. Since SDL displays otherwise, swap those here.
-         */
-        dst_buf[i] = ((tmp & 0xE000) >> 13) | ((tmp & 0x0007) << 13) |
-            (tmp & 0x1FF8);
-    }
+/* gen_buf() into a mmap'd source buffer, which only the device reads */
+static void gen_device_buf(uint8_t * dst, uint8_t * src, size_t size)
+{
+    rgb565x_swap_green_row_nt((uint16_t *) dst, (const uint16_t *)src,
+                              size / 2);
 }
 
 
 static int read_mem2mem_frame(int last)
 {
     struct v4l2_buffer buf;
+    uint64_t render_start;
     int ret;
 
     memzero(buf);
@@ -951,7 +1105,7 @@ static int read_mem2mem_frame(int last)
     buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
     buf.memory = V4L2_MEMORY_MMAP;
 
-    ret = ioctl(mem2mem_fd, VIDIOC_DQBUF, &buf);
+    ret = m2m_ioctl(mem2mem_fd, VIDIOC_DQBUF, &buf);
     debug("Dequeued source buffer, index: %d\n", buf.index);
     if (ret)
     {
@@ -977,15 +1131,26 @@ static int read_mem2mem_frame(int last)
     /* Enqueue back the buffer (note that the index is preserved) */
     if (!last)
     {
-        uint8_t *p_buf = (uint8_t *) buffer_sdl;
-        p_buf += curr_buf * transsize;
+        if (share == SHARE_FUSED)
+        {
+            /* Next frame is converted straight into this buffer */
+            fused_dst = (uint16_t *) p_src_buf[buf.index];
+            read_input_frame();
+            fused_dst = NULL;
+        }
+        else
+        {
+            uint8_t *p_buf = (uint8_t *) buffer_sdl;
+            p_buf += curr_buf * transsize;
 
-        gen_buf((uint8_t *) p_src_buf[buf.index], p_buf, transsize);
+            gen_device_buf((uint8_t *) p_src_buf[buf.index], p_buf, transsize);
+        }
 
 
         buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
         buf.memory = V4L2_MEMORY_MMAP;
-        ret = ioctl(mem2mem_fd, VIDIOC_QBUF, &buf);
+        m2m_stamp(&buf);
+        ret = m2m_ioctl(mem2mem_fd, VIDIOC_QBUF, &buf);
         perror_ret(ret != 0, "ioctl");
     }
 
@@ -993,7 +1158,7 @@ static int read_mem2mem_frame(int last)
     buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 
     debug("Dequeuing destination buffer\n");
-    ret = ioctl(mem2mem_fd, VIDIOC_DQBUF, &buf);
+    ret = m2m_ioctl(mem2mem_fd, VIDIOC_DQBUF, &buf);
     if (ret)
     {
         switch (errno)
@@ -1015,6 +1180,8 @@ static int read_mem2mem_frame(int last)
     /* Verify we've got a correct buffer */
     assert(buf.index < num_dst_bufs);
 
+    m2m_dequeued(&buf);
+
     debug("Current buffer in the transaction: %d\n", curr_buf);
 
     uint8_t *p_post = (uint8_t *) buffer_m2m_sdl;
@@ -1023,19 +1190,24 @@ static int read_mem2mem_frame(int last)
     if (curr_buf >= translen)
     {
         curr_buf = 0;
-        read_input_frame();
+
+        if (share != SHARE_FUSED)
+            read_input_frame();
     }
 
     /* Display results */
+    render_start = latency_now();
+
     gen_buf(p_post, (uint8_t *) p_dst_buf[buf.index], transsize);
 
     render(data_sf, data_m2m_sf);
+    stage_record(STAGE_RENDER, render_start, latency_now());
 
     /* Enqueue back the buffer */
     if (!last)
     {
         // gen_dst_buf(p_dst_buf[buf.index], dst_buf_size[buf.index]);
-        ret = ioctl(mem2mem_fd, VIDIOC_QBUF, &buf);
+        ret = m2m_ioctl(mem2mem_fd, VIDIOC_QBUF, &buf);
         perror_ret(ret != 0, "ioctl");
         debug("Enqueued back dst buffer\n");
     }
@@ -1043,6 +1215,205 @@ static int read_mem2mem_frame(int last)
     return 0;
 }
 
+/*
+ * Capture buffers are queued on the mem2mem OUTPUT side directly, and go
+ * back to the capture device only once the mem2mem device is done with them.
+ */
+static int dmabuf_capture_frame(void)
+{
+    struct v4l2_buffer buf;
+    int ret;
+
+    CLEAR(buf);
+
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = V4L2_MEMORY_MMAP;
+
+    if (-1 == xioctl(fd, VIDIOC_DQBUF, &buf))
+    {
+        if (EAGAIN == errno)
+            return 0;
+
+        errno_exit("VIDIOC_DQBUF");
+    }
+
+    assert(buf.index < n_buffers);
+
+    capture_dequeued(&buf);
+
+    process_image(buffers[buf.index].start);
+
+    buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+    buf.memory = V4L2_MEMORY_DMABUF;
+    buf.m.fd = dmabuf_fds[buf.index];
+    buf.length = buffers[buf.index].length;
+    buf.bytesused = WIDTH * HEIGHT * 2;
+    m2m_stamp(&buf);
+
+    ret = m2m_ioctl(mem2mem_fd, VIDIOC_QBUF, &buf);
+    if (ret)
+        return -1;
+
+    debug("Queued capture buffer %d as mem2mem source\n", buf.index);
+
+    return 1;
+}
+
+static int dmabuf_release_source(void)
+{
+    struct v4l2_buffer buf;
+    int ret;
+
+    memzero(buf);
+
+    buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+    buf.memory = V4L2_MEMORY_DMABUF;
+
+    ret = m2m_ioctl(mem2mem_fd, VIDIOC_DQBUF, &buf);
+    if (ret)
+        return errno == EAGAIN ? 0 : -1;
+
+    assert(buf.index < n_buffers);
+
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = V4L2_MEMORY_MMAP;
+
+    if (-1 == xioctl(fd, VIDIOC_QBUF, &buf))
+        errno_exit("VIDIOC_QBUF");
+
+    return 1;
+}
+
+static int dmabuf_read_result(int last)
+{
+    struct v4l2_buffer buf;
+    uint64_t render_start;
+    int ret;
+
+    memzero(buf);
+
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = V4L2_MEMORY_MMAP;
+
+    ret = m2m_ioctl(mem2mem_fd, VIDIOC_DQBUF, &buf);
+    if (ret)
+        return errno == EAGAIN ? 0 : -1;
+
+    assert(buf.index < num_dst_bufs);
+
+    m2m_dequeued(&buf);
+
+    render_start = latency_now();
+
+    gen_buf((uint8_t *) buffer_m2m_sdl, (uint8_t *) p_dst_buf[buf.index],
+            transsize);
+
+    render(data_sf, data_m2m_sf);
+    stage_record(STAGE_RENDER, render_start, latency_now());
+
+    if (!last)
+    {
+        ret = m2m_ioctl(mem2mem_fd, VIDIOC_QBUF, &buf);
+        if (ret)
+            return -1;
+    }
+
+    return 1;
+}
+
+static void poll_sdl(void)
+{
+    SDL_Event event;
+
+    while (SDL_PollEvent(&event))
+        if (event.type == SDL_QUIT)
+            reactor_quit(&loop);
+}
+
+static void on_signal(void *arg, uint32_t signo)
+{
+    reactor_quit(&loop);
+}
+
+static void on_stats(void *arg, uint32_t expirations)
+{
+    print_latency(1);
+}
+
+static void frame_done(void)
+{
+    --num_frames;
+    printf("FRAMES LEFT: %d\n", num_frames);
+
+    if (!num_frames)
+        reactor_quit(&loop);
+}
+
+/* Both fds are edge triggered, each callback drains what is ready */
+static void on_dmabuf_capture(void *arg, uint32_t events)
+{
+    int r;
+
+    while ((r = dmabuf_capture_frame()) > 0)
+        ;
+
+    if (r < 0)
+    {
+        fprintf(stderr, "Queueing captured frame failed\n");
+        reactor_quit(&loop);
+    }
+}
+
+static void on_dmabuf_m2m(void *arg, uint32_t events)
+{
+    int r = 0;
+
+    if (events & EPOLLOUT)
+        while ((r = dmabuf_release_source()) > 0)
+            ;
+
+    if (r < 0)
+    {
+        fprintf(stderr, "Releasing source buffer failed\n");
+        reactor_quit(&loop);
+        return;
+    }
+
+    if (events & EPOLLIN)
+        while (num_frames && (r = dmabuf_read_result(num_frames == 1)) > 0)
+            frame_done();
+
+    if (r < 0)
+    {
+        fprintf(stderr, "Read frame failed\n");
+        reactor_quit(&loop);
+    }
+}
+
+static void on_m2m(void *arg, uint32_t events)
+{
+    if (read_mem2mem_frame(num_frames == 1))
+    {
+        fprintf(stderr, "Read frame failed\n");
+        reactor_quit(&loop);
+        return;
+    }
+
+    frame_done();
+}
+
+static void run_loop(void)
+{
+    while (num_frames && reactor_running(&loop))
+    {
+        poll_sdl();
+
+        /* Wake up now and then to keep handling SDL events */
+        if (-1 == reactor_run(&loop, 100))
+            errno_exit("epoll_wait");
+    }
+}
+
 static void start_mem2mem()
 {
     int ret;
@@ -1050,25 +1421,38 @@ static void start_mem2mem()
     struct v4l2_buffer buf;
     struct v4l2_requestbuffers reqbuf;
     enum v4l2_buf_type type;
-    int last = 0;
-    SDL_Event event;
 
     init_mem2mem_dev();
 
     memzero(reqbuf);
-    reqbuf.count = NUM_BUFS;
     reqbuf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
     type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
-    reqbuf.memory = V4L2_MEMORY_MMAP;
-    ret = ioctl(mem2mem_fd, VIDIOC_REQBUFS, &reqbuf);
+
+    if (share == SHARE_DMABUF)
+    {
+        /* One slot per capture buffer, they are imported on QBUF */
+        reqbuf.count = n_buffers;
+        reqbuf.memory = V4L2_MEMORY_DMABUF;
+    }
+    else
+    {
+        reqbuf.count = num_m2m_buffers;
+        reqbuf.memory = V4L2_MEMORY_MMAP;
+    }
+
+    ret = m2m_ioctl(mem2mem_fd, VIDIOC_REQBUFS, &reqbuf);
     perror_exit(ret != 0, "ioctl");
     num_src_bufs = reqbuf.count;
     debug("Got %d src buffers\n", num_src_bufs);
 
-    reqbuf.count = NUM_BUFS;
+    if (share == SHARE_DMABUF)
+        num_src_bufs = 0;   /* nothing to map */
+
+    reqbuf.count = num_m2m_buffers;
     reqbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    reqbuf.memory = V4L2_MEMORY_MMAP;
     type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    ret = ioctl(mem2mem_fd, VIDIOC_REQBUFS, &reqbuf);
+    ret = m2m_ioctl(mem2mem_fd, VIDIOC_REQBUFS, &reqbuf);
     perror_exit(ret != 0, "ioctl");
     num_dst_bufs = reqbuf.count;
     debug("Got %d dst buffers\n", num_dst_bufs);
@@ -1081,14 +1465,14 @@ static void start_mem2mem()
         buf.memory = V4L2_MEMORY_MMAP;
         buf.index = i;
 
-        ret = ioctl(mem2mem_fd, VIDIOC_QUERYBUF, &buf);
+        ret = m2m_ioctl(mem2mem_fd, VIDIOC_QUERYBUF, &buf);
         perror_exit(ret != 0, "ioctl");
         debug("QUERYBUF returned offset: %x\n", buf.m.offset);
 
         src_buf_size[i] = buf.length;
-        p_src_buf[i] = mmap(NULL, buf.length,
-                            PROT_READ | PROT_WRITE, MAP_SHARED,
-                            mem2mem_fd, buf.m.offset);
+        p_src_buf[i] = m2m_mmap(NULL, buf.length,
+                                PROT_READ | PROT_WRITE, MAP_SHARED,
+                                mem2mem_fd, buf.m.offset);
         perror_exit(MAP_FAILED == p_src_buf[i], "mmap");
     }
 
@@ -1098,32 +1482,44 @@ static void start_mem2mem()
         buf.memory = V4L2_MEMORY_MMAP;
         buf.index = i;
 
-        ret = ioctl(mem2mem_fd, VIDIOC_QUERYBUF, &buf);
+        ret = m2m_ioctl(mem2mem_fd, VIDIOC_QUERYBUF, &buf);
         perror_exit(ret != 0, "ioctl");
         debug("QUERYBUF returned offset: %x\n", buf.m.offset);
 
         dst_buf_size[i] = buf.length;
-        p_dst_buf[i] = mmap(NULL, buf.length,
-                            PROT_READ | PROT_WRITE, MAP_SHARED,
-                            mem2mem_fd, buf.m.offset);
+        p_dst_buf[i] = m2m_mmap(NULL, buf.length,
+                                PROT_READ | PROT_WRITE, MAP_SHARED,
+                                mem2mem_fd, buf.m.offset);
         perror_exit(MAP_FAILED == p_dst_buf[i], "mmap");
     }
 
-    read_input_frame();
+    if (share != SHARE_FUSED && share != SHARE_DMABUF)
+        read_input_frame();
+
     for (i = 0; i < num_src_bufs; ++i)
     {
-        uint8_t *p_buf = (uint8_t *) buffer_sdl;
-        p_buf += (i % translen) * transsize;
+        if (share == SHARE_FUSED)
+        {
+            fused_dst = (uint16_t *) p_src_buf[i];
+            read_input_frame();
+            fused_dst = NULL;
+        }
+        else
+        {
+            uint8_t *p_buf = (uint8_t *) buffer_sdl;
+            p_buf += (i % translen) * transsize;
 
-        gen_buf((uint8_t *) p_src_buf[i], p_buf, transsize);
+            gen_device_buf((uint8_t *) p_src_buf[i], p_buf, transsize);
+        }
 
 
         memzero(buf);
         buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
         buf.memory = V4L2_MEMORY_MMAP;
         buf.index = i;
+        m2m_stamp(&buf);
 
-        ret = ioctl(mem2mem_fd, VIDIOC_QBUF, &buf);
+        ret = m2m_ioctl(mem2mem_fd, VIDIOC_QBUF, &buf);
         perror_exit(ret != 0, "ioctl");
     }
 
@@ -1134,51 +1530,50 @@ static void start_mem2mem()
         buf.memory = V4L2_MEMORY_MMAP;
         buf.index = i;
 
-        ret = ioctl(mem2mem_fd, VIDIOC_QBUF, &buf);
+        ret = m2m_ioctl(mem2mem_fd, VIDIOC_QBUF, &buf);
         perror_exit(ret != 0, "ioctl");
     }
 
     type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
-    ret = ioctl(mem2mem_fd, VIDIOC_STREAMON, &type);
+    ret = m2m_ioctl(mem2mem_fd, VIDIOC_STREAMON, &type);
     debug("STREAMON (%ld): %d\n", VIDIOC_STREAMON, ret);
     perror_exit(ret != 0, "ioctl");
 
     type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    ret = ioctl(mem2mem_fd, VIDIOC_STREAMON, &type);
+    ret = m2m_ioctl(mem2mem_fd, VIDIOC_STREAMON, &type);
     debug("STREAMON (%ld): %d\n", VIDIOC_STREAMON, ret);
     perror_exit(ret != 0, "ioctl");
 
-    while (num_frames)
+    if (share == SHARE_DMABUF)
     {
-        fd_set read_fds;
-        int r;
+        ret = reactor_add(&loop, &capture_source, fd, EPOLLIN | EPOLLET,
+                          on_dmabuf_capture, NULL);
+        perror_exit(ret != 0, "epoll_ctl");
 
+        ret = reactor_add(&loop, &m2m_source, mem2mem_fd,
+                          EPOLLIN | EPOLLOUT | EPOLLET, on_dmabuf_m2m, NULL);
+        perror_exit(ret != 0, "epoll_ctl");
 
-        while (SDL_PollEvent(&event))
-            if (event.type == SDL_QUIT)
-                return;
+        run_loop();
 
+        reactor_del(&loop, &capture_source);
+    }
+    else
+    {
+        /*
+         * Level triggered: each result waits for the next captured frame
+         * in read_input_frame(), so one frame is handled per wakeup.
+         */
+        ret = reactor_add(&loop, &m2m_source, mem2mem_fd, EPOLLIN,
+                          on_m2m, NULL);
+        perror_exit(ret != 0, "epoll_ctl");
 
-        FD_ZERO(&read_fds);
-        FD_SET(mem2mem_fd, &read_fds);
-
-        debug("Before select");
-        r = select(mem2mem_fd + 1, &read_fds, NULL, NULL, 0);
-        perror_exit(r < 0, "select");
-        debug("After select");
-
-        if (num_frames == 1)
-            last = 1;
-        if (read_mem2mem_frame(last))
-        {
-            fprintf(stderr, "Read frame failed\n");
-            break;
-        }
-        --num_frames;
-        printf("FRAMES LEFT: %d\n", num_frames);
+        run_loop();
     }
 
-    close(mem2mem_fd);
+    reactor_del(&loop, &m2m_source);
+
+    m2m_close(mem2mem_fd);
 
     for (i = 0; i < num_src_bufs; ++i)
         munmap(p_src_buf[i], src_buf_size[i]);
@@ -1194,7 +1589,11 @@ static void usage(FILE * fp, int argc, char **argv)
             "Options:\n"
             "-i | --input-device name   Video device name [/dev/video0]\n"
             "-o | --m2m-device name     mem2mem device name [/dev/video1]\n"
+            "-b | --buffers num         Number of capture buffers [4]\n"
+            "-B | --m2m-buffers num     Number of mem2mem buffers per queue "
+            "[4]\n"
             "-h | --help                Print this message\n"
+            "-j | --threads num         Conversion threads [number of CPUs]\n"
             "-m | --mmap                Use memory mapped buffers\n"
             "-r | --read                Use read() calls\n"
             "-u | --userp               Use application allocated buffers\n"
@@ -1205,15 +1604,23 @@ static void usage(FILE * fp, int argc, char **argv)
             "-n | --num-frames          Number of frames to process [1000]\n"
             "-f | --hflip               Horizontal Mirror\n"
             "-v | --flip                Vertical Mirror\n"
+            "-D | --dmabuf              Share frames with mem2mem device\n"
+            "-E | --emulate[=threads]   Emulate mem2mem_testdev in process "
+            "instead of\n"
+            "                           opening --m2m-device [1 thread]\n"
+            "-s | --stats sec           Print latencies every sec seconds\n"
             "", argv[0]);
 }
 
-static const char short_options[] = "d:o:hmrux:y:t:T:n:fv";
+static const char short_options[] = "d:o:b:B:hj:mrux:y:t:T:n:fvDE::s:";
 
 static const struct option long_options[] = {
     {"input-device", required_argument, NULL, 'd'},
     {"m2m-device", required_argument, NULL, 'o'},
+    {"buffers", required_argument, NULL, 'b'},
+    {"m2m-buffers", required_argument, NULL, 'B'},
     {"help", no_argument, NULL, 'h'},
+    {"threads", required_argument, NULL, 'j'},
     {"mmap", no_argument, NULL, 'm'},
     {"read", no_argument, NULL, 'r'},
     {"userp", no_argument, NULL, 'u'},
@@ -1224,6 +1631,9 @@ static const struct option long_options[] = {
     {"num-frames", required_argument, NULL, 'n'},
     {"hflip", no_argument, NULL, 'f'},
     {"vflip", no_argument, NULL, 'v'},
+    {"dmabuf", no_argument, NULL, 'D'},
+    {"emulate", optional_argument, NULL, 'E'},
+    {"stats", required_argument, NULL, 's'},
     {0, 0, 0, 0}
 };
 
@@ -1234,6 +1644,8 @@ static int sdl_filter(const SDL_Event * event)
 
 int main(int argc, char **argv)
 {
+    sigset_t signals;
+
     dev_name = "/dev/video0";
     mem2mem_dev_name = "/dev/video1";
 
@@ -1260,10 +1672,36 @@ int main(int argc, char **argv)
             mem2mem_dev_name = optarg;
             break;
 
+        case 'b':
+            num_buffers = atoi(optarg);
+
+            if (num_buffers < 2 || num_buffers > MAX_BUFS)
+            {
+                fprintf(stderr, "Buffer count must be between 2 and %d\n",
+                        MAX_BUFS);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'B':
+            num_m2m_buffers = atoi(optarg);
+
+            if (num_m2m_buffers < 1 || num_m2m_buffers > MAX_BUFS)
+            {
+                fprintf(stderr, "mem2mem buffer count must be between 1 "
+                        "and %d\n", MAX_BUFS);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
         case 'h':
             usage(stdout, argc, argv);
             exit(EXIT_SUCCESS);
 
+        case 'j':
+            num_threads = atoi(optarg);
+            break;
+
         case 'm':
             io = IO_METHOD_MMAP;
             break;
@@ -1304,25 +1742,63 @@ int main(int argc, char **argv)
             vflip = 1;
             break;
 
+        case 'D':
+            want_dmabuf = 1;
+            break;
+
+        case 'E':
+            emulate = optarg ? atoi(optarg) : 1;
+
+            if (emulate < 1)
+            {
+                fprintf(stderr, "The emulator needs at least one thread\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 's':
+            stats_interval = atoi(optarg);
+            break;
+
         default:
             usage(stderr, argc, argv);
             exit(EXIT_FAILURE);
         }
     }
 
-    generate_YCbCr_to_RGB_lookup();
+    /* Before any thread starts, so that all of them block the signals */
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+
+    if (reactor_init(&loop) || reactor_init(&capture_loop) ||
+        reactor_add_signals(&loop, &signal_source, &signals, on_signal, NULL))
+        errno_exit("reactor");
+
+    convert_init();
+    workers_init(num_threads);
 
     open_device();
     init_device();
 
+    if (reactor_add(&capture_loop, &capture_wait_source, fd,
+                    EPOLLIN | EPOLLET, on_capture_wait, NULL))
+        errno_exit("epoll_ctl");
+
+    if (emulate)
+        mem2mem_dev_name = "emulated mem2mem_testdev";
+
+    if (want_dmabuf)
+        select_share_method();
+
     atexit(SDL_Quit);
     if (SDL_Init(SDL_INIT_VIDEO) < 0)
         return 1;
 
     SDL_WM_SetCaption("SDL mem2mem tester", NULL);
 
-    buffer_sdl = (uint16_t *) malloc(WIDTH * HEIGHT * 2);
-    buffer_m2m_sdl = (uint16_t *) malloc(WIDTH * HEIGHT * 2);
+    buffer_sdl = arena_alloc(WIDTH * HEIGHT * 2);
+    buffer_m2m_sdl = arena_alloc(WIDTH * HEIGHT * 2);
 
     SDL_SetVideoMode(WIDTH, HEIGHT * 2 + SEPARATOR, 16, SDL_HWSURFACE);
 
@@ -1336,17 +1812,35 @@ int main(int argc, char **argv)
 
     SDL_SetEventFilter(sdl_filter);
 
+    if (stats_interval &&
+        reactor_add_timer(&loop, &stats_source, stats_interval * 1000,
+                          on_stats, NULL))
+        errno_exit("timerfd");
+
     start_capturing();
     start_mem2mem();
     stop_capturing();
 
+    if (stats_interval)
+        reactor_del(&loop, &stats_source);
+
+    print_latency(0);
+
+    reactor_del(&capture_loop, &capture_wait_source);
+
     uninit_device();
     close_device();
 
+    workers_exit();
+
+    reactor_del(&loop, &signal_source);
+    reactor_free(&capture_loop);
+    reactor_free(&loop);
+
     SDL_FreeSurface(data_sf);
     SDL_FreeSurface(data_m2m_sf);
-    free(buffer_sdl);
-    free(buffer_m2m_sdl);
+    arena_free(buffer_sdl);
+    arena_free(buffer_m2m_sdl);
 
     exit(EXIT_SUCCESS);
 
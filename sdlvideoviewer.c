@@ -2,7 +2,9 @@
  * Copyright (C) 2012 by Tomasz Moń <desowin@gmail.com>
  *
  * compile with:
- *   gcc -o sdlvideoviewer sdlvideoviewer.c -lSDL
+ *   gcc -pthread -o sdlvideoviewer sdlvideoviewer.c arena.c bufq.c convert.c \
+ *       dirty.c latency.c mjpeg.c reactor.c record.c replay.c workers.c \
+ *       -lSDL -ljpeg
  *
  * Based on V4L2 video capture example
  *
@@ -25,6 +27,8 @@
  * in this Software without prior written authorization of the copyright holder.
  */
 
+#define _GNU_SOURCE
+
 #include <SDL/SDL.h>
 #include <assert.h>
 #include <stdint.h>
@@ -42,9 +46,13 @@
 #include <unistd.h>
 #include <errno.h>
 #include <malloc.h>
+#include <poll.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <sys/resource.h>
+#include <time.h>
 #include <sys/mman.h>
 #include <sys/ioctl.h>
 
@@ -52,36 +60,181 @@
 
 #include <linux/videodev2.h>
 
+#include "arena.h"
+#include "bufq.h"
+#include "convert.h"
+#include "dirty.h"
+#include "latency.h"
+#include "mjpeg.h"
+#include "reactor.h"
+#include "record.h"
+#include "replay.h"
+#include "ring.h"
+#include "workers.h"
+
 #define CLEAR(x) memset (&(x), 0, sizeof (x))
 
 #define max(a, b) (a > b ? a : b)
 #define min(a, b) (a > b ? b : a)
 
+#define mask32(BYTE) (*(uint32_t *)(uint8_t [4]){ [BYTE] = 0xff })
+
 typedef enum
 {
     IO_METHOD_READ,
     IO_METHOD_MMAP,
     IO_METHOD_USERPTR,
+    IO_METHOD_REPLAY,           /* --record files instead of devices */
 } io_method;
 
+/* Multi-planar buffers have one mapping per plane, others only start[0] */
 struct buffer
 {
-    void *start;
-    size_t length;
+    void *start[VIDEO_MAX_PLANES];
+    size_t length[VIDEO_MAX_PLANES];
+};
+
+/* Upper limit for the adaptive queue, buffers[] is allocated this large */
+#define MAX_BUFFERS 32
+
+#define MAX_DEVICES 16
+
+/* Downscaling halves the image up to this many times */
+#define MAX_SCALE 3
+
+/* Points in the life of a frame, CLOCK_MONOTONIC ns, 0 if not taken */
+struct frame_times
+{
+    uint64_t driver;            /* v4l2_buffer.timestamp */
+    uint64_t dequeued;          /* VIDIOC_DQBUF returned */
+    uint64_t converted;         /* process_image() done converting */
+    uint64_t rendered;          /* render() returned */
+    uint64_t queued;            /* VIDIOC_QBUF returned */
+};
+
+enum stage
+{
+    STAGE_WAIT,                 /* driver to DQBUF */
+    STAGE_CONVERT,              /* DQBUF to converted */
+    STAGE_RENDER,               /* converted to on screen */
+    STAGE_REQUEUE,              /* to QBUF */
+    STAGE_TOTAL,                /* driver (or DQBUF) to on screen */
+    N_STAGES
+};
+
+static const char *const stage_names[N_STAGES] = {
+    [STAGE_WAIT] = "driver to DQBUF",
+    [STAGE_CONVERT] = "conversion",
+    [STAGE_RENDER] = "render",
+    [STAGE_REQUEUE] = "to QBUF",
+    [STAGE_TOTAL] = "end to end",
+};
+
+struct device
+{
+    char *name;
+    int fd;
+    struct buffer *buffers;
+    unsigned int n_buffers;
+
+    /* Negotiated by VIDIOC_S_FMT, may differ from WIDTH x HEIGHT */
+    size_t width;
+    size_t height;
+    size_t bytesperline;
+    size_t sizeimage;
+    uint32_t pixelformat;
+    size_t chroma_bytesperline; /* 4:2:0, per row of each chroma plane */
+
+    /* Single or multi-planar queue, n_planes is 1 for the former */
+    enum v4l2_buf_type buf_type;
+    unsigned int n_planes;
+
+    /* IO_METHOD_REPLAY, fd is the replay timerfd */
+    struct replay replay;
+
+    /* Adaptive queue depth */
+    struct bufq queue_depth;
+    unsigned int n_active;
+    unsigned int parked[MAX_BUFFERS];
+    unsigned int n_parked;
+
+    /* Composite display, when capturing from several devices */
+    pthread_t thread;
+    unsigned int scale;         /* image is halved this many times */
+    uint8_t *tile;              /* top left pixel of the tile */
+    uint8_t *scale_rows[MAX_SCALE + 1][2];  /* by level, 0 for 4:2:0 only */
+
+    /* Throughput, counted on DQBUF */
+    unsigned long frames_captured;
+    unsigned long frames_dropped;   /* gaps in v4l2_buffer.sequence */
+    unsigned long frames_skipped;   /* stale, see latest_only */
+    uint32_t last_sequence;
+
+    /* Frame in flight and per stage histograms, whole run and interval */
+    struct frame_times times;
+    struct latency latency[N_STAGES];
+    struct latency latency_interval[N_STAGES];
 };
 
-static char *dev_name = NULL;
+static struct device devices[MAX_DEVICES];
+static unsigned int n_devices = 0;
+
 static io_method io = IO_METHOD_MMAP;
-static int fd = -1;
-struct buffer *buffers = NULL;
-static unsigned int n_buffers = 0;
+static unsigned int num_buffers = 4;
+
+static unsigned int num_threads = 0;
+static int pipelined = 0;
 
 static size_t WIDTH = 640;
 static size_t HEIGHT = 480;
 
+/* Asked for with VIDIOC_S_FMT, the driver may pick another of formats[] */
+static uint32_t pixelformat = V4L2_PIX_FMT_YUYV;
+
+static const struct
+{
+    const char *name;
+    uint32_t pixelformat;
+    unsigned int n_planes;
+} formats[] = {
+    {"yuyv", V4L2_PIX_FMT_YUYV, 1},
+    {"nv12", V4L2_PIX_FMT_NV12, 1},
+    {"nv21", V4L2_PIX_FMT_NV21, 1},
+    {"yu12", V4L2_PIX_FMT_YUV420, 1},
+    {"mjpeg", V4L2_PIX_FMT_MJPEG, 1},
+    {"jpeg", V4L2_PIX_FMT_JPEG, 1},
+    {"nv12m", V4L2_PIX_FMT_NV12M, 2},
+    {"nv21m", V4L2_PIX_FMT_NV21M, 2},
+    {"yu12m", V4L2_PIX_FMT_YUV420M, 3},
+};
+
 static uint8_t *buffer_sdl;
 SDL_Surface *data_sf;
 
+/* YUY2 overlay display, SDL does the colorspace conversion */
+static int use_overlay = 0;
+static SDL_Overlay *overlay = NULL;
+
+static unsigned long frames_displayed = 0;
+static struct timespec display_start;
+static struct rusage usage_start;
+
+/* Capture and convert only, SDL is never initialized */
+static int headless = 0;
+
+/*
+ * Low latency: each wakeup drains every ready buffer and only the newest
+ * one is converted, the stale ones go straight back to the driver.
+ */
+static int latest_only = 0;
+
+/* Seconds between fps reports while running, 0 disables them */
+static unsigned int stats_interval = 0;
+
+static struct reactor loop;
+static struct reactor_source signal_source;
+static struct reactor_source stats_source;
+
 static void errno_exit(const char *s)
 {
     fprintf(stderr, "%s error %d, %s\n", s, errno, strerror(errno));
@@ -107,283 +260,1647 @@ static void render(SDL_Surface * sf)
     SDL_Surface *screen = SDL_GetVideoSurface();
     if (SDL_BlitSurface(sf, NULL, screen, NULL) == 0)
         SDL_UpdateRect(screen, 0, 0, 0, 0);
+
+    frames_displayed++;
 }
 
-void YCbCrToRGB(int y, int cb, int cr, uint8_t * r, uint8_t * g, uint8_t * b)
+/* stride is the pitch of the YUY2 source, bytesperline of the device */
+static void render_overlay(const void *p, size_t stride)
 {
-    double Y = (double)y;
-    double Cb = (double)cb;
-    double Cr = (double)cr;
+    const uint8_t *buffer_yuv = p;
+    SDL_Rect rect = {
+        .x = 0,.y = 0,
+        .w = WIDTH,.h = HEIGHT
+    };
+    size_t y;
+
+    if (SDL_LockYUVOverlay(overlay) < 0)
+        return;
+
+    if (overlay->pitches[0] == WIDTH * 2 && stride == WIDTH * 2)
+        memcpy(overlay->pixels[0], buffer_yuv, WIDTH * HEIGHT * 2);
+    else
+        for (y = 0; y < HEIGHT; y++)
+            memcpy(overlay->pixels[0] + y * overlay->pitches[0],
+                   buffer_yuv + y * stride, WIDTH * 2);
+
+    SDL_UnlockYUVOverlay(overlay);
 
-    int R = (int)(Y + 1.40200 * (Cr - 0x80));
-    int G = (int)(Y - 0.34414 * (Cb - 0x80) - 0.71414 * (Cr - 0x80));
-    int B = (int)(Y + 1.77200 * (Cb - 0x80));
+    SDL_DisplayYUVOverlay(overlay, &rect);
 
-    *r = max(0, min(255, R));
-    *g = max(0, min(255, G));
-    *b = max(0, min(255, B));
+    frames_displayed++;
 }
 
-/* 
- * YCbCr to RGB lookup table
- *
- * Indexes are [Y][Cb][Cr]
- * Y, Cb, Cr range is 0-255
- *
- * Stored value bits:
- *   24-16 Red
- *   15-8  Green
- *   7-0   Blue
- */
-uint32_t YCbCr_to_RGB[256][256][256];
+static double cpu_seconds(const struct rusage *ru)
+{
+    return ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1e6 +
+        ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1e6;
+}
 
-static void generate_YCbCr_to_RGB_lookup()
+/* Capture side numbers, also valid without a display */
+static void print_throughput(void)
 {
-    int y;
-    int cb;
-    int cr;
+    struct timespec now;
+    struct rusage usage;
+    unsigned long frames = 0;
+    double elapsed, cpu;
+    unsigned int i;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    getrusage(RUSAGE_SELF, &usage);
 
-    for (y = 0; y < 256; y++)
+    elapsed = (now.tv_sec - display_start.tv_sec) +
+        (now.tv_nsec - display_start.tv_nsec) / 1e9;
+    cpu = cpu_seconds(&usage) - cpu_seconds(&usage_start);
+
+    for (i = 0; i < n_devices; i++)
     {
-        for (cb = 0; cb < 256; cb++)
-        {
-            for (cr = 0; cr < 256; cr++)
-            {
-                double Y = (double)y;
-                double Cb = (double)cb;
-                double Cr = (double)cr;
+        const struct device *dev = &devices[i];
+        unsigned long captured = __atomic_load_n(&dev->frames_captured,
+                                                 __ATOMIC_RELAXED);
 
-                int R = (int)(Y+1.40200*(Cr - 0x80));
-                int G = (int)(Y-0.34414*(Cb - 0x80)-0.71414*(Cr - 0x80));
-                int B = (int)(Y+1.77200*(Cb - 0x80));
+        fprintf(stderr, "%s: %lu frames captured, %.2f fps, %lu dropped",
+                dev->name, captured, elapsed > 0 ? captured / elapsed : 0.0,
+                __atomic_load_n(&dev->frames_dropped, __ATOMIC_RELAXED));
 
-                R = max(0, min(255, R));
-                G = max(0, min(255, G));
-                B = max(0, min(255, B));
+        if (latest_only)
+            fprintf(stderr, ", %lu skipped as stale",
+                    __atomic_load_n(&dev->frames_skipped, __ATOMIC_RELAXED));
 
-                YCbCr_to_RGB[y][cb][cr] = R << 16 | G << 8 | B;
-            }
-        }
+        fprintf(stderr, "\n");
+
+        frames += captured;
     }
+
+    fprintf(stderr, "CPU %.2f s in %.2f s (%.0f%% of one core), %.3f ms "
+            "per frame\n", cpu, elapsed, elapsed > 0 ? cpu * 100 / elapsed :
+            0.0, frames ? cpu * 1000 / frames : 0.0);
 }
 
-#define COLOR_GET_RED(color)   ((color >> 16) & 0xFF)
-#define COLOR_GET_GREEN(color) ((color >> 8) & 0xFF)
-#define COLOR_GET_BLUE(color)  (color & 0xFF)
+static void print_fps(void)
+{
+    struct timespec now;
+    double elapsed;
 
-/**
- *  Converts YUV422 to RGB
- *  Before first use call generate_YCbCr_to_RGB_lookup();
- *
- *  input is pointer to YUV422 encoded data in following order: Y0, Cb, Y1, Cr.
- *  output is pointer to 24 bit RGB buffer.
- *  Output data is written in following order: R1, G1, B1, R2, G2, B2.
- */
-static void inline YUV422_to_RGB(uint8_t * output, const uint8_t * input)
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    elapsed = (now.tv_sec - display_start.tv_sec) +
+        (now.tv_nsec - display_start.tv_nsec) / 1e9;
+
+    fprintf(stderr, "%lu frames in %.2f s, %.2f fps (%s)\n",
+            frames_displayed, elapsed,
+            elapsed > 0 ? frames_displayed / elapsed : 0.0,
+            overlay ? (overlay->hw_overlay ? "YUY2 hw overlay" :
+                       "YUY2 sw overlay") : "RGB");
+}
+
+/* A captured frame, YUYV when u is NULL and 4:2:0 otherwise */
+struct image
+{
+    const uint8_t *y;
+    const uint8_t *u;
+    const uint8_t *v;
+    size_t chroma_step;         /* see yuv420_to_yuyv_row() */
+    size_t stride;
+    size_t chroma_stride;
+};
+
+static void image_init(const struct device *dev, struct image *img,
+                       void *const *planes)
+{
+    const uint8_t *chroma;
+
+    img->y = planes[0];
+    img->u = NULL;
+    img->v = NULL;
+    img->chroma_step = 2;
+    img->stride = dev->bytesperline;
+    img->chroma_stride = dev->chroma_bytesperline;
+
+    /* Contiguous formats put the chroma right below the luma */
+    chroma = dev->n_planes > 1 ? planes[1] :
+        img->y + dev->bytesperline * dev->height;
+
+    switch (dev->pixelformat)
+    {
+    case V4L2_PIX_FMT_NV12:
+    case V4L2_PIX_FMT_NV12M:
+        img->u = chroma;
+        img->v = chroma + 1;
+        break;
+
+    case V4L2_PIX_FMT_NV21:
+    case V4L2_PIX_FMT_NV21M:
+        img->v = chroma;
+        img->u = chroma + 1;
+        break;
+
+    case V4L2_PIX_FMT_YUV420:
+        img->u = chroma;
+        img->v = chroma + dev->chroma_bytesperline * (dev->height / 2);
+        img->chroma_step = 1;
+        break;
+
+    case V4L2_PIX_FMT_YUV420M:
+        img->u = chroma;
+        img->v = planes[2];
+        img->chroma_step = 1;
+        break;
+    }
+}
+
+/* Row y of img as YUYV, repacked into out unless it already is */
+static const uint8_t *image_row(const struct image *img, size_t y,
+                                size_t width, uint8_t * out)
 {
-    uint8_t y0 = input[0];
-    uint8_t cb = input[1];
-    uint8_t y1 = input[2];
-    uint8_t cr = input[3];
+    const uint8_t *luma = img->y + y * img->stride;
+    size_t chroma = y / 2 * img->chroma_stride;
 
-    uint32_t rgb = YCbCr_to_RGB[y0][cb][cr];
-    output[0] = COLOR_GET_RED(rgb);
-    output[1] = COLOR_GET_GREEN(rgb);
-    output[2] = COLOR_GET_BLUE(rgb);
+    if (!img->u)
+        return luma;
 
-    rgb = YCbCr_to_RGB[y1][cb][cr];
-    output[3] = COLOR_GET_RED(rgb);
-    output[4] = COLOR_GET_GREEN(rgb);
-    output[5] = COLOR_GET_BLUE(rgb);
+    yuv420_to_yuyv_row(out, luma, img->u + chroma, img->v + chroma,
+                       img->chroma_step, width);
+
+    return out;
 }
 
-static void process_image(const void *p)
+struct convert_job
 {
-    const uint8_t *buffer_yuv = p;
+    const struct image *src;
+    uint8_t *dst;
+};
+
+static void convert_stripe(void *arg, size_t first, size_t last)
+{
+    const struct convert_job *job = arg;
+    const struct image *img = job->src;
 
-    size_t x;
     size_t y;
 
-    for (y = 0; y < HEIGHT; y++)
-        for (x = 0; x < WIDTH; x += 2)
-            YUV422_to_RGB(buffer_sdl + (y * WIDTH + x) * 3,
-                          buffer_yuv + (y * WIDTH + x) * 2);
+    for (y = first; y < last; y++)
+    {
+        const uint8_t *luma = img->y + y * img->stride;
+        size_t chroma = y / 2 * img->chroma_stride;
 
-    render(data_sf);
+        if (img->u)
+            yuv420_to_rgb24_row(job->dst + y * WIDTH * 3, luma,
+                                img->u + chroma, img->v + chroma,
+                                img->chroma_step, WIDTH);
+        else
+            yuyv_to_rgb24_row(job->dst + y * WIDTH * 3, luma, WIDTH);
+    }
 }
 
-static int read_frame(void)
+static void convert_image(uint8_t * dst, const struct image *img)
 {
-    struct v4l2_buffer buf;
-    unsigned int i;
+    struct convert_job job = {.src = img,.dst = dst };
 
-    switch (io)
-    {
-    case IO_METHOD_READ:
-        if (-1 == read(fd, buffers[0].start, buffers[0].length))
+    workers_run(convert_stripe, &job, HEIGHT);
+}
+
+/*
+ * --changes: static scenes barely change from frame to frame, so only the
+ * tiles whose hash changed are converted and pushed to the screen. YUYV
+ * on a single device shown from the main loop only.
+ */
+static int changes_only = 0;
+static struct dirty dirty;
+static SDL_Rect *dirty_rects;
+
+/* Stripes of whole tile rows, each tile is checked by one thread only */
+static void convert_dirty_stripe(void *arg, size_t first, size_t last)
+{
+    const struct convert_job *job = arg;
+    const struct image *img = job->src;
+    unsigned int row, col;
+
+    for (row = first; row < last; row++)
+        for (col = 0; col < dirty.cols; col++)
         {
-            switch (errno)
-            {
-            case EAGAIN:
-                return 0;
+            const uint8_t *src;
+            size_t x, y, w, h;
 
-            case EIO:
-                /* Could ignore EIO, see spec. */
+            dirty_tile(&dirty, col, row, &x, &y, &w, &h);
+            src = img->y + y * img->stride + x * 2;
 
-                /* fall through */
+            if (!dirty_check(&dirty, col, row, src, img->stride))
+                continue;
 
-            default:
-                errno_exit("read");
-            }
+            for (; h--; y++, src += img->stride)
+                yuyv_to_rgb24_row(job->dst + (y * WIDTH + x) * 3, src, w);
         }
+}
 
-        process_image(buffers[0].start);
+/* Returns the number of tiles that changed */
+static unsigned int convert_dirty(uint8_t * dst, const struct image *img)
+{
+    struct convert_job job = {.src = img,.dst = dst };
 
-        break;
+    workers_run(convert_dirty_stripe, &job, dirty.rows);
 
-    case IO_METHOD_MMAP:
-        CLEAR(buf);
+    return dirty_commit(&dirty);
+}
 
-        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        buf.memory = V4L2_MEMORY_MMAP;
+/* Blits and updates the changed tiles, runs of them merged per tile row */
+static void render_dirty(SDL_Surface * sf)
+{
+    SDL_Surface *screen = SDL_GetVideoSurface();
+    unsigned int row, col;
+    int i, n = 0;
 
-        if (-1 == xioctl(fd, VIDIOC_DQBUF, &buf))
+    for (row = 0; row < dirty.rows; row++)
+        for (col = 0; col < dirty.cols; col++)
         {
-            switch (errno)
-            {
-            case EAGAIN:
-                return 0;
+            size_t x, y, w, h;
 
-            case EIO:
-                /* Could ignore EIO, see spec. */
+            if (!dirty.changed[row * dirty.cols + col])
+                continue;
 
-                /* fall through */
+            dirty_tile(&dirty, col, row, &x, &y, &w, &h);
 
-            default:
-                errno_exit("VIDIOC_DQBUF");
+            if (col && dirty.changed[row * dirty.cols + col - 1])
+            {
+                dirty_rects[n - 1].w += w;
+                continue;
             }
+
+            dirty_rects[n].x = x;
+            dirty_rects[n].y = y;
+            dirty_rects[n].w = w;
+            dirty_rects[n].h = h;
+            n++;
         }
 
-        assert(buf.index < n_buffers);
+    for (i = 0; i < n; i++)
+    {
+        /* Blitting clips dstrect in place */
+        SDL_Rect dst = dirty_rects[i];
+
+        SDL_BlitSurface(sf, &dirty_rects[i], screen, &dst);
+    }
 
-        process_image(buffers[buf.index].start);
+    SDL_UpdateRects(screen, n, dirty_rects);
+}
 
-        if (-1 == xioctl(fd, VIDIOC_QBUF, &buf))
-            errno_exit("VIDIOC_QBUF");
+/*
+ * Composite display
+ *
+ * With several devices each one is captured on its own thread, which
+ * converts frames straight into its tile of the composite image and rings
+ * composite_efd. The main thread only blits. Tiles are WIDTH x HEIGHT
+ * halved as often as needed for the grid to fit in the window limit.
+ */
+static size_t window_width = 1920;
+static size_t window_height = 1080;
 
-        break;
+static unsigned int grid_cols = 1;
+static unsigned int grid_rows = 1;
+static size_t tile_width;
+static size_t tile_height;
 
-    case IO_METHOD_USERPTR:
-        CLEAR(buf);
+static int composite_efd = -1;
+static int capture_stop_efd = -1;
+static int capture_quit = 0;
 
-        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        buf.memory = V4L2_MEMORY_USERPTR;
+/* Width of a row of width pixels after yuyv_downscale2_row() level times */
+static size_t scaled_width(size_t width, unsigned int level)
+{
+    width &= ~1;
 
-        if (-1 == xioctl(fd, VIDIOC_DQBUF, &buf))
-        {
-            switch (errno)
-            {
-            case EAGAIN:
-                return 0;
+    while (level--)
+        width = width / 4 * 2;
 
-            case EIO:
-                /* Could ignore EIO, see spec. */
+    return width;
+}
 
-                /* fall through */
+/* Returns YUYV row y of the image halved level times */
+static const uint8_t *scaled_row(struct device *dev, const struct image *src,
+                                 unsigned int level, size_t y, uint8_t * out)
+{
+    const uint8_t *a, *b;
 
-            default:
-                errno_exit("VIDIOC_DQBUF");
-            }
-        }
+    if (!level)
+        return image_row(src, y, dev->width, out);
 
-        for (i = 0; i < n_buffers; ++i)
-            if (buf.m.userptr == (unsigned long)buffers[i].start
-                && buf.length == buffers[i].length)
-                break;
+    /* Each level keeps its two input rows apart from the ones below */
+    a = scaled_row(dev, src, level - 1, 2 * y, dev->scale_rows[level - 1][0]);
+    b = scaled_row(dev, src, level - 1, 2 * y + 1,
+                   dev->scale_rows[level - 1][1]);
 
-        assert(i < n_buffers);
+    yuyv_downscale2_row(out, a, b, scaled_width(dev->width, level - 1));
 
-        process_image((void *)buf.m.userptr);
+    return out;
+}
 
-        if (-1 == xioctl(fd, VIDIOC_QBUF, &buf))
-            errno_exit("VIDIOC_QBUF");
+static void kick(int efd)
+{
+    uint64_t one = 1;
 
-        break;
+    if (write(efd, &one, sizeof(one)) < 0)
+    {
+        /* Counter saturated, the reader is awake anyway */
     }
+}
 
-    return 1;
+static void convert_tile(struct device *dev, const struct image *img)
+{
+    size_t stride = grid_cols * tile_width * 3;
+    size_t width = min(scaled_width(dev->width, dev->scale), tile_width);
+    size_t height = min(dev->height >> dev->scale, tile_height);
+    size_t y;
+
+    for (y = 0; y < height; y++)
+        yuyv_to_rgb24_row(dev->tile + y * stride,
+                          scaled_row(dev, img, dev->scale, y,
+                                     dev->scale_rows[dev->scale][0]), width);
+
+    kick(composite_efd);
 }
 
-static void mainloop(void)
+/* planes holds dev->n_planes pointers, see struct buffer */
+static void process_image(struct device *dev, void *const *planes)
 {
-    SDL_Event event;
-    for (;;)
+    struct image img;
+
+    image_init(dev, &img, planes);
+
+    if (n_devices > 1)
     {
+        convert_tile(dev, &img);
+        dev->times.converted = latency_now();
+        return;
+    }
 
-        while (SDL_PollEvent(&event))
-            if (event.type == SDL_QUIT)
-                return;
+    /* Only set up for YUYV */
+    if (overlay)
+    {
+        render_overlay(img.y, img.stride);
+        dev->times.rendered = latency_now();
+        return;
+    }
+
+    if (changes_only)
+    {
+        unsigned int changed = convert_dirty(buffer_sdl, &img);
 
+        dev->times.converted = latency_now();
 
-        for (;;)
+        if (headless)
+            return;
+
+        /* An identical frame is on screen already */
+        if (changed)
+            render_dirty(data_sf);
+
+        frames_displayed++;
+        dev->times.rendered = latency_now();
+        return;
+    }
+
+    convert_image(buffer_sdl, &img);
+    dev->times.converted = latency_now();
+
+    if (headless)
+        return;
+
+    render(data_sf);
+    dev->times.rendered = latency_now();
+}
+
+static void stage_record(struct device *dev, enum stage stage, uint64_t from,
+                         uint64_t to)
+{
+    if (!from || !to)
+        return;
+
+    latency_record(&dev->latency[stage], to - from);
+    latency_record(&dev->latency_interval[stage], to - from);
+}
+
+/* For frames that went through every stage on the same thread */
+static void record_frame(struct device *dev, const struct frame_times *t)
+{
+    uint64_t start = t->driver ? t->driver : t->dequeued;
+    uint64_t shown = t->rendered ? t->rendered : t->converted;
+
+    stage_record(dev, STAGE_WAIT, t->driver, t->dequeued);
+    stage_record(dev, STAGE_CONVERT, t->dequeued, t->converted);
+    stage_record(dev, STAGE_RENDER, t->converted ? t->converted : t->dequeued,
+                 t->rendered);
+    stage_record(dev, STAGE_REQUEUE, shown, t->queued);
+    stage_record(dev, STAGE_TOTAL, start, shown);
+}
+
+static void print_latency(struct device *dev, int interval)
+{
+    struct latency *l = interval ? dev->latency_interval : dev->latency;
+    unsigned int stage;
+
+    fprintf(stderr, "%s latency%s:\n", dev->name,
+            interval ? " (last interval)" : "");
+
+    for (stage = 0; stage < N_STAGES; stage++)
+    {
+        latency_print(&l[stage], stderr, stage_names[stage]);
+
+        if (interval)
+            latency_reset(&l[stage]);
+    }
+}
+
+/*
+ * Adaptive queue depth (mmap only)
+ *
+ * n_active buffers circulate between the driver and the application.
+ * Growing takes back parked buffers first and only then allocates new ones
+ * with VIDIOC_CREATE_BUFS. Shrinking parks a buffer instead of queueing it
+ * again, as V4L2 cannot free single buffers while streaming.
+ */
+static int adaptive = 0;
+
+/*
+ * Multi-planar queues want a plane array with every buffer they are
+ * handed. Stored v4l2_buffers never point to one, these fill it in.
+ */
+static int qbuf(struct device *dev, const struct v4l2_buffer *buf)
+{
+    struct v4l2_plane planes[VIDEO_MAX_PLANES];
+    struct v4l2_buffer b = *buf;
+
+    if (V4L2_TYPE_IS_MULTIPLANAR(b.type))
+    {
+        CLEAR(planes);
+        b.m.planes = planes;
+        b.length = dev->n_planes;
+    }
+
+    return xioctl(dev->fd, VIDIOC_QBUF, &b);
+}
+
+/* VIDIOC_DQBUF, bytesused is that of plane 0 for multi-planar queues */
+static int dqbuf(struct device *dev, struct v4l2_buffer *buf,
+                 enum v4l2_memory memory)
+{
+    struct v4l2_plane planes[VIDEO_MAX_PLANES];
+    int r;
+
+    CLEAR(*buf);
+
+    buf->type = dev->buf_type;
+    buf->memory = memory;
+
+    if (V4L2_TYPE_IS_MULTIPLANAR(buf->type))
+    {
+        CLEAR(planes);
+        buf->m.planes = planes;
+        buf->length = dev->n_planes;
+    }
+
+    r = xioctl(dev->fd, VIDIOC_DQBUF, buf);
+
+    if (V4L2_TYPE_IS_MULTIPLANAR(buf->type))
+    {
+        buf->bytesused = planes[0].bytesused;
+        buf->m.planes = NULL;
+    }
+
+    return r;
+}
+
+static void map_buffer(struct device *dev, unsigned int index)
+{
+    struct v4l2_plane planes[VIDEO_MAX_PLANES];
+    struct v4l2_buffer buf;
+    unsigned int i;
+
+    CLEAR(buf);
+    CLEAR(planes);
+
+    buf.type = dev->buf_type;
+    buf.memory = V4L2_MEMORY_MMAP;
+    buf.index = index;
+
+    if (V4L2_TYPE_IS_MULTIPLANAR(buf.type))
+    {
+        buf.m.planes = planes;
+        buf.length = dev->n_planes;
+    }
+
+    if (-1 == xioctl(dev->fd, VIDIOC_QUERYBUF, &buf))
+        errno_exit("VIDIOC_QUERYBUF");
+
+    for (i = 0; i < dev->n_planes; i++)
+    {
+        size_t length = buf.length;
+        off_t offset = buf.m.offset;
+
+        if (V4L2_TYPE_IS_MULTIPLANAR(buf.type))
         {
-            fd_set fds;
-            struct timeval tv;
-            int r;
+            length = planes[i].length;
+            offset = planes[i].m.mem_offset;
+        }
+
+        dev->buffers[index].length[i] = length;
+        dev->buffers[index].start[i] = mmap(NULL /* start anywhere */ ,
+                                            length,
+                                            PROT_READ | PROT_WRITE,
+                                            MAP_SHARED, dev->fd, offset);
 
-            FD_ZERO(&fds);
-            FD_SET(fd, &fds);
+        if (MAP_FAILED == dev->buffers[index].start[i])
+            errno_exit("mmap");
+    }
+}
+
+static int create_buffer(struct device *dev, unsigned int *index)
+{
+    struct v4l2_create_buffers create;
 
-            /* Timeout. */
-            tv.tv_sec = 2;
-            tv.tv_usec = 0;
+    if (dev->n_buffers == MAX_BUFFERS)
+        return -1;
 
-            r = select(fd + 1, &fds, NULL, NULL, &tv);
+    CLEAR(create);
 
-            if (-1 == r)
-            {
-                if (EINTR == errno)
-                    continue;
+    create.count = 1;
+    create.memory = V4L2_MEMORY_MMAP;
+    create.format.type = dev->buf_type;
 
-                errno_exit("select");
-            }
+    if (-1 == xioctl(dev->fd, VIDIOC_G_FMT, &create.format))
+        errno_exit("VIDIOC_G_FMT");
+
+    if (-1 == xioctl(dev->fd, VIDIOC_CREATE_BUFS, &create) || create.count != 1)
+        return -1;
+
+    assert(create.index == dev->n_buffers);
+
+    map_buffer(dev, create.index);
+    dev->n_buffers++;
+
+    *index = create.index;
+
+    return 0;
+}
+
+/* Starts the frame timeline, buf is NULL for read() i/o */
+static void buffer_dequeued(struct device *dev, const struct v4l2_buffer *buf)
+{
+    struct frame_times *t = &dev->times;
+
+    memset(t, 0, sizeof(*t));
+    t->dequeued = latency_now();
+
+    if (!buf)
+    {
+        __atomic_add_fetch(&dev->frames_captured, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    /* Sequence numbers are only meaningful after the first frame */
+    if (dev->frames_captured && buf->sequence - dev->last_sequence > 1)
+        __atomic_add_fetch(&dev->frames_dropped,
+                           buf->sequence - dev->last_sequence - 1,
+                           __ATOMIC_RELAXED);
+
+    dev->last_sequence = buf->sequence;
+    __atomic_add_fetch(&dev->frames_captured, 1, __ATOMIC_RELAXED);
+
+    if ((buf->flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) ==
+        V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC)
+        t->driver = latency_timeval(&buf->timestamp);
+
+    if (adaptive)
+        bufq_dequeued(&dev->queue_depth, buf->sequence, t->dequeued);
+}
+
+/*
+ * Gives a dequeued buffer back to the driver, or parks it, and tops the
+ * queue up to the current target. Returns the number of buffers queued.
+ */
+static unsigned int queue_buffer(struct device *dev, struct v4l2_buffer *buf)
+{
+    unsigned int queued = 0;
+
+    if (adaptive && dev->n_active > dev->queue_depth.target)
+    {
+        dev->parked[dev->n_parked++] = buf->index;
+        dev->n_active--;
+    }
+    else
+    {
+        if (-1 == qbuf(dev, buf))
+            errno_exit("VIDIOC_QBUF");
+
+        queued++;
+    }
+
+    while (adaptive && dev->n_active < dev->queue_depth.target)
+    {
+        struct v4l2_buffer extra;
+        unsigned int index;
+
+        if (dev->n_parked)
+        {
+            index = dev->parked[--dev->n_parked];
+        }
+        else if (create_buffer(dev, &index))
+        {
+            fprintf(stderr, "Cannot grow the queue past %u buffers\n",
+                    dev->n_active);
+            bufq_limit(&dev->queue_depth, dev->n_active);
+            break;
+        }
+
+        CLEAR(extra);
+
+        extra.type = dev->buf_type;
+        extra.memory = V4L2_MEMORY_MMAP;
+        extra.index = index;
+
+        if (-1 == qbuf(dev, &extra))
+            errno_exit("VIDIOC_QBUF");
+
+        dev->n_active++;
+        queued++;
+    }
+
+    return queued;
+}
+
+/*
+ * Recording (mmap only)
+ *
+ * Frames are written to disk straight from the capture buffers. A buffer
+ * is only queued again once its write has completed, so a slow disk shows
+ * up as dropped frames rather than as a torn recording.
+ */
+static const char *record_path = NULL;
+static struct record recorder;
+static struct reactor_source record_source;
+static struct v4l2_buffer record_bufs[MAX_BUFFERS];
+
+static void record_buffer(struct device *dev, const struct v4l2_buffer *buf)
+{
+    struct record_index entry;
+
+    record_bufs[buf->index] = *buf;
+
+    /* Replay paces by these, the driver clock is steadier when we have it */
+    entry.timestamp = dev->times.driver ? dev->times.driver :
+        dev->times.dequeued;
+    entry.sequence = buf->sequence;
+    entry.bytesused = buf->bytesused;
+
+    if (record_write(&recorder, buf->index, dev->buffers[buf->index].start[0],
+                     dev->buffers[buf->index].length[0], &entry))
+        errno_exit("record");
+}
+
+static void on_recorded(void *arg, unsigned int index)
+{
+    struct device *dev = arg;
+
+    queue_buffer(dev, &record_bufs[index]);
+}
+
+static void on_record_complete(void *arg, uint32_t events)
+{
+    record_complete(&recorder);
+}
+
+static void start_recording(struct device *dev)
+{
+    struct record_header format;
+
+    if (dev->n_planes > 1)
+    {
+        fprintf(stderr, "Only single plane formats can be recorded\n");
+        exit(EXIT_FAILURE);
+    }
+
+    memset(&format, 0, sizeof(format));
+
+    format.pixelformat = dev->pixelformat;
+    format.width = dev->width;
+    format.height = dev->height;
+    format.bytesperline = dev->bytesperline;
+    format.frame_size = dev->sizeimage;
+
+    if (record_open(&recorder, record_path, &format, on_recorded, dev))
+        errno_exit(record_path);
+
+    if (reactor_add(&loop, &record_source, recorder.efd, EPOLLIN,
+                    on_record_complete, NULL))
+        errno_exit("epoll_ctl");
+
+    fprintf(stderr, "Recording to %s (%s%s)\n", record_path,
+            recorder.uring ? "io_uring" : "writer thread",
+            recorder.direct ? ", O_DIRECT" : "");
+}
+
+/* Before stop_capturing(), the buffers are still being written */
+static void stop_recording(void)
+{
+    reactor_del(&loop, &record_source);
+
+    if (record_close(&recorder))
+        errno_exit(record_path);
+
+    fprintf(stderr, "%llu frames recorded, %lu staged through a copy\n",
+            (unsigned long long)recorder.header.frames, recorder.staged);
+}
+
+/*
+ * MJPEG (mmap only)
+ *
+ * Each frame is handed to the decoder pool as it is dequeued and its
+ * buffer stays with the pool until on_decoded(), which gets the frames
+ * back in sequence order and shows and queues them.
+ */
+static struct mjpeg decoder;
+static struct reactor_source decoder_source;
+static struct v4l2_buffer decode_bufs[MAX_BUFFERS];
+static struct frame_times decode_times[MAX_BUFFERS];
+static uint8_t *decode_rgb[MAX_BUFFERS];
+static SDL_Surface *decode_sf[MAX_BUFFERS];
+
+static int is_mjpeg(uint32_t fourcc)
+{
+    return fourcc == V4L2_PIX_FMT_MJPEG || fourcc == V4L2_PIX_FMT_JPEG;
+}
+
+static void decode_buffer(struct device *dev, const struct v4l2_buffer *buf)
+{
+    unsigned int index = buf->index;
+
+    /* The adaptive queue may have created the buffer just now */
+    if (!decode_rgb[index])
+    {
+        decode_rgb[index] = arena_alloc(dev->width * dev->height * 3);
+
+        if (!decode_rgb[index])
+        {
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+
+        if (!headless)
+            decode_sf[index] = SDL_CreateRGBSurfaceFrom(decode_rgb[index],
+                                                        dev->width,
+                                                        dev->height, 24,
+                                                        dev->width * 3,
+                                                        mask32(0), mask32(1),
+                                                        mask32(2), 0);
+    }
+
+    decode_bufs[index] = *buf;
+    decode_times[index] = dev->times;
+
+    if (mjpeg_decode(&decoder, index, buf->sequence,
+                     dev->buffers[index].start[0], buf->bytesused ?
+                     buf->bytesused : dev->buffers[index].length[0],
+                     decode_rgb[index]))
+        errno_exit("mjpeg_decode");
+}
+
+static void on_decoded(void *arg, unsigned int index, int ok)
+{
+    struct device *dev = arg;
+    struct frame_times *t = &decode_times[index];
+
+    t->converted = latency_now();
+
+    /* A corrupt frame leaves the previous one on screen */
+    if (ok && !headless)
+    {
+        render(decode_sf[index]);
+        t->rendered = latency_now();
+    }
+
+    queue_buffer(dev, &decode_bufs[index]);
+
+    t->queued = latency_now();
+    record_frame(dev, t);
+}
+
+static void on_decoder(void *arg, uint32_t events)
+{
+    mjpeg_complete(&decoder);
+}
+
+static void start_decoding(struct device *dev)
+{
+    if (mjpeg_init(&decoder, num_threads, dev->width, dev->height,
+                   on_decoded, dev))
+        errno_exit("mjpeg_init");
+
+    if (reactor_add(&loop, &decoder_source, decoder.efd, EPOLLIN,
+                    on_decoder, NULL))
+        errno_exit("epoll_ctl");
+
+    fprintf(stderr, "Decoding MJPEG on %u threads\n", decoder.n_threads);
+}
+
+/* Before stop_capturing(), the threads may still read the buffers */
+static void stop_decoding(void)
+{
+    unsigned int i;
+
+    reactor_del(&loop, &decoder_source);
+
+    mjpeg_exit(&decoder);
+
+    fprintf(stderr, "%lu frames decoded, %lu corrupt\n", decoder.decoded,
+            decoder.corrupt);
+
+    for (i = 0; i < MAX_BUFFERS; i++)
+    {
+        if (decode_sf[i])
+            SDL_FreeSurface(decode_sf[i]);
+        arena_free(decode_rgb[i]);
+    }
+}
+
+/* Replay: paced at the recorded rate unless --fast, from --seek on */
+static int replay_paced = 1;
+static uint64_t replay_start = 0;
+/* Composite replay runs until the longest recording is over */
+static unsigned int replays_ended = 0;
+
+static void skipped(struct device *dev)
+{
+    __atomic_add_fetch(&dev->frames_skipped, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * latest_only: keeps dequeueing until the driver runs dry and gives every
+ * buffer but the newest back at once. buf holds the newest one on return.
+ */
+static void skip_stale(struct device *dev, struct v4l2_buffer *buf)
+{
+    for (;;)
+    {
+        struct v4l2_buffer next;
+
+        if (-1 == dqbuf(dev, &next, buf->memory))
+        {
+            if (EAGAIN == errno)
+                return;
+
+            errno_exit("VIDIOC_DQBUF");
+        }
+
+        /* Counts it and keeps the sequence gaps right */
+        buffer_dequeued(dev, buf);
+
+        if (IO_METHOD_MMAP == io)
+            queue_buffer(dev, buf);
+        else if (-1 == qbuf(dev, buf))
+            errno_exit("VIDIOC_QBUF");
+
+        skipped(dev);
+        *buf = next;
+    }
+}
+
+static int read_frame(struct device *dev)
+{
+    struct v4l2_buffer buf;
+    unsigned int i;
+    void *frame;
+    int64_t n;
+
+    switch (io)
+    {
+    case IO_METHOD_READ:
+        if (-1 == read(dev->fd, dev->buffers[0].start[0],
+                       dev->buffers[0].length[0]))
+        {
+            switch (errno)
+            {
+            case EAGAIN:
+                return 0;
+
+            case EIO:
+                /* Could ignore EIO, see spec. */
+
+                /* fall through */
+
+            default:
+                errno_exit("read");
+            }
+        }
+
+        buffer_dequeued(dev, NULL);
+
+        process_image(dev, dev->buffers[0].start);
+
+        break;
+
+    case IO_METHOD_MMAP:
+        if (-1 == dqbuf(dev, &buf, V4L2_MEMORY_MMAP))
+        {
+            switch (errno)
+            {
+            case EAGAIN:
+                return 0;
+
+            case EIO:
+                /* Could ignore EIO, see spec. */
+
+                /* fall through */
+
+            default:
+                errno_exit("VIDIOC_DQBUF");
+            }
+        }
+
+        if (latest_only)
+            skip_stale(dev, &buf);
+
+        assert(buf.index < dev->n_buffers);
+
+        buffer_dequeued(dev, &buf);
+
+        if (is_mjpeg(dev->pixelformat))
+        {
+            /* Queued by on_decoded(), which also times it */
+            decode_buffer(dev, &buf);
+            return 1;
+        }
+
+        process_image(dev, dev->buffers[buf.index].start);
+
+        if (record_path)
+        {
+            /* Queued by on_recorded(), nothing to time here */
+            record_buffer(dev, &buf);
+            record_frame(dev, &dev->times);
+            return 1;
+        }
+
+        queue_buffer(dev, &buf);
+
+        break;
+
+    case IO_METHOD_USERPTR:
+        if (-1 == dqbuf(dev, &buf, V4L2_MEMORY_USERPTR))
+        {
+            switch (errno)
+            {
+            case EAGAIN:
+                return 0;
+
+            case EIO:
+                /* Could ignore EIO, see spec. */
+
+                /* fall through */
+
+            default:
+                errno_exit("VIDIOC_DQBUF");
+            }
+        }
+
+        if (latest_only)
+            skip_stale(dev, &buf);
+
+        for (i = 0; i < dev->n_buffers; ++i)
+            if (buf.m.userptr == (unsigned long)dev->buffers[i].start[0]
+                && buf.length == dev->buffers[i].length[0])
+                break;
+
+        assert(i < dev->n_buffers);
+
+        buffer_dequeued(dev, &buf);
+
+        process_image(dev, dev->buffers[i].start);
+
+        if (-1 == qbuf(dev, &buf))
+            errno_exit("VIDIOC_QBUF");
+
+        break;
+
+    case IO_METHOD_REPLAY:
+        n = replay_next(&dev->replay);
+
+        if (n < 0)
+            return 0;
+
+        /* Unpaced every frame is due at once, nothing is stale */
+        while (latest_only && dev->replay.paced)
+        {
+            int64_t newer = replay_next(&dev->replay);
+
+            if (newer < 0)
+                break;
+
+            CLEAR(buf);
+            buf.sequence = dev->replay.index[n].sequence;
+            buffer_dequeued(dev, &buf);
+
+            skipped(dev);
+            n = newer;
+        }
+
+        /* Recorded timestamps are from another run, only keep sequence */
+        CLEAR(buf);
+        buf.sequence = dev->replay.index[n].sequence;
+
+        buffer_dequeued(dev, &buf);
+
+        /* Straight from the mapping, nothing to give back */
+        frame = (void *)replay_data(&dev->replay, n);
+        process_image(dev, &frame);
+
+        /* The timerfd stays quiet after the last frame */
+        if (replay_ended(&dev->replay) &&
+            __atomic_add_fetch(&replays_ended, 1, __ATOMIC_RELAXED) ==
+            n_devices)
+            reactor_quit(&loop);
+
+        break;
+    }
+
+    dev->times.queued = latency_now();
+    record_frame(dev, &dev->times);
+
+    return 1;
+}
+
+/*
+ * Reads every frame that is ready. Unpaced replay has the whole recording
+ * due at once, there it is one frame per wakeup so that the caller gets
+ * to signals, SDL and quitting in between. The re-armed timerfd is ready
+ * again right away.
+ */
+static void read_frames(struct device *dev)
+{
+    if (IO_METHOD_REPLAY == io && !dev->replay.paced)
+        read_frame(dev);
+    else
+        while (read_frame(dev))
+            ;
+}
+
+/*
+ * Event loop
+ *
+ * The capture fd is edge triggered, so every wakeup drains all ready
+ * buffers. A watchdog timer replaces the per-frame select() timeout, and
+ * SIGINT or SIGTERM end the loop the same way closing the window does.
+ */
+#define WATCHDOG_MS 2000
+
+static struct reactor_source capture_source;
+static struct reactor_source watchdog_source;
+
+static void on_signal(void *arg, uint32_t signo)
+{
+    if (SIGUSR1 == signo)
+        print_throughput();
+    else
+        reactor_quit(&loop);
+}
+
+static void on_stats(void *arg, uint32_t expirations)
+{
+    static unsigned long last_frames = 0;
+    unsigned long frames = frames_displayed;
+    unsigned int i;
+
+    /* Without a display count what was captured instead */
+    for (i = 0; headless && i < n_devices; i++)
+        frames += __atomic_load_n(&devices[i].frames_captured,
+                                  __ATOMIC_RELAXED);
+
+    fprintf(stderr, "%.2f fps\n", (frames - last_frames) /
+            (double)(stats_interval * expirations));
+
+    last_frames = frames;
+
+    for (i = 0; i < n_devices; i++)
+        print_latency(&devices[i], 1);
+}
+
+static void on_capture(void *arg, uint32_t events)
+{
+    read_frames(arg);
+}
+
+static void on_watchdog(void *arg, uint32_t expirations)
+{
+    static unsigned long last_frames = 0;
+    struct device *dev = arg;
+
+    if (dev->frames_captured == last_frames)
+    {
+        fprintf(stderr, "capture timeout\n");
+        exit(EXIT_FAILURE);
+    }
+
+    last_frames = dev->frames_captured;
+}
+
+static void poll_sdl(void)
+{
+    SDL_Event event;
+
+    if (headless)
+        return;
+
+    while (SDL_PollEvent(&event))
+        if (event.type == SDL_QUIT)
+            reactor_quit(&loop);
+}
+
+static void mainloop(void)
+{
+    struct device *dev = &devices[0];
+
+    if (reactor_add(&loop, &capture_source, dev->fd, EPOLLIN | EPOLLET,
+                    on_capture, dev) ||
+        reactor_add_timer(&loop, &watchdog_source, WATCHDOG_MS,
+                          on_watchdog, dev))
+        errno_exit("epoll_ctl");
+
+    while (reactor_running(&loop))
+    {
+        poll_sdl();
+
+        /* Wake up now and then to keep handling SDL events */
+        if (-1 == reactor_run(&loop, 100))
+            errno_exit("epoll_wait");
+    }
+
+    reactor_del(&loop, &watchdog_source);
+    reactor_del(&loop, &capture_source);
+}
+
+/*
+ * Pipelined mode
+ *
+ * The capture thread only does DQBUF and QBUF, the convert thread turns
+ * dequeued buffers into RGB slots and the main thread displays them.
+ * Stages pass buffer indices over single-producer, single-consumer rings:
+ *
+ *   capture_ring  capture -> convert   V4L2 buffer index
+ *   done_ring     convert -> capture   V4L2 buffer index, ready for QBUF
+ *   display_ring  convert -> display   RGB slot
+ *   free_ring     display -> convert   RGB slot
+ *
+ * A V4L2 buffer is handed back for QBUF as soon as it is converted. If
+ * the display still holds every RGB slot the frame is not converted at
+ * all and goes straight back to the driver.
+ */
+#define PIPE_SLOTS 3
+
+static struct ring capture_ring;
+static struct ring done_ring;
+static struct ring display_ring;
+static struct ring free_ring;
+
+static struct v4l2_buffer *pipe_bufs;
+static struct frame_times *pipe_times;      /* by V4L2 buffer index */
+static uint8_t *pipe_rgb[PIPE_SLOTS];
+static SDL_Surface *pipe_sf[PIPE_SLOTS];
+static struct frame_times pipe_slot_times[PIPE_SLOTS];
+
+static int pipe_quit = 0;
+static unsigned long pipe_dropped = 0;
+
+static int pipe_running(void)
+{
+    return !__atomic_load_n(&pipe_quit, __ATOMIC_ACQUIRE);
+}
+
+static void *capture_thread(void *arg)
+{
+    struct device *dev = arg;
+    unsigned int queued = dev->n_buffers;
+
+    while (pipe_running())
+    {
+        struct pollfd pfd[2];
+        unsigned int index;
+        int r;
+
+        /* With nothing queued the driver would report POLLERR at once */
+        pfd[0].fd = queued ? dev->fd : -1;
+        pfd[0].events = POLLIN;
+        pfd[1].fd = done_ring.efd;
+        pfd[1].events = POLLIN;
+
+        r = poll(pfd, 2, 2000);
+
+        if (-1 == r)
+        {
+            if (EINTR == errno)
+                continue;
+
+            errno_exit("poll");
+        }
+
+        if (0 == r)
+        {
+            fprintf(stderr, "select timeout\n");
+            exit(EXIT_FAILURE);
+        }
+
+        if (pfd[1].revents & POLLIN)
+            ring_clear(&done_ring);
+
+        while (0 == ring_pop(&done_ring, &index))
+        {
+            struct frame_times *t = &pipe_times[index];
+
+            queued += queue_buffer(dev, &pipe_bufs[index]);
+
+            /* Render and end to end are recorded by the display */
+            stage_record(dev, STAGE_WAIT, t->driver, t->dequeued);
+            stage_record(dev, STAGE_CONVERT, t->dequeued, t->converted);
+            stage_record(dev, STAGE_REQUEUE, t->converted, latency_now());
+        }
+
+        if (!(pfd[0].revents & (POLLIN | POLLERR)))
+            continue;
+
+        for (;;)
+        {
+            struct v4l2_buffer buf;
+
+            if (-1 == dqbuf(dev, &buf, io == IO_METHOD_MMAP ?
+                            V4L2_MEMORY_MMAP : V4L2_MEMORY_USERPTR))
+            {
+                if (EAGAIN == errno)
+                    break;
+
+                errno_exit("VIDIOC_DQBUF");
+            }
+
+            assert(buf.index < dev->n_buffers);
+
+            buffer_dequeued(dev, &buf);
+
+            pipe_bufs[buf.index] = buf;
+            pipe_times[buf.index] = dev->times;
+            queued--;
+
+            ring_push(&capture_ring, buf.index);
+        }
+    }
+
+    return NULL;
+}
+
+static void *convert_thread(void *arg)
+{
+    struct device *dev = arg;
+
+    while (pipe_running())
+    {
+        unsigned int index, newer;
+        unsigned int slot;
+        struct image img;
+
+        if (ring_pop(&capture_ring, &index))
+        {
+            ring_wait(&capture_ring, -1);
+            continue;
+        }
+
+        /* Older frames are handed back unconverted */
+        while (latest_only && 0 == ring_pop(&capture_ring, &newer))
+        {
+            ring_push(&done_ring, index);
+            skipped(dev);
+            index = newer;
+        }
+
+        if (ring_pop(&free_ring, &slot))
+        {
+            pipe_dropped++;
+            ring_push(&done_ring, index);
+            continue;
+        }
+
+        image_init(dev, &img, dev->buffers[index].start);
+        convert_image(pipe_rgb[slot], &img);
+
+        pipe_times[index].converted = latency_now();
+        pipe_slot_times[slot] = pipe_times[index];
+
+        ring_push(&done_ring, index);
+        ring_push(&display_ring, slot);
+    }
+
+    return NULL;
+}
+
+static struct reactor_source display_source;
+
+static void on_display(void *arg, uint32_t events)
+{
+    struct device *dev = arg;
+    unsigned int slot;
+
+    ring_clear(&display_ring);
+
+    while (0 == ring_pop(&display_ring, &slot))
+    {
+        const struct frame_times *t = &pipe_slot_times[slot];
+        uint64_t now;
+
+        if (!headless)
+            render(pipe_sf[slot]);
+
+        now = latency_now();
+        stage_record(dev, STAGE_RENDER, t->converted, now);
+        stage_record(dev, STAGE_TOTAL, t->driver ? t->driver : t->dequeued,
+                     now);
+
+        ring_push(&free_ring, slot);
+    }
+}
+
+static void pipeline_loop(void)
+{
+    pthread_t capture;
+    pthread_t convert;
+    unsigned int slot;
+
+    if (ring_init(&capture_ring) || ring_init(&done_ring) ||
+        ring_init(&display_ring) || ring_init(&free_ring))
+        errno_exit("eventfd");
+
+    /* Room for every buffer the adaptive queue might create */
+    pipe_bufs = calloc(MAX_BUFFERS, sizeof(*pipe_bufs));
+    pipe_times = calloc(MAX_BUFFERS, sizeof(*pipe_times));
+
+    if (!pipe_bufs || !pipe_times)
+    {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (slot = 0; slot < PIPE_SLOTS; slot++)
+    {
+        pipe_rgb[slot] = arena_alloc(WIDTH * HEIGHT * 3);
+
+        if (!pipe_rgb[slot])
+        {
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+
+        if (!headless)
+            pipe_sf[slot] = SDL_CreateRGBSurfaceFrom(pipe_rgb[slot],
+                                                     WIDTH, HEIGHT, 24,
+                                                     WIDTH * 3, mask32(0),
+                                                     mask32(1), mask32(2), 0);
+        ring_push(&free_ring, slot);
+    }
+
+    if (pthread_create(&capture, NULL, capture_thread, &devices[0]) ||
+        pthread_create(&convert, NULL, convert_thread, &devices[0]))
+    {
+        fprintf(stderr, "Cannot create pipeline threads\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (reactor_add(&loop, &display_source, display_ring.efd, EPOLLIN,
+                    on_display, &devices[0]))
+        errno_exit("epoll_ctl");
+
+    while (reactor_running(&loop))
+    {
+        poll_sdl();
+
+        /* Wake up now and then to keep handling SDL events */
+        if (-1 == reactor_run(&loop, 10))
+            errno_exit("epoll_wait");
+    }
+
+    reactor_del(&loop, &display_source);
+
+    __atomic_store_n(&pipe_quit, 1, __ATOMIC_RELEASE);
+
+    ring_kick(&capture_ring);
+    ring_kick(&done_ring);
+
+    pthread_join(capture, NULL);
+    pthread_join(convert, NULL);
+
+    fprintf(stderr, "Pipeline: %lu frames dropped by display\n",
+            pipe_dropped);
+
+    for (slot = 0; slot < PIPE_SLOTS; slot++)
+    {
+        if (pipe_sf[slot])
+            SDL_FreeSurface(pipe_sf[slot]);
+        arena_free(pipe_rgb[slot]);
+    }
+
+    free(pipe_bufs);
+    free(pipe_times);
+
+    ring_free(&capture_ring);
+    ring_free(&done_ring);
+    ring_free(&display_ring);
+    ring_free(&free_ring);
+}
+
+/* Composite mode: one capture thread per device, see convert_tile() */
+static void *device_thread(void *arg)
+{
+    struct device *dev = arg;
+
+    while (!__atomic_load_n(&capture_quit, __ATOMIC_ACQUIRE))
+    {
+        struct pollfd pfd[2];
+        int r;
+
+        pfd[0].fd = dev->fd;
+        pfd[0].events = POLLIN;
+        pfd[1].fd = capture_stop_efd;
+        pfd[1].events = POLLIN;
+
+        /* A replay that has ended only waits to be stopped */
+        r = poll(pfd, 2, IO_METHOD_REPLAY == io &&
+                 replay_ended(&dev->replay) ? -1 : WATCHDOG_MS);
+
+        if (-1 == r)
+        {
+            if (EINTR == errno)
+                continue;
+
+            errno_exit("poll");
+        }
+
+        if (0 == r)
+        {
+            fprintf(stderr, "%s: capture timeout\n", dev->name);
+            exit(EXIT_FAILURE);
+        }
+
+        if (pfd[0].revents)
+            read_frames(dev);
+    }
+
+    return NULL;
+}
+
+/*
+ * Picks a grid as close to square as possible, halves the tiles until it
+ * fits in window_width x window_height and allocates buffer_sdl for it.
+ */
+static void layout_composite(void)
+{
+    unsigned int scale = 0;
+    unsigned int i;
+
+    while (grid_cols * grid_cols < n_devices)
+        grid_cols++;
+
+    grid_rows = (n_devices + grid_cols - 1) / grid_cols;
+
+    while (scale < MAX_SCALE &&
+           (grid_cols * scaled_width(WIDTH, scale) > window_width ||
+            grid_rows * (HEIGHT >> scale) > window_height))
+        scale++;
+
+    tile_width = scaled_width(WIDTH, scale);
+    tile_height = HEIGHT >> scale;
+
+    /* Unused tiles stay black */
+    buffer_sdl = arena_alloc(grid_cols * tile_width * grid_rows * tile_height *
+                             3);
+
+    if (!buffer_sdl)
+    {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < n_devices; i++)
+    {
+        struct device *dev = &devices[i];
+        unsigned int level;
+
+        /* The driver may have picked a larger size than asked for */
+        dev->scale = 0;
+
+        while (dev->scale < MAX_SCALE &&
+               (scaled_width(dev->width, dev->scale) > tile_width ||
+                (dev->height >> dev->scale) > tile_height))
+            dev->scale++;
+
+        /* Level 0 is where 4:2:0 rows are repacked as YUYV */
+        for (level = dev->pixelformat == V4L2_PIX_FMT_YUYV;
+             level <= dev->scale; level++)
+        {
+            size_t size = scaled_width(dev->width, level) * 2;
+
+            dev->scale_rows[level][0] = malloc(size);
+            dev->scale_rows[level][1] = malloc(size);
+
+            if (!dev->scale_rows[level][0] || !dev->scale_rows[level][1])
+            {
+                fprintf(stderr, "Out of memory\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        dev->tile = buffer_sdl +
+            ((i / grid_cols) * tile_height * grid_cols * tile_width +
+             (i % grid_cols) * tile_width) * 3;
+    }
+}
+
+static struct reactor_source composite_source;
+
+static void on_composite(void *arg, uint32_t events)
+{
+    uint64_t count;
+
+    if (read(composite_efd, &count, sizeof(count)) < 0)
+    {
+        /* EAGAIN, nothing was pending */
+    }
+
+    if (!headless)
+        render(data_sf);
+}
+
+static void composite_loop(void)
+{
+    unsigned int i;
+
+    composite_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    capture_stop_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if (composite_efd < 0 || capture_stop_efd < 0)
+        errno_exit("eventfd");
+
+    if (reactor_add(&loop, &composite_source, composite_efd, EPOLLIN,
+                    on_composite, NULL))
+        errno_exit("epoll_ctl");
+
+    for (i = 0; i < n_devices; i++)
+        if (pthread_create(&devices[i].thread, NULL, device_thread,
+                           &devices[i]))
+        {
+            fprintf(stderr, "Cannot create capture threads\n");
+            exit(EXIT_FAILURE);
+        }
+
+    while (reactor_running(&loop))
+    {
+        poll_sdl();
+
+        /* Wake up now and then to keep handling SDL events */
+        if (-1 == reactor_run(&loop, 100))
+            errno_exit("epoll_wait");
+    }
 
-            if (0 == r)
-            {
-                fprintf(stderr, "select timeout\n");
-                exit(EXIT_FAILURE);
-            }
+    __atomic_store_n(&capture_quit, 1, __ATOMIC_RELEASE);
+    kick(capture_stop_efd);
 
-            if (read_frame())
-                break;
+    for (i = 0; i < n_devices; i++)
+    {
+        pthread_join(devices[i].thread, NULL);
 
-            /* EAGAIN - continue select loop. */
-        }
+        fprintf(stderr, "%s: %lu frames captured\n", devices[i].name,
+                devices[i].frames_captured);
     }
+
+    reactor_del(&loop, &composite_source);
+
+    close(composite_efd);
+    close(capture_stop_efd);
 }
 
-static void stop_capturing(void)
+static void stop_capturing(struct device *dev)
 {
     enum v4l2_buf_type type;
 
     switch (io)
     {
     case IO_METHOD_READ:
+    case IO_METHOD_REPLAY:
         /* Nothing to do. */
         break;
 
     case IO_METHOD_MMAP:
     case IO_METHOD_USERPTR:
-        type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        type = dev->buf_type;
 
-        if (-1 == xioctl(fd, VIDIOC_STREAMOFF, &type))
+        if (-1 == xioctl(dev->fd, VIDIOC_STREAMOFF, &type))
             errno_exit("VIDIOC_STREAMOFF");
 
         break;
     }
 }
 
-static void start_capturing(void)
+static void start_capturing(struct device *dev)
 {
     unsigned int i;
     enum v4l2_buf_type type;
@@ -395,114 +1912,134 @@ static void start_capturing(void)
         break;
 
     case IO_METHOD_MMAP:
-        for (i = 0; i < n_buffers; ++i)
+        dev->n_active = dev->n_buffers;
+        dev->n_parked = 0;
+
+        for (i = 0; i < dev->n_buffers; ++i)
         {
             struct v4l2_buffer buf;
 
             CLEAR(buf);
 
-            buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+            buf.type = dev->buf_type;
             buf.memory = V4L2_MEMORY_MMAP;
             buf.index = i;
 
-            if (-1 == xioctl(fd, VIDIOC_QBUF, &buf))
+            if (-1 == qbuf(dev, &buf))
                 errno_exit("VIDIOC_QBUF");
         }
 
-        type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        type = dev->buf_type;
 
-        if (-1 == xioctl(fd, VIDIOC_STREAMON, &type))
+        if (-1 == xioctl(dev->fd, VIDIOC_STREAMON, &type))
             errno_exit("VIDIOC_STREAMON");
 
         break;
 
     case IO_METHOD_USERPTR:
-        for (i = 0; i < n_buffers; ++i)
+        for (i = 0; i < dev->n_buffers; ++i)
         {
             struct v4l2_buffer buf;
 
             CLEAR(buf);
 
-            buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+            buf.type = dev->buf_type;
             buf.memory = V4L2_MEMORY_USERPTR;
             buf.index = i;
-            buf.m.userptr = (unsigned long)buffers[i].start;
-            buf.length = buffers[i].length;
+            buf.m.userptr = (unsigned long)dev->buffers[i].start[0];
+            buf.length = dev->buffers[i].length[0];
 
-            if (-1 == xioctl(fd, VIDIOC_QBUF, &buf))
+            if (-1 == xioctl(dev->fd, VIDIOC_QBUF, &buf))
                 errno_exit("VIDIOC_QBUF");
         }
 
-        type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        type = dev->buf_type;
 
-        if (-1 == xioctl(fd, VIDIOC_STREAMON, &type))
+        if (-1 == xioctl(dev->fd, VIDIOC_STREAMON, &type))
             errno_exit("VIDIOC_STREAMON");
 
         break;
+
+    case IO_METHOD_REPLAY:
+        /* Restarts the clock, the first frame is due now */
+        replay_seek(&dev->replay, dev->replay.pos);
+        break;
     }
 }
 
-static void uninit_device(void)
+static void uninit_device(struct device *dev)
 {
-    unsigned int i;
+    unsigned int i, plane;
 
     switch (io)
     {
     case IO_METHOD_READ:
-        free(buffers[0].start);
+        arena_free(dev->buffers[0].start[0]);
         break;
 
     case IO_METHOD_MMAP:
-        for (i = 0; i < n_buffers; ++i)
-            if (-1 == munmap(buffers[i].start, buffers[i].length))
-                errno_exit("munmap");
+        for (i = 0; i < dev->n_buffers; ++i)
+            for (plane = 0; plane < dev->n_planes; plane++)
+                if (-1 == munmap(dev->buffers[i].start[plane],
+                                 dev->buffers[i].length[plane]))
+                    errno_exit("munmap");
         break;
 
     case IO_METHOD_USERPTR:
-        for (i = 0; i < n_buffers; ++i)
-            free(buffers[i].start);
+        for (i = 0; i < dev->n_buffers; ++i)
+            arena_free(dev->buffers[i].start[0]);
+        break;
+
+    case IO_METHOD_REPLAY:
+        /* Frames live in the mapping */
         break;
     }
 
-    free(buffers);
+    free(dev->buffers);
+
+    for (i = 0; i <= dev->scale; i++)
+    {
+        free(dev->scale_rows[i][0]);
+        free(dev->scale_rows[i][1]);
+    }
 }
 
-static void init_read(unsigned int buffer_size)
+static void init_read(struct device *dev, unsigned int buffer_size)
 {
-    buffers = calloc(1, sizeof(*buffers));
+    dev->buffers = calloc(1, sizeof(*dev->buffers));
 
-    if (!buffers)
+    if (!dev->buffers)
     {
         fprintf(stderr, "Out of memory\n");
         exit(EXIT_FAILURE);
     }
 
-    buffers[0].length = buffer_size;
-    buffers[0].start = malloc(buffer_size);
+    dev->buffers[0].length[0] = buffer_size;
+    dev->buffers[0].start[0] = arena_alloc(buffer_size);
 
-    if (!buffers[0].start)
+    if (!dev->buffers[0].start[0])
     {
         fprintf(stderr, "Out of memory\n");
         exit(EXIT_FAILURE);
     }
 }
 
-static void init_mmap(void)
+static void init_mmap(struct device *dev)
 {
     struct v4l2_requestbuffers req;
 
     CLEAR(req);
 
-    req.count = 4;
-    req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    req.count = num_buffers;
+    req.type = dev->buf_type;
     req.memory = V4L2_MEMORY_MMAP;
 
-    if (-1 == xioctl(fd, VIDIOC_REQBUFS, &req))
+    if (-1 == xioctl(dev->fd, VIDIOC_REQBUFS, &req))
     {
         if (EINVAL == errno)
         {
             fprintf(stderr, "%s does not support "
-                    "memory mapping\n", dev_name);
+                    "memory mapping\n", dev->name);
             exit(EXIT_FAILURE);
         }
         else
@@ -513,44 +2050,32 @@ static void init_mmap(void)
 
     if (req.count < 2)
     {
-        fprintf(stderr, "Insufficient buffer memory on %s\n", dev_name);
+        fprintf(stderr, "Insufficient buffer memory on %s\n", dev->name);
         exit(EXIT_FAILURE);
     }
 
-    buffers = calloc(req.count, sizeof(*buffers));
+    if (req.count > MAX_BUFFERS)
+        req.count = MAX_BUFFERS;
 
-    if (!buffers)
+    /* Leave room for buffers created later on by the adaptive queue */
+    dev->buffers = calloc(MAX_BUFFERS, sizeof(*dev->buffers));
+
+    if (!dev->buffers)
     {
         fprintf(stderr, "Out of memory\n");
         exit(EXIT_FAILURE);
     }
 
-    for (n_buffers = 0; n_buffers < req.count; ++n_buffers)
-    {
-        struct v4l2_buffer buf;
-
-        CLEAR(buf);
-
-        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        buf.memory = V4L2_MEMORY_MMAP;
-        buf.index = n_buffers;
-
-        if (-1 == xioctl(fd, VIDIOC_QUERYBUF, &buf))
-            errno_exit("VIDIOC_QUERYBUF");
+    for (dev->n_buffers = 0; dev->n_buffers < req.count; ++dev->n_buffers)
+        map_buffer(dev, dev->n_buffers);
 
-        buffers[n_buffers].length = buf.length;
-        buffers[n_buffers].start = mmap(NULL /* start anywhere */ ,
-                                        buf.length, PROT_READ | PROT_WRITE  /* required 
-                                                                             */ ,
-                                        MAP_SHARED /* recommended */ ,
-                                        fd, buf.m.offset);
-
-        if (MAP_FAILED == buffers[n_buffers].start)
-            errno_exit("mmap");
-    }
+    /* Never go below one buffer being filled while another is processed */
+    if (adaptive)
+        bufq_init(&dev->queue_depth, min(3, dev->n_buffers), MAX_BUFFERS,
+                  dev->n_buffers);
 }
 
-static void init_userp(unsigned int buffer_size)
+static void init_userp(struct device *dev, unsigned int buffer_size)
 {
     struct v4l2_requestbuffers req;
     unsigned int page_size;
@@ -560,16 +2085,16 @@ static void init_userp(unsigned int buffer_size)
 
     CLEAR(req);
 
-    req.count = 4;
-    req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    req.count = num_buffers;
+    req.type = dev->buf_type;
     req.memory = V4L2_MEMORY_USERPTR;
 
-    if (-1 == xioctl(fd, VIDIOC_REQBUFS, &req))
+    if (-1 == xioctl(dev->fd, VIDIOC_REQBUFS, &req))
     {
         if (EINVAL == errno)
         {
             fprintf(stderr, "%s does not support "
-                    "user pointer i/o\n", dev_name);
+                    "user pointer i/o\n", dev->name);
             exit(EXIT_FAILURE);
         }
         else
@@ -578,21 +2103,20 @@ static void init_userp(unsigned int buffer_size)
         }
     }
 
-    buffers = calloc(4, sizeof(*buffers));
+    dev->buffers = calloc(num_buffers, sizeof(*dev->buffers));
 
-    if (!buffers)
+    if (!dev->buffers)
     {
         fprintf(stderr, "Out of memory\n");
         exit(EXIT_FAILURE);
     }
 
-    for (n_buffers = 0; n_buffers < 4; ++n_buffers)
+    for (dev->n_buffers = 0; dev->n_buffers < num_buffers; ++dev->n_buffers)
     {
-        buffers[n_buffers].length = buffer_size;
-        buffers[n_buffers].start = memalign( /* boundary */ page_size,
-                                            buffer_size);
+        dev->buffers[dev->n_buffers].length[0] = buffer_size;
+        dev->buffers[dev->n_buffers].start[0] = arena_alloc(buffer_size);
 
-        if (!buffers[n_buffers].start)
+        if (!dev->buffers[dev->n_buffers].start[0])
         {
             fprintf(stderr, "Out of memory\n");
             exit(EXIT_FAILURE);
@@ -600,19 +2124,101 @@ static void init_userp(unsigned int buffer_size)
     }
 }
 
-static void init_device(void)
+/* Index into formats[], or -1 if the format cannot be shown */
+static int find_format(uint32_t fourcc, unsigned int n_planes)
+{
+    unsigned int i;
+
+    for (i = 0; i < sizeof(formats) / sizeof(formats[0]); i++)
+        if (formats[i].pixelformat == fourcc &&
+            formats[i].n_planes == n_planes)
+            return i;
+
+    return -1;
+}
+
+/* Smallest bytesperline for width pixels of plane 0 */
+static size_t min_bytesperline(uint32_t fourcc, size_t width)
+{
+    return fourcc == V4L2_PIX_FMT_YUYV ? width * 2 : width;
+}
+
+/* Single plane image, 4:2:0 has its chroma below the luma */
+static uint64_t min_sizeimage(uint32_t fourcc, uint64_t bytesperline,
+                              uint64_t height)
+{
+    uint64_t size = bytesperline * height;
+
+    return fourcc == V4L2_PIX_FMT_YUYV ? size : size + size / 2;
+}
+
+/* Chroma row length of the single plane 4:2:0 formats */
+static size_t chroma_bytesperline(uint32_t fourcc, size_t bytesperline)
+{
+    return fourcc == V4L2_PIX_FMT_YUV420 ? bytesperline / 2 : bytesperline;
+}
+
+static void init_replay(struct device *dev)
+{
+    const struct record_header *h = &dev->replay.header;
+
+    if (find_format(h->pixelformat, 1) < 0 || is_mjpeg(h->pixelformat) ||
+        h->bytesperline < min_bytesperline(h->pixelformat, h->width))
+    {
+        fprintf(stderr, "%s is not a YUYV or 4:2:0 recording\n", dev->name);
+        exit(EXIT_FAILURE);
+    }
+
+    if (h->frame_size < min_sizeimage(h->pixelformat, h->bytesperline,
+                                      h->height))
+    {
+        fprintf(stderr, "%s has frames too small for %ux%u\n", dev->name,
+                h->width, h->height);
+        exit(EXIT_FAILURE);
+    }
+
+    if (!h->index_offset)
+        fprintf(stderr, "%s was not closed, replaying %llu frames at a "
+                "fixed rate\n", dev->name, (unsigned long long)h->frames);
+
+    if (replay_seek(&dev->replay, replay_start))
+    {
+        fprintf(stderr, "%s has only %llu frames\n", dev->name,
+                (unsigned long long)h->frames);
+        exit(EXIT_FAILURE);
+    }
+
+    dev->width = h->width;
+    dev->height = h->height;
+    dev->bytesperline = h->bytesperline;
+    dev->sizeimage = h->frame_size;
+    dev->pixelformat = h->pixelformat;
+    dev->chroma_bytesperline = chroma_bytesperline(h->pixelformat,
+                                                   h->bytesperline);
+    dev->buf_type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    dev->n_planes = 1;
+}
+
+static void init_device(struct device *dev)
 {
     struct v4l2_capability cap;
     struct v4l2_cropcap cropcap;
     struct v4l2_crop crop;
     struct v4l2_format fmt;
+    uint32_t caps;
     unsigned int min;
 
-    if (-1 == xioctl(fd, VIDIOC_QUERYCAP, &cap))
+    if (IO_METHOD_REPLAY == io)
+    {
+        init_replay(dev);
+        return;
+    }
+
+    if (-1 == xioctl(dev->fd, VIDIOC_QUERYCAP, &cap))
     {
         if (EINVAL == errno)
         {
-            fprintf(stderr, "%s is no V4L2 device\n", dev_name);
+            fprintf(stderr, "%s is no V4L2 device\n", dev->name);
             exit(EXIT_FAILURE);
         }
         else
@@ -621,9 +2227,28 @@ static void init_device(void)
         }
     }
 
-    if (!(cap.capabilities & V4L2_CAP_VIDEO_CAPTURE))
+    /* Those of this node rather than of the whole driver, if known */
+    caps = cap.capabilities & V4L2_CAP_DEVICE_CAPS ? cap.device_caps :
+        cap.capabilities;
+
+    if (caps & V4L2_CAP_VIDEO_CAPTURE)
+    {
+        dev->buf_type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    }
+    else if (caps & V4L2_CAP_VIDEO_CAPTURE_MPLANE)
+    {
+        dev->buf_type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+
+        if (io != IO_METHOD_MMAP)
+        {
+            fprintf(stderr, "%s is multi-planar, use mmap i/o\n",
+                    dev->name);
+            exit(EXIT_FAILURE);
+        }
+    }
+    else
     {
-        fprintf(stderr, "%s is no video capture device\n", dev_name);
+        fprintf(stderr, "%s is no video capture device\n", dev->name);
         exit(EXIT_FAILURE);
     }
 
@@ -632,7 +2257,7 @@ static void init_device(void)
     case IO_METHOD_READ:
         if (!(cap.capabilities & V4L2_CAP_READWRITE))
         {
-            fprintf(stderr, "%s does not support read i/o\n", dev_name);
+            fprintf(stderr, "%s does not support read i/o\n", dev->name);
             exit(EXIT_FAILURE);
         }
 
@@ -642,11 +2267,15 @@ static void init_device(void)
     case IO_METHOD_USERPTR:
         if (!(cap.capabilities & V4L2_CAP_STREAMING))
         {
-            fprintf(stderr, "%s does not support streaming i/o\n", dev_name);
+            fprintf(stderr, "%s does not support streaming i/o\n", dev->name);
             exit(EXIT_FAILURE);
         }
 
         break;
+
+    case IO_METHOD_REPLAY:
+        /* Handled by init_replay() */
+        break;
     }
 
 
@@ -657,12 +2286,12 @@ static void init_device(void)
 
     cropcap.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 
-    if (0 == xioctl(fd, VIDIOC_CROPCAP, &cropcap))
+    if (0 == xioctl(dev->fd, VIDIOC_CROPCAP, &cropcap))
     {
         crop.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
         crop.c = cropcap.defrect;   /* reset to default */
 
-        if (-1 == xioctl(fd, VIDIOC_S_CROP, &crop))
+        if (-1 == xioctl(dev->fd, VIDIOC_S_CROP, &crop))
         {
             switch (errno)
             {
@@ -683,78 +2312,142 @@ static void init_device(void)
 
     CLEAR(fmt);
 
-    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    fmt.fmt.pix.width = WIDTH;
-    fmt.fmt.pix.height = HEIGHT;
-    fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;
-    fmt.fmt.pix.field = V4L2_FIELD_INTERLACED;
+    fmt.type = dev->buf_type;
+
+    if (V4L2_TYPE_IS_MULTIPLANAR(fmt.type))
+    {
+        fmt.fmt.pix_mp.width = WIDTH;
+        fmt.fmt.pix_mp.height = HEIGHT;
+        fmt.fmt.pix_mp.pixelformat = pixelformat;
+        fmt.fmt.pix_mp.field = V4L2_FIELD_INTERLACED;
+    }
+    else
+    {
+        fmt.fmt.pix.width = WIDTH;
+        fmt.fmt.pix.height = HEIGHT;
+        fmt.fmt.pix.pixelformat = pixelformat;
+        fmt.fmt.pix.field = V4L2_FIELD_INTERLACED;
+    }
 
-    if (-1 == xioctl(fd, VIDIOC_S_FMT, &fmt))
+    if (-1 == xioctl(dev->fd, VIDIOC_S_FMT, &fmt))
         errno_exit("VIDIOC_S_FMT");
 
-    /* Note VIDIOC_S_FMT may change width and height. */
+    /* Note VIDIOC_S_FMT may change width, height and the format. */
+
+    if (V4L2_TYPE_IS_MULTIPLANAR(fmt.type))
+    {
+        struct v4l2_pix_format_mplane *mp = &fmt.fmt.pix_mp;
+
+        dev->width = mp->width;
+        dev->height = mp->height;
+        dev->pixelformat = mp->pixelformat;
+        dev->n_planes = mp->num_planes;
+        dev->bytesperline = mp->plane_fmt[0].bytesperline;
+        dev->sizeimage = mp->plane_fmt[0].sizeimage;
+        dev->chroma_bytesperline = mp->num_planes > 1 ?
+            mp->plane_fmt[1].bytesperline :
+            chroma_bytesperline(dev->pixelformat, dev->bytesperline);
+    }
+    else
+    {
+        dev->width = fmt.fmt.pix.width;
+        dev->height = fmt.fmt.pix.height;
+        dev->pixelformat = fmt.fmt.pix.pixelformat;
+        dev->n_planes = 1;
+        dev->bytesperline = fmt.fmt.pix.bytesperline;
+        dev->sizeimage = fmt.fmt.pix.sizeimage;
+    }
 
-    /* Buggy driver paranoia. */
-    min = fmt.fmt.pix.width * 2;
-    if (fmt.fmt.pix.bytesperline < min)
-        fmt.fmt.pix.bytesperline = min;
-    min = fmt.fmt.pix.bytesperline * fmt.fmt.pix.height;
-    if (fmt.fmt.pix.sizeimage < min)
-        fmt.fmt.pix.sizeimage = min;
+    if (find_format(dev->pixelformat, dev->n_planes) < 0)
+    {
+        fprintf(stderr, "%s offers %c%c%c%c, which cannot be shown\n",
+                dev->name, dev->pixelformat & 0xff,
+                (dev->pixelformat >> 8) & 0xff,
+                (dev->pixelformat >> 16) & 0xff, dev->pixelformat >> 24);
+        exit(EXIT_FAILURE);
+    }
 
-    if (fmt.fmt.pix.width != WIDTH)
-        WIDTH = fmt.fmt.pix.width;
+    /* Buggy driver paranoia. Compressed frames have no bytesperline. */
+    if (!is_mjpeg(dev->pixelformat))
+    {
+        min = min_bytesperline(dev->pixelformat, dev->width);
+        if (dev->bytesperline < min)
+            dev->bytesperline = min;
+        min = dev->n_planes > 1 ? dev->bytesperline * dev->height :
+            min_sizeimage(dev->pixelformat, dev->bytesperline, dev->height);
+        if (dev->sizeimage < min)
+            dev->sizeimage = min;
+    }
 
-    if (fmt.fmt.pix.height != HEIGHT)
-        HEIGHT = fmt.fmt.pix.height;
+    if (!V4L2_TYPE_IS_MULTIPLANAR(fmt.type))
+        dev->chroma_bytesperline = chroma_bytesperline(dev->pixelformat,
+                                                       dev->bytesperline);
 
     switch (io)
     {
     case IO_METHOD_READ:
-        init_read(fmt.fmt.pix.sizeimage);
+        init_read(dev, dev->sizeimage);
         break;
 
     case IO_METHOD_MMAP:
-        init_mmap();
+        init_mmap(dev);
         break;
 
     case IO_METHOD_USERPTR:
-        init_userp(fmt.fmt.pix.sizeimage);
+        init_userp(dev, dev->sizeimage);
+        break;
+
+    case IO_METHOD_REPLAY:
         break;
     }
 }
 
-static void close_device(void)
+static void close_device(struct device *dev)
 {
-    if (-1 == close(fd))
+    if (IO_METHOD_REPLAY == io)
+        replay_close(&dev->replay);
+    else if (-1 == close(dev->fd))
         errno_exit("close");
 
-    fd = -1;
+    dev->fd = -1;
 }
 
-static void open_device(void)
+static void open_device(struct device *dev)
 {
     struct stat st;
 
-    if (-1 == stat(dev_name, &st))
+    if (IO_METHOD_REPLAY == io)
+    {
+        if (replay_open(&dev->replay, dev->name, replay_paced))
+        {
+            fprintf(stderr, "Cannot replay '%s': %d, %s\n",
+                    dev->name, errno, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+
+        dev->fd = dev->replay.fd;
+        return;
+    }
+
+    if (-1 == stat(dev->name, &st))
     {
         fprintf(stderr, "Cannot identify '%s': %d, %s\n",
-                dev_name, errno, strerror(errno));
+                dev->name, errno, strerror(errno));
         exit(EXIT_FAILURE);
     }
 
     if (!S_ISCHR(st.st_mode))
     {
-        fprintf(stderr, "%s is no device\n", dev_name);
+        fprintf(stderr, "%s is no device\n", dev->name);
         exit(EXIT_FAILURE);
     }
 
-    fd = open(dev_name, O_RDWR /* required */  | O_NONBLOCK, 0);
+    dev->fd = open(dev->name, O_RDWR /* required */  | O_NONBLOCK, 0);
 
-    if (-1 == fd)
+    if (-1 == dev->fd)
     {
         fprintf(stderr, "Cannot open '%s': %d, %s\n",
-                dev_name, errno, strerror(errno));
+                dev->name, errno, strerror(errno));
         exit(EXIT_FAILURE);
     }
 }
@@ -764,24 +2457,75 @@ static void usage(FILE * fp, int argc, char **argv)
     fprintf(fp,
             "Usage: %s [options]\n\n"
             "Options:\n"
-            "-d | --device name   Video device name [/dev/video]\n"
+            "-a | --adaptive      Grow and shrink the buffer queue with the "
+            "load (mmap)\n"
+            "-b | --buffers num   Number of capture buffers [4]\n"
+            "-c | --changes       Only convert and update the parts of the "
+            "image that\n"
+            "                     changed (YUYV)\n"
+            "-d | --device name   Video device name [/dev/video0], repeat "
+            "to show\n"
+            "                     several devices side by side\n"
+            "-f | --fast          Replay as fast as possible, not at the "
+            "recorded rate\n"
+            "-F | --format name   Capture format: yuyv, nv12, nv21, yu12 or "
+            "mjpeg,\n"
+            "                     the driver may pick another of those "
+            "[yuyv]\n"
             "-h | --help          Print this message\n"
+            "-H | --headless      Capture and convert without a window, "
+            "SIGUSR1\n"
+            "                     prints the frame rate and CPU time\n"
+            "-j | --threads num   Conversion threads [number of CPUs]\n"
+            "-l | --latest        Only show the newest frame, requeue stale "
+            "ones\n"
             "-m | --mmap          Use memory mapped buffers\n"
+            "-M | --mlock         Lock frame buffers in memory\n"
+            "-o | --overlay       Display through a YUY2 overlay, no RGB "
+            "conversion\n"
+            "-p | --pipeline      Capture, convert and display on separate "
+            "threads\n"
+            "-P | --replay file   Play back a --record file instead of a "
+            "device,\n"
+            "                     repeat for several, -d names files then "
+            "too\n"
             "-r | --read          Use read() calls\n"
+            "-R | --record file   Write the raw frames to file (mmap)\n"
+            "-s | --stats sec     Print frame rate and latency every sec "
+            "seconds\n"
+            "-S | --seek frame    Start replaying at this frame number\n"
             "-u | --userp         Use application allocated buffers\n"
+            "-w | --window WxH    Largest window for several devices "
+            "[1920x1080]\n"
             "-x | --width         Video width\n"
             "-y | --height        Video height\n"
              "", argv[0]);
 }
 
-static const char short_options[] = "d:hmrux:y:";
+static const char short_options[] = "ab:cd:fF:hHj:lmMopP:rR:s:S:uw:x:y:";
 
 static const struct option long_options[] = {
+    {"adaptive", no_argument, NULL, 'a'},
+    {"buffers", required_argument, NULL, 'b'},
+    {"changes", no_argument, NULL, 'c'},
     {"device", required_argument, NULL, 'd'},
+    {"fast", no_argument, NULL, 'f'},
+    {"format", required_argument, NULL, 'F'},
     {"help", no_argument, NULL, 'h'},
+    {"headless", no_argument, NULL, 'H'},
+    {"threads", required_argument, NULL, 'j'},
+    {"latest", no_argument, NULL, 'l'},
     {"mmap", no_argument, NULL, 'm'},
+    {"mlock", no_argument, NULL, 'M'},
+    {"overlay", no_argument, NULL, 'o'},
+    {"pipeline", no_argument, NULL, 'p'},
+    {"replay", required_argument, NULL, 'P'},
     {"read", no_argument, NULL, 'r'},
+    {"record", required_argument, NULL, 'R'},
+    {"stats", required_argument, NULL, 's'},
+    {"seek", required_argument, NULL, 'S'},
     {"userp", no_argument, NULL, 'u'},
+    {"window", required_argument, NULL, 'w'},
     {"width", required_argument, NULL, 'x'},
     {"height", required_argument, NULL, 'y'},
     {0, 0, 0, 0}
@@ -792,11 +2536,50 @@ static int sdl_filter(const SDL_Event * event)
     return event->type == SDL_QUIT;
 }
 
-#define mask32(BYTE) (*(uint32_t *)(uint8_t [4]){ [BYTE] = 0xff })
+static void init_display(size_t screen_width, size_t screen_height)
+{
+    atexit(SDL_Quit);
+    if (SDL_Init(SDL_INIT_VIDEO) < 0)
+    {
+        fprintf(stderr, "Cannot initialize SDL: %s\n", SDL_GetError());
+        exit(EXIT_FAILURE);
+    }
+
+    SDL_WM_SetCaption("SDL Video viewer", NULL);
+
+    if (use_overlay)
+    {
+        SDL_Surface *screen = SDL_SetVideoMode(WIDTH, HEIGHT, 0,
+                                               SDL_HWSURFACE);
+
+        if (screen)
+            overlay = SDL_CreateYUVOverlay(WIDTH, HEIGHT, SDL_YUY2_OVERLAY,
+                                           screen);
+
+        if (!overlay)
+            fprintf(stderr, "Cannot create YUY2 overlay: %s, using RGB\n",
+                    SDL_GetError());
+        else if (pipelined)
+            fprintf(stderr, "Overlay display runs in the main loop, "
+                    "ignoring --pipeline\n");
+    }
+
+    if (!overlay)
+        SDL_SetVideoMode(screen_width, screen_height, 24, SDL_HWSURFACE);
+
+    data_sf = SDL_CreateRGBSurfaceFrom(buffer_sdl, screen_width,
+                                       screen_height, 24, screen_width * 3,
+                                       mask32(0), mask32(1), mask32(2), 0);
+
+    SDL_SetEventFilter(sdl_filter);
+}
 
 int main(int argc, char **argv)
 {
-    dev_name = "/dev/video0";
+    sigset_t signals;
+    size_t screen_width, screen_height;
+    int replaying = 0;
+    unsigned int i;
 
     for (;;)
     {
@@ -813,26 +2596,127 @@ int main(int argc, char **argv)
         case 0:                /* getopt_long() flag */
             break;
 
+        case 'a':
+            adaptive = 1;
+            break;
+
+        case 'b':
+            num_buffers = atoi(optarg);
+
+            if (num_buffers < 2 || num_buffers > MAX_BUFFERS)
+            {
+                fprintf(stderr, "Buffer count must be between 2 and %d\n",
+                        MAX_BUFFERS);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'c':
+            changes_only = 1;
+            break;
+
         case 'd':
-            dev_name = optarg;
+            if (n_devices == MAX_DEVICES)
+            {
+                fprintf(stderr, "At most %d devices are supported\n",
+                        MAX_DEVICES);
+                exit(EXIT_FAILURE);
+            }
+
+            devices[n_devices++].name = optarg;
+            break;
+
+        case 'f':
+            replay_paced = 0;
+            break;
+
+        case 'F':
+            for (i = 0; i < sizeof(formats) / sizeof(formats[0]); i++)
+                if (formats[i].n_planes == 1 &&
+                    !strcmp(formats[i].name, optarg))
+                    break;
+
+            if (i == sizeof(formats) / sizeof(formats[0]))
+            {
+                usage(stderr, argc, argv);
+                exit(EXIT_FAILURE);
+            }
+
+            pixelformat = formats[i].pixelformat;
             break;
 
         case 'h':
             usage(stdout, argc, argv);
             exit(EXIT_SUCCESS);
 
+        case 'H':
+            headless = 1;
+            break;
+
+        case 'j':
+            num_threads = atoi(optarg);
+            break;
+
+        case 'l':
+            latest_only = 1;
+            break;
+
         case 'm':
             io = IO_METHOD_MMAP;
             break;
 
+        case 'M':
+            arena_init(ARENA_MLOCK);
+            break;
+
+        case 'o':
+            use_overlay = 1;
+            break;
+
+        case 'p':
+            pipelined = 1;
+            break;
+
+        case 'P':
+            if (n_devices == MAX_DEVICES)
+            {
+                fprintf(stderr, "At most %d devices are supported\n",
+                        MAX_DEVICES);
+                exit(EXIT_FAILURE);
+            }
+
+            devices[n_devices++].name = optarg;
+            replaying = 1;
+            break;
+
         case 'r':
             io = IO_METHOD_READ;
             break;
 
+        case 'R':
+            record_path = optarg;
+            break;
+
+        case 's':
+            stats_interval = atoi(optarg);
+            break;
+
+        case 'S':
+            replay_start = strtoull(optarg, NULL, 0);
+            break;
+
         case 'u':
             io = IO_METHOD_USERPTR;
             break;
 
+        case 'w':
+            if (2 != sscanf(optarg, "%zux%zu", &window_width, &window_height))
+            {
+                usage(stderr, argc, argv);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
         case 'x':
             WIDTH = atoi(optarg);
             break;
@@ -847,36 +2731,226 @@ int main(int argc, char **argv)
         }
     }
 
-    generate_YCbCr_to_RGB_lookup();
+    if (!n_devices)
+        devices[n_devices++].name = "/dev/video0";
 
-    open_device();
-    init_device();
+    if (replaying)
+        io = IO_METHOD_REPLAY;
 
-    atexit(SDL_Quit);
-    if (SDL_Init(SDL_INIT_VIDEO) < 0)
-        return 1;
+    if (replaying && pipelined)
+    {
+        fprintf(stderr, "Replay runs in the main loop, ignoring "
+                "--pipeline\n");
+        pipelined = 0;
+    }
 
-    SDL_WM_SetCaption("SDL Video viewer", NULL);
+    if (adaptive && io != IO_METHOD_MMAP)
+    {
+        fprintf(stderr, "--adaptive needs mmap i/o, ignoring it\n");
+        adaptive = 0;
+    }
+
+    if (record_path && (io != IO_METHOD_MMAP || n_devices > 1))
+    {
+        fprintf(stderr, "--record needs mmap i/o and a single device\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (record_path && latest_only)
+    {
+        fprintf(stderr, "Every frame is recorded, ignoring --latest\n");
+        latest_only = 0;
+    }
+
+    if (record_path && pipelined)
+    {
+        fprintf(stderr, "Recording runs in the main loop, ignoring "
+                "--pipeline\n");
+        pipelined = 0;
+    }
 
-    buffer_sdl = (uint8_t*)malloc(WIDTH*HEIGHT*3);
+    /* Before any thread starts, so that all of them block the signals */
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGUSR1);
 
-    SDL_SetVideoMode(WIDTH, HEIGHT, 24, SDL_HWSURFACE);
+    if (reactor_init(&loop) ||
+        reactor_add_signals(&loop, &signal_source, &signals, on_signal, NULL))
+        errno_exit("reactor");
 
-    data_sf = SDL_CreateRGBSurfaceFrom(buffer_sdl, WIDTH, HEIGHT,
-                                       24, WIDTH * 3,
-                                       mask32(0), mask32(1), mask32(2), 0);
+    convert_init();
+    workers_init(num_threads);
 
-    SDL_SetEventFilter(sdl_filter);
+    for (i = 0; i < n_devices; i++)
+    {
+        open_device(&devices[i]);
+        init_device(&devices[i]);
+    }
+
+    for (i = 0; i < n_devices; i++)
+        if (is_mjpeg(devices[i].pixelformat) &&
+            (n_devices > 1 || io != IO_METHOD_MMAP || record_path))
+        {
+            fprintf(stderr, "MJPEG needs mmap i/o and a single device, "
+                    "and cannot be recorded\n");
+            exit(EXIT_FAILURE);
+        }
+
+    if (is_mjpeg(devices[0].pixelformat))
+    {
+        if (pipelined)
+            fprintf(stderr, "MJPEG is decoded on its own threads, ignoring "
+                    "--pipeline\n");
+
+        pipelined = 0;
+    }
+
+    if (n_devices > 1)
+    {
+        if (use_overlay || pipelined)
+            fprintf(stderr, "Several devices are shown as an RGB composite, "
+                    "ignoring --overlay and --pipeline\n");
+
+        use_overlay = 0;
+
+        layout_composite();
+
+        screen_width = grid_cols * tile_width;
+        screen_height = grid_rows * tile_height;
+    }
+    else
+    {
+        /* Note VIDIOC_S_FMT may change width and height. */
+        WIDTH = devices[0].width;
+        HEIGHT = devices[0].height;
+
+        buffer_sdl = arena_alloc(WIDTH * HEIGHT * 3);
+
+        if (!buffer_sdl)
+        {
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+
+        screen_width = WIDTH;
+        screen_height = HEIGHT;
+    }
+
+    if (headless && use_overlay)
+    {
+        fprintf(stderr, "Nothing is displayed, ignoring --overlay\n");
+        use_overlay = 0;
+    }
+
+    if (use_overlay && devices[0].pixelformat != V4L2_PIX_FMT_YUYV)
+    {
+        fprintf(stderr, "The overlay only takes YUYV, ignoring --overlay\n");
+        use_overlay = 0;
+    }
+
+    if (changes_only && (n_devices > 1 || use_overlay ||
+                         devices[0].pixelformat != V4L2_PIX_FMT_YUYV ||
+                         (pipelined && io != IO_METHOD_READ)))
+    {
+        fprintf(stderr, "--changes needs YUYV from one device and neither "
+                "--overlay nor --pipeline, ignoring it\n");
+        changes_only = 0;
+    }
+
+    if (changes_only)
+    {
+        if (dirty_init(&dirty, WIDTH, HEIGHT) ||
+            !(dirty_rects = calloc(dirty.cols * dirty.rows,
+                                   sizeof(*dirty_rects))))
+        {
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (!headless)
+        init_display(screen_width, screen_height);
+
+    if (record_path)
+        start_recording(&devices[0]);
+
+    if (is_mjpeg(devices[0].pixelformat))
+        start_decoding(&devices[0]);
+
+    for (i = 0; i < n_devices; i++)
+        start_capturing(&devices[i]);
+    clock_gettime(CLOCK_MONOTONIC, &display_start);
+    getrusage(RUSAGE_SELF, &usage_start);
+
+    if (stats_interval &&
+        reactor_add_timer(&loop, &stats_source, stats_interval * 1000,
+                          on_stats, NULL))
+        errno_exit("timerfd");
+
+    if (n_devices > 1)
+        composite_loop();
+    else if (pipelined && io != IO_METHOD_READ && !overlay)
+        pipeline_loop();
+    else
+        mainloop();
 
-    start_capturing();
-    mainloop();
-    stop_capturing();
+    if (stats_interval)
+        reactor_del(&loop, &stats_source);
 
-    uninit_device();
-    close_device();
+    if (record_path)
+        stop_recording();
 
-    SDL_FreeSurface(data_sf);
-    free(buffer_sdl);
+    if (is_mjpeg(devices[0].pixelformat))
+        stop_decoding();
+
+    for (i = 0; i < n_devices; i++)
+        stop_capturing(&devices[i]);
+
+    if (!headless)
+        print_fps();
+
+    print_throughput();
+
+    for (i = 0; i < n_devices; i++)
+        print_latency(&devices[i], 0);
+
+    if (changes_only)
+        fprintf(stderr, "%lu of %lu frames unchanged, %.1f%% of the tiles "
+                "converted\n", dirty.frames_static, dirty.frames,
+                dirty.frames ? 100.0 * dirty.tiles_changed /
+                ((double)dirty.frames * dirty.cols * dirty.rows) : 0.0);
+
+    for (i = 0; adaptive && i < n_devices; i++)
+        fprintf(stderr, "%s: queue depth %u buffers (grown %u, shrunk %u "
+                "times), %lu frames dropped by the driver\n",
+                devices[i].name, devices[i].queue_depth.target,
+                devices[i].queue_depth.grown, devices[i].queue_depth.shrunk,
+                devices[i].queue_depth.dropped);
+
+    for (i = 0; i < n_devices; i++)
+    {
+        uninit_device(&devices[i]);
+        close_device(&devices[i]);
+    }
+
+    workers_exit();
+
+    reactor_del(&loop, &signal_source);
+    reactor_free(&loop);
+
+    if (overlay)
+        SDL_FreeYUVOverlay(overlay);
+
+    if (data_sf)
+        SDL_FreeSurface(data_sf);
+    arena_free(buffer_sdl);
+
+    if (changes_only)
+    {
+        dirty_free(&dirty);
+        free(dirty_rects);
+    }
 
     exit(EXIT_SUCCESS);
 
@@ -0,0 +1,163 @@
+/*
+ * Copyright (C) 2012 by Tomasz Moń <desowin@gmail.com>
+ *
+ * Persistent worker pool splitting frames into horizontal stripes.
+ *
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright
+ * notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+ * OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name of a copyright holder shall not
+ * be used in advertising or otherwise to promote the sale, use or other dealings
+ * in this Software without prior written authorization of the copyright holder.
+ */
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "workers.h"
+
+struct worker
+{
+    pthread_t thread;
+    unsigned int index;
+};
+
+static struct worker *workers = NULL;
+static unsigned int n_workers = 1;
+
+/* Every job passes both barriers: start hands it out, done collects it */
+static pthread_barrier_t start_barrier;
+static pthread_barrier_t done_barrier;
+
+static stripe_fn job_fn;
+static void *job_arg;
+static size_t job_rows;
+static int job_quit;
+
+static void run_stripe(unsigned int index)
+{
+    size_t first = job_rows * index / n_workers;
+    size_t last = job_rows * (index + 1) / n_workers;
+
+    if (first < last)
+        job_fn(job_arg, first, last);
+}
+
+static void *worker_thread(void *arg)
+{
+    struct worker *w = arg;
+
+    for (;;)
+    {
+        pthread_barrier_wait(&start_barrier);
+
+        if (job_quit)
+            break;
+
+        run_stripe(w->index);
+
+        pthread_barrier_wait(&done_barrier);
+    }
+
+    return NULL;
+}
+
+void workers_init(unsigned int n)
+{
+    unsigned int i;
+
+    if (n == 0)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+        n = cpus > 0 ? cpus : 1;
+    }
+
+    n_workers = n;
+    job_quit = 0;
+
+    if (n_workers == 1)
+        return;
+
+    workers = calloc(n_workers, sizeof(*workers));
+
+    if (!workers)
+    {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_barrier_init(&start_barrier, NULL, n_workers);
+    pthread_barrier_init(&done_barrier, NULL, n_workers);
+
+    /* Stripe 0 belongs to the calling thread */
+    for (i = 1; i < n_workers; i++)
+    {
+        workers[i].index = i;
+
+        if (pthread_create(&workers[i].thread, NULL, worker_thread,
+                           &workers[i]))
+        {
+            fprintf(stderr, "Cannot create worker thread\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+void workers_exit(void)
+{
+    unsigned int i;
+
+    if (n_workers == 1)
+        return;
+
+    job_quit = 1;
+    pthread_barrier_wait(&start_barrier);
+
+    for (i = 1; i < n_workers; i++)
+        pthread_join(workers[i].thread, NULL);
+
+    pthread_barrier_destroy(&start_barrier);
+    pthread_barrier_destroy(&done_barrier);
+
+    free(workers);
+    workers = NULL;
+    n_workers = 1;
+}
+
+unsigned int workers_count(void)
+{
+    return n_workers;
+}
+
+void workers_run(stripe_fn fn, void *arg, size_t rows)
+{
+    job_fn = fn;
+    job_arg = arg;
+    job_rows = rows;
+
+    if (n_workers == 1)
+    {
+        run_stripe(0);
+        return;
+    }
+
+    pthread_barrier_wait(&start_barrier);
+    run_stripe(0);
+    pthread_barrier_wait(&done_barrier);
+}
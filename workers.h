@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2012 by Tomasz Moń <desowin@gmail.com>
+ *
+ * Persistent worker pool splitting frames into horizontal stripes.
+ *
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright
+ * notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+ * OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name of a copyright holder shall not
+ * be used in advertising or otherwise to promote the sale, use or other dealings
+ * in this Software without prior written authorization of the copyright holder.
+ */
+
+#ifndef WORKERS_H
+#define WORKERS_H
+
+#include <stddef.h>
+
+/* Processes rows [first, last) of the current job */
+typedef void (*stripe_fn) (void *arg, size_t first, size_t last);
+
+/*
+ * Starts n - 1 worker threads; the calling thread handles the first
+ * stripe itself. n = 0 picks the number of online CPUs.
+ */
+void workers_init(unsigned int n);
+
+/* Stops and joins the worker threads */
+void workers_exit(void);
+
+/* Number of stripes each job is split into */
+unsigned int workers_count(void);
+
+/*
+ * Runs fn over rows [0, rows) split into workers_count() stripes and
+ * returns once every stripe is done.
+ */
+void workers_run(stripe_fn fn, void *arg, size_t rows);
+
+#endif /* WORKERS_H */